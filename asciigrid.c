@@ -0,0 +1,397 @@
+/*
+**  asciigrid.c: Fast reader for ASCII grids (see asciigrid.h).
+**
+**  Reading a big ASCII grid one fscanf at a time spends nearly all of its
+**  time in the C library. Instead, the file is mapped into memory and the
+**  numbers are picked out by hand. The header may be either the ARC/INFO
+**  kind, a list of "keyword value" lines in any order, or the D. Tarboton
+**  kind, which is just the four numbers "ncols nrows dx dy". The body is
+**  cut into pieces at line breaks and the pieces are parsed on separate
+**  threads: a first pass counts the values in each piece, so that each
+**  thread knows which cell its first value belongs to, and a second pass
+**  converts the values and stores them straight into the grid.
+**
+**  As in the original readers, values are listed a row at a time starting
+**  from the top (north) of the grid, so the value in row r and column c of
+**  the file goes into cell (c, nrows-1-r).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "asciigrid.h"
+
+#define IsSpace(c) ((c)==' ' || (c)=='\n' || (c)=='\r' || (c)=='\t')
+
+/* Powers of ten that are exact in a double (and, up to 1e10, in a float) */
+static const double Pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+typedef struct
+{
+  AsciiGrid *f;
+  Grid *g;
+  int isfloat;
+  char *lo, *hi;        /* The piece of the file to parse */
+  GridIndex first;      /* Number of values before this piece */
+  GridIndex count;      /* Number of values in this piece */
+} AsciiChunk;
+
+
+/*
+** ScanInt: converts the integer starting at *p, which must be followed by
+** white space or the end of the file. Returns a pointer just past it, or
+** NULL if it isn't an integer.
+*/
+static char *ScanInt( char *p, char *end, long long *value )
+{
+  long long v = 0;
+  int neg = 0;
+  char *start;
+
+  if( p<end && (*p=='-' || *p=='+') ) neg = (*p++=='-');
+  start = p;
+  while( p<end && *p>='0' && *p<='9' && p-start<18 )
+    v = v*10 + (*p++ - '0');
+  if( p==start || (p<end && !IsSpace(*p)) ) return NULL;
+  *value = neg ? -v : v;
+  return p;
+}
+
+
+/*
+** ScanFloat: converts the floating point number starting at *p; exponents
+** may be written with e, E, d or D. Short numbers, which is to say nearly
+** all of them, are converted exactly with one multiply or divide by a
+** power of ten, in float or double arithmetic to suit the result (so the
+** result is what strtof or strtod would give); anything else is handed to
+** strtof or strtod. Returns a pointer just past the number, or NULL.
+*/
+char *ScanFloat( char *p, char *end, int isdouble, double *value )
+{
+  unsigned long long mant = 0;
+  int neg = 0, ndig = 0, exp10 = 0, e = 0, eneg = 0, any = 0;
+  char *start = p, buf[64];
+  size_t n;
+
+  if( p<end && (*p=='-' || *p=='+') ) neg = (*p++=='-');
+  for( ; p<end && *p>='0' && *p<='9'; p++, any=1 )
+    if( ndig<19 ) { if( mant>0 || *p>'0' ) ndig++; mant = mant*10 + (*p-'0'); }
+    else exp10++;
+  if( p<end && *p=='.' )
+    for( p++; p<end && *p>='0' && *p<='9'; p++, any=1 )
+      if( ndig<19 )
+      {
+        if( mant>0 || *p>'0' ) ndig++;
+        mant = mant*10 + (*p-'0');
+        exp10--;
+      }
+  if( !any ) return NULL;
+  if( p<end && (*p=='e' || *p=='E' || *p=='d' || *p=='D') )
+  {
+    p++;
+    if( p<end && (*p=='-' || *p=='+') ) eneg = (*p++=='-');
+    if( p==end || *p<'0' || *p>'9' ) return NULL;
+    while( p<end && *p>='0' && *p<='9' )
+      if( (e = e*10 + (*p++ - '0'))>100000 ) e = 100000;
+    exp10 += eneg ? -e : e;
+  }
+  if( p<end && !IsSpace(*p) ) return NULL;
+
+  if( mant==0 ) *value = 0.0;
+  else if( !isdouble && ndig<=7 && exp10>=-10 && exp10<=10 )
+  {
+    float fv = (float)mant;
+    if( exp10<0 ) fv = fv / (float)Pow10[-exp10];
+    else fv = fv * (float)Pow10[exp10];
+    *value = fv;
+  }
+  else if( isdouble && ndig<=15 && exp10>=-22 && exp10<=22 )
+    *value = exp10<0 ? (double)mant / Pow10[-exp10]
+                     : (double)mant * Pow10[exp10];
+  else
+  {
+    /* Let the C library sort out the awkward cases */
+    n = p - start;
+    if( n>=sizeof( buf ) ) n = sizeof( buf ) - 1;
+    memcpy( buf, start, n );
+    buf[n] = '\0';
+    for( n=0; buf[n]; n++ ) if( buf[n]=='d' || buf[n]=='D' ) buf[n] = 'e';
+    *value = isdouble ? strtod( buf, NULL ) : strtof( buf, NULL );
+    return p;
+  }
+  if( neg ) *value = -*value;
+  return p;
+}
+
+
+static char *SkipSpace( char *p, char *end )
+{
+  while( p<end && IsSpace(*p) ) p++;
+  return p;
+}
+
+
+static void BadHeader( AsciiGrid *f, char *p )
+{
+  printf("I can't make sense of the header of '%s' near '%.20s'\n",
+         f->name, p );
+  exit(1);
+}
+
+
+/*
+** ReadHeader: fills in the header fields of |f| and finds the start of
+** the data.
+*/
+static void ReadHeader( AsciiGrid *f )
+{
+  char *p = f->map, *end = f->map + f->size, *q, key[32];
+  double v[4];
+  size_t n;
+  int i;
+
+  p = SkipSpace( p, end );
+  if( p<end && isalpha( (unsigned char)*p ) )
+  {
+    /* ARC/INFO: keyword and value pairs, until the first number */
+    f->ncols = f->nrows = -1;
+    while( p<end && isalpha( (unsigned char)*p ) )
+    {
+      for( q=p; q<end && !IsSpace(*q); q++ ) ;
+      n = (size_t)(q-p) < sizeof( key ) ? (size_t)(q-p) : sizeof( key )-1;
+      for( i=0; i<(int)n; i++ ) key[i] = tolower( (unsigned char)p[i] );
+      key[n] = '\0';
+      p = SkipSpace( q, end );
+      if( (q = ScanFloat( p, end, 1, &v[0] ))==NULL ) BadHeader( f, p );
+      if( strcmp( key, "ncols" )==0 ) f->ncols = (long)v[0];
+      else if( strcmp( key, "nrows" )==0 ) f->nrows = (long)v[0];
+      else if( strncmp( key, "xll", 3 )==0 ) f->xllcorner = v[0];
+      else if( strncmp( key, "yll", 3 )==0 ) f->yllcorner = v[0];
+      else if( strcmp( key, "cellsize" )==0 ) f->cellsize = v[0];
+      else if( strcmp( key, "nodata_value" )==0 )
+      {
+        f->nodata = v[0];
+        f->hasnodata = 1;
+      }
+      p = SkipSpace( q, end );
+    }
+  }
+  else
+  {
+    /* Tarboton: ncols nrows dx dy */
+    for( i=0; i<4; i++ )
+    {
+      if( (q = ScanFloat( p, end, 1, &v[i] ))==NULL ) BadHeader( f, p );
+      p = SkipSpace( q, end );
+    }
+    f->ncols = (long)v[0];
+    f->nrows = (long)v[1];
+    f->cellsize = v[2];
+  }
+  if( f->ncols<1 || f->nrows<1 ) BadHeader( f, f->map );
+  f->body = p - f->map;
+}
+
+
+/*
+** OpenAsciiGrid: maps the file into memory and reads its header. Quits
+** with a message if the file can't be found or read.
+*/
+AsciiGrid *OpenAsciiGrid( char *filename )
+{
+  AsciiGrid *f;
+  struct stat st;
+  int fd;
+
+  if( (fd = open( filename, O_RDONLY ))<0 || fstat( fd, &st )!=0 )
+  {
+    printf("Unable to find '%s'\n", filename );
+    exit( 0 );
+  }
+  f = (AsciiGrid *)calloc( 1, sizeof( AsciiGrid ) );
+  f->name = filename;
+  f->size = st.st_size;
+  if( f->size==0 ) BadHeader( f, "" );
+  f->map = (char *)mmap( NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( f->map==MAP_FAILED )
+  {
+    printf("Unable to read '%s'\n", filename );
+    exit( 1 );
+  }
+  madvise( f->map, f->size, MADV_SEQUENTIAL );
+  ReadHeader( f );
+
+  return f;
+}
+
+
+void CloseAsciiGrid( AsciiGrid *f )
+{
+  munmap( f->map, f->size );
+  free( f );
+}
+
+
+static void *CountValues( void *arg )
+{
+  AsciiChunk *c = (AsciiChunk *)arg;
+  char *p = c->lo;
+
+  c->count = 0;
+  for( ;; )
+  {
+    while( p<c->hi && IsSpace(*p) ) p++;
+    if( p==c->hi ) break;
+    c->count++;
+    while( p<c->hi && !IsSpace(*p) ) p++;
+  }
+  return NULL;
+}
+
+
+static void *StoreValues( void *arg )
+{
+  AsciiChunk *c = (AsciiChunk *)arg;
+  AsciiGrid *f = c->f;
+  Grid *g = c->g;
+  char *p = c->lo, *q, *data = (char *)g->data;
+  GridIndex v = c->first, nvalues = (GridIndex)f->ncols*f->nrows, k;
+  long row, col;
+  long long iv;
+  double fv;
+
+  row = v / f->ncols;
+  col = v % f->ncols;
+  for( ; v<nvalues; v++ )
+  {
+    p = SkipSpace( p, c->hi );
+    if( p==c->hi ) break;
+    k = GIDX(g,col,f->nrows-1-row);
+    if( c->isfloat )
+    {
+      if( (q = ScanFloat( p, c->hi, g->elsize==sizeof( double ), &fv ))==NULL )
+        break;
+      if( g->elsize==sizeof( double ) ) ((double *)data)[k] = fv;
+      else ((float *)data)[k] = (float)fv;
+    }
+    else
+    {
+      if( (q = ScanInt( p, c->hi, &iv ))==NULL ) break;
+      switch( g->elsize )
+      {
+        case 1: ((signed char *)data)[k] = (signed char)iv; break;
+        case 2: ((short *)data)[k] = (short)iv; break;
+        case 4: ((int *)data)[k] = (int)iv; break;
+        default: ((long long *)data)[k] = iv;
+      }
+    }
+    p = q;
+    if( ++col==f->ncols ) { col = 0; row++; }
+  }
+  if( v<nvalues && p<c->hi )
+  {
+    for( q=p; q<c->hi && !IsSpace(*q) && q-p<20; q++ ) ;
+    printf("Bad value '%.*s' in '%s'\n", (int)(q-p), p, f->name );
+    exit(1);
+  }
+  return NULL;
+}
+
+
+/*
+** RunChunks: runs |work| on each of the |n| chunks, one thread apiece.
+*/
+static void RunChunks( AsciiChunk *c, int n, void *(*work)( void * ) )
+{
+  pthread_t *thread;
+  int t;
+
+  if( n==1 ) { work( c ); return; }
+  thread = (pthread_t *)malloc( n*sizeof( pthread_t ) );
+  for( t=0; t<n; t++ )
+    if( pthread_create( &thread[t], NULL, work, &c[t] )!=0 )
+    {
+      printf("Unable to start thread %d\n", t );
+      exit(1);
+    }
+  for( t=0; t<n; t++ ) pthread_join( thread[t], NULL );
+  free( thread );
+}
+
+
+static void ReadValues( AsciiGrid *f, Grid *g, int nthreads, int isfloat )
+{
+  AsciiChunk *c;
+  char *body = f->map + f->body, *end = f->map + f->size, *p;
+  GridIndex total = 0;
+  int t;
+
+  if( g->nx!=f->ncols || g->ny!=f->nrows )
+  {
+    printf("'%s' is %ld by %ld, but the grid is %ld by %ld\n",
+           f->name, f->ncols, f->nrows, g->nx, g->ny );
+    exit(1);
+  }
+  if( nthreads<1 ) nthreads = 1;
+  if( (size_t)(end-body) < (size_t)nthreads*65536 )
+    nthreads = 1 + (end-body)/65536;
+
+  /* Cut the body into pieces at line breaks */
+  c = (AsciiChunk *)calloc( nthreads, sizeof( AsciiChunk ) );
+  for( t=0; t<nthreads; t++ )
+  {
+    c[t].f = f;
+    c[t].g = g;
+    c[t].isfloat = isfloat;
+    c[t].lo = t==0 ? body : c[t-1].hi;
+    p = body + (end-body)*(t+1)/nthreads;
+    if( p<c[t].lo ) p = c[t].lo;
+    while( p<end && *p!='\n' ) p++;
+    c[t].hi = p<end ? p+1 : end;
+  }
+  if( nthreads>1 ) madvise( f->map, f->size, MADV_WILLNEED );
+
+  RunChunks( c, nthreads, CountValues );
+  for( t=0; t<nthreads; t++ )
+  {
+    c[t].first = total;
+    total += c[t].count;
+  }
+  if( total < (GridIndex)f->ncols*f->nrows )
+  {
+    printf("'%s' has only %lld of its %ld by %ld values\n",
+           f->name, total, f->ncols, f->nrows );
+    exit(1);
+  }
+  RunChunks( c, nthreads, StoreValues );
+  free( c );
+}
+
+
+/*
+** ReadAsciiInts: reads the body of |f| into |g|, whose cells may be 1, 2,
+** 4 or 8 byte integers. |g| must have the dimensions given in the header.
+*/
+void ReadAsciiInts( AsciiGrid *f, Grid *g, int nthreads )
+{
+  ReadValues( f, g, nthreads, 0 );
+}
+
+
+/*
+** ReadAsciiFloats: reads the body of |f| into |g|, whose cells may be
+** floats or doubles.
+*/
+void ReadAsciiFloats( AsciiGrid *f, Grid *g, int nthreads )
+{
+  ReadValues( f, g, nthreads, 1 );
+}
@@ -0,0 +1,30 @@
+/*
+**  asciigrid.h: Fast reader for ASCII grids in ARC/INFO or D. Tarboton
+**               format.
+*/
+
+#ifndef ASCIIGRID_H
+#define ASCIIGRID_H
+
+#include <stddef.h>
+#include "demgrid.h"
+
+typedef struct
+{
+  char *name;           /* File name, for error messages */
+  long ncols, nrows;
+  double xllcorner, yllcorner, cellsize;
+  double nodata;        /* NODATA_value, if the header gives one */
+  int hasnodata;
+  char *map;            /* The whole file, mapped into memory */
+  size_t size;          /* Length of the file in bytes */
+  size_t body;          /* Offset of the first data value */
+} AsciiGrid;
+
+AsciiGrid *OpenAsciiGrid( char *filename );
+void CloseAsciiGrid( AsciiGrid *f );
+void ReadAsciiInts( AsciiGrid *f, Grid *g, int nthreads );
+void ReadAsciiFloats( AsciiGrid *f, Grid *g, int nthreads );
+char *ScanFloat( char *p, char *end, int isdouble, double *value );
+
+#endif
@@ -0,0 +1,195 @@
+/*
+**  asciiout.c: Fast writer for ASCII grids (see asciiout.h).
+**
+**  Writing a big grid with a fprintf per cell spends nearly all of its
+**  time in the C library working out the format. Instead, the numbers are
+**  turned into digits by hand, two at a time from a table, into a large
+**  buffer, and the buffer goes to the file in one write. FormatLong gives
+**  the same characters as printf's "%ld".
+**
+**  The rows are cut into blocks of about BlockBytes of text, and with
+**  several threads each thread formats every nth block into a buffer of
+**  its own. The threads take turns to write, in order of block, so each
+**  can format its next block while another writes. The memory used is
+**  one block per thread, however big the grid.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "asciiout.h"
+
+#define BlockBytes 4194304  /* Text formatted between writes, per thread */
+
+static const char Digits2[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233"
+  "34353637383940414243444546474849505152535455565758596061626364656667"
+  "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* The rows to write, and whose turn it is to write them */
+typedef struct
+{
+  AsciiRowFormat format;
+  void *arg;
+  long nrows, blockrows, nblocks;
+  size_t rowmax;
+  int fd, nthreads;
+  long next;                  /* The next block to be written */
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+} AsciiRows;
+
+typedef struct
+{
+  AsciiRows *w;
+  int t;
+} AsciiThread;
+
+
+/*
+** PutDigits: writes the digits of |u| at |p|, and returns a pointer just
+** past them.
+*/
+static char *PutDigits( char *p, unsigned long long u )
+{
+  char tmp[24], *q = tmp + sizeof( tmp );
+  size_t n;
+
+  while( u>=100 )
+  {
+    q -= 2;
+    memcpy( q, Digits2 + 2*(u%100), 2 );
+    u /= 100;
+  }
+  if( u>=10 )
+  {
+    q -= 2;
+    memcpy( q, Digits2 + 2*u, 2 );
+  }
+  else *--q = (char)('0' + u);
+  n = tmp + sizeof( tmp ) - q;
+  memcpy( p, q, n );
+  return p + n;
+}
+
+
+/*
+** FormatLong: writes |v| at |p| as printf's "%ld" would, and returns a
+** pointer just past it.
+*/
+char *FormatLong( char *p, long v )
+{
+  *p = '-';
+  p += v<0;
+  return PutDigits( p, v<0 ? 0ULL - (unsigned long long)v
+                           : (unsigned long long)v );
+}
+
+
+/*
+** WriteAll: writes |n| bytes to |fd|, however many writes that takes.
+*/
+static void WriteAll( int fd, char *buf, size_t n )
+{
+  ssize_t k;
+
+  while( n>0 )
+  {
+    if( (k = write( fd, buf, n ))<=0 )
+    {
+      printf("Unable to write the output file\n");
+      exit(1);
+    }
+    buf += k;
+    n -= k;
+  }
+}
+
+
+static void *WriteBlocks( void *arg )
+{
+  AsciiThread *at = (AsciiThread *)arg;
+  AsciiRows *w = at->w;
+  char *buf, *p;
+  long b, r, last;
+
+  if( (buf = (char *)malloc( w->blockrows*w->rowmax ))==NULL )
+  {
+    printf("Unable to allocate an output buffer\n");
+    exit(1);
+  }
+  for( b=at->t; b<w->nblocks; b+=w->nthreads )
+  {
+    p = buf;
+    last = (b+1)*w->blockrows < w->nrows ? (b+1)*w->blockrows : w->nrows;
+    for( r=b*w->blockrows; r<last; r++ )
+      p = w->format( w->arg, r, p );
+
+    pthread_mutex_lock( &w->lock );
+    while( w->next!=b ) pthread_cond_wait( &w->turn, &w->lock );
+    pthread_mutex_unlock( &w->lock );
+    WriteAll( w->fd, buf, p-buf );
+    pthread_mutex_lock( &w->lock );
+    w->next++;
+    pthread_cond_broadcast( &w->turn );
+    pthread_mutex_unlock( &w->lock );
+  }
+  free( buf );
+  return NULL;
+}
+
+
+/*
+** WriteAsciiRows: writes |nrows| rows of text to |fp|, after anything
+** already written to it, each row formatted by |format|. Rows are
+** formatted on |nthreads| threads, and written in order.
+*/
+void WriteAsciiRows( FILE *fp, long nrows, size_t rowmax,
+                     AsciiRowFormat format, void *arg, int nthreads )
+{
+  AsciiRows w;
+  AsciiThread *at;
+  pthread_t *thread;
+  int t;
+
+  if( nrows<1 ) return;
+  fflush( fp );
+  w.format = format;
+  w.arg = arg;
+  w.nrows = nrows;
+  w.rowmax = rowmax;
+  w.blockrows = rowmax<BlockBytes ? BlockBytes/rowmax : 1;
+  w.nblocks = (nrows + w.blockrows - 1)/w.blockrows;
+  w.fd = fileno( fp );
+  w.next = 0;
+  if( nthreads<1 ) nthreads = 1;
+  if( nthreads>w.nblocks ) nthreads = (int)w.nblocks;
+  w.nthreads = nthreads;
+  pthread_mutex_init( &w.lock, NULL );
+  pthread_cond_init( &w.turn, NULL );
+
+  at = (AsciiThread *)malloc( nthreads*sizeof( AsciiThread ) );
+  for( t=0; t<nthreads; t++ )
+  {
+    at[t].w = &w;
+    at[t].t = t;
+  }
+  if( nthreads==1 ) WriteBlocks( &at[0] );
+  else
+  {
+    thread = (pthread_t *)malloc( nthreads*sizeof( pthread_t ) );
+    for( t=0; t<nthreads; t++ )
+      if( pthread_create( &thread[t], NULL, WriteBlocks, &at[t] )!=0 )
+      {
+        printf("Unable to start thread %d\n", t );
+        exit(1);
+      }
+    for( t=0; t<nthreads; t++ ) pthread_join( thread[t], NULL );
+    free( thread );
+  }
+  free( at );
+  pthread_mutex_destroy( &w.lock );
+  pthread_cond_destroy( &w.turn );
+}
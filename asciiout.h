@@ -0,0 +1,20 @@
+/*
+**  asciiout.h: Fast writer for ASCII grids and other text output, a block
+**              of rows at a time on several threads.
+*/
+
+#ifndef ASCIIOUT_H
+#define ASCIIOUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Formats row |row| of the output at |p|, and returns a pointer just past
+   it; a row may be at most the |rowmax| given to WriteAsciiRows */
+typedef char *(*AsciiRowFormat)( void *arg, long row, char *p );
+
+char *FormatLong( char *p, long v );
+void WriteAsciiRows( FILE *fp, long nrows, size_t rowmax,
+                     AsciiRowFormat format, void *arg, int nthreads );
+
+#endif
@@ -0,0 +1,207 @@
+/*
+**  baslen.c: Finds the length of the basin above every cell of a D8 flow
+**            network in one pass over the grid (see baslen.h).
+**
+**  The length of a cell's basin is the greatest straight-line distance
+**  from the cell to any cell that drains to it, plus one, as measured by
+**  basinlength and basinlen2. The farthest point of a set from any given
+**  point is a corner of the set's convex hull, so a cell need only know
+**  the hull of the centers of the cells above it, and that hull is the
+**  hull of its own center and of its donors' hulls. The cells are taken
+**  in topological order (D8Topological): a cell's hull is built once
+**  all its donors have handed theirs in, measured, passed on to its
+**  receiver and freed. Each cell is visited once, and a hull of cells on
+**  a grid has few corners (of the order of the cube root of its area
+**  squared), so the work is close to proportional to the number of
+**  cells. Distances are compared as exact integer squares, and only the
+**  greatest is passed to sqrt, so the lengths are the same, bit for bit,
+**  as those found by tracing every path.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "baslen.h"
+#include "d8walk.h"
+
+
+typedef struct
+{
+  int x, y;
+} Point;
+
+typedef struct
+{
+  int n, size;
+  Point pt[1];      /* Really |size| of them */
+} Hull;
+
+
+/*
+** AddPoints: appends |n| points to the list |*h|, making room as needed.
+*/
+static void AddPoints( Hull **h, Point *pt, int n )
+{
+  int have = *h ? (*h)->n : 0, size = *h ? (*h)->size : 0;
+
+  if( have+n > size )
+  {
+    while( size < have+n ) size = size ? 2*size : 8;
+    if( (*h = (Hull *)realloc( *h,
+                 sizeof( Hull ) + (size-1)*sizeof( Point ) ))==NULL )
+    {
+      printf("Unable to allocate basin outlines\n");
+      exit(1);
+    }
+    (*h)->n = have;
+    (*h)->size = size;
+  }
+  while( n-- > 0 ) (*h)->pt[(*h)->n++] = *pt++;
+}
+
+
+static int ComparePoints( const void *a, const void *b )
+{
+  const Point *p = (const Point *)a, *q = (const Point *)b;
+
+  if( p->x!=q->x ) return p->x < q->x ? -1 : 1;
+  return p->y < q->y ? -1 : p->y > q->y;
+}
+
+static long long Cross( Point o, Point a, Point b )
+{
+  return (long long)(a.x-o.x)*(b.y-o.y) - (long long)(a.y-o.y)*(b.x-o.x);
+}
+
+
+/*
+** MakeHull: replaces the points of |h| with the corners of their convex
+** hull (Andrew's monotone chain), dropping repeats and points on edges.
+*/
+static void MakeHull( Hull *h )
+{
+  Point *pt = h->pt, *out;
+  int i, n = 0, lower;
+
+  qsort( pt, h->n, sizeof( Point ), ComparePoints );
+  if( h->n<3 )
+  {
+    if( h->n==2 && pt[0].x==pt[1].x && pt[0].y==pt[1].y ) h->n = 1;
+    return;
+  }
+  if( (out = (Point *)malloc( 2*h->n*sizeof( Point ) ))==NULL )
+  {
+    printf("Unable to allocate basin outlines\n");
+    exit(1);
+  }
+  for( i=0; i<h->n; i++ )
+  {
+    while( n>=2 && Cross( out[n-2], out[n-1], pt[i] )<=0 ) n--;
+    out[n++] = pt[i];
+  }
+  for( i=h->n-2, lower=n+1; i>=0; i-- )
+  {
+    while( n>=lower && Cross( out[n-2], out[n-1], pt[i] )<=0 ) n--;
+    out[n++] = pt[i];
+  }
+  n--;                        /* The first point came round again */
+  if( n<1 ) n = 1;
+  for( i=0; i<n; i++ ) pt[i] = out[i];
+  h->n = n;
+  free( out );
+}
+
+
+/* What MeasureCell needs to know */
+typedef struct
+{
+  Grid *dir;
+  Hull **hull;      /* Outline of the sources above each pending cell */
+  double *len;
+  int interior;
+} Lengths;
+
+
+/*
+** MeasureCell: the D8Topological visitor. Adds the cell to the outline
+** its donors have handed in, if it is a source, measures the basin from
+** the corners, and hands the outline on to the receiver.
+*/
+static void MeasureCell( GridIndex k, long p, long q, GridIndex r,
+                         void *arg )
+{
+  Lengths *b = (Lengths *)arg;
+  Hull *h;
+  Point self;
+  long long d2, maxd2;
+  int n;
+
+  if( !b->interior || (p>0 && q>0 && p<b->dir->nx-1 && q<b->dir->ny-1) )
+  {
+    self.x = p;
+    self.y = q;
+    AddPoints( &b->hull[k], &self, 1 );
+  }
+  b->len[k] = 0;
+  if( (h = b->hull[k])==NULL ) return;
+  MakeHull( h );
+  for( n=0, maxd2=0; n<h->n; n++ )
+  {
+    d2 = (long long)(h->pt[n].x-p)*(h->pt[n].x-p)
+         + (long long)(h->pt[n].y-q)*(h->pt[n].y-q);
+    if( d2>maxd2 ) maxd2 = d2;
+  }
+  b->len[k] = sqrt( (double)maxd2 ) + 1;
+  if( r>=0 ) AddPoints( &b->hull[r], h->pt, h->n );
+  free( h );
+  b->hull[k] = NULL;
+}
+
+
+/*
+** BasinLengths: on return |len| (a double grid the size of |dir|) holds
+** the basin length of every cell: the greatest distance from the cell to
+** a source cell that drains to it (itself included), plus one, or zero if
+** no source cell drains to it. Every cell is a source if |interior| is
+** zero, as in basinlength; only those not on the edge of the grid are if
+** it is nonzero, as in basinlen2. |dir| holds one-byte D8 codes; a cell
+** drains to another only if its code points to a cell of the grid.
+** Cells on a loop in the flow directions can't be measured: those that
+** have sources above them are set to -1 and counted, and the count is
+** returned.
+*/
+long BasinLengths( Grid *dir, Grid *len, int interior )
+{
+  Lengths b;
+  double unvisited = -1;
+  long i, j, nleft;
+  GridIndex k;
+
+  b.dir = dir;
+  b.len = (double *)len->data;
+  b.interior = interior;
+  if( (b.hull = (Hull **)calloc( dir->ncells, sizeof( Hull * ) ))==NULL )
+  {
+    printf("Unable to allocate basin outlines\n");
+    exit(1);
+  }
+  FillGrid( len, &unvisited );
+  D8Topological( dir, MeasureCell, &b );
+
+  /* Whatever is left is on a loop */
+  nleft = 0;
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+    {
+      k = GIDX(dir,i,j);
+      if( b.len[k]>=0 ) continue;
+      if( b.hull[k]!=NULL
+          || !interior || (i>0 && j>0 && i<dir->nx-1 && j<dir->ny-1) )
+        nleft++;
+      else b.len[k] = 0;
+      free( b.hull[k] );
+    }
+
+  free( b.hull );
+  return nleft;
+}
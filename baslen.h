@@ -0,0 +1,12 @@
+/*
+**  baslen.h: Basin lengths in one pass over a D8 flow network.
+*/
+
+#ifndef BASLEN_H
+#define BASLEN_H
+
+#include "demgrid.h"
+
+long BasinLengths( Grid *dir, Grid *len, int interior );
+
+#endif
@@ -3,21 +3,24 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include "demgrid.h"
+#include "asciigrid.h"
+#include "d8dir.h"
+#include "baslen.h"
 
-#define NColumns 1765
-#define NRows 609
 
+/* Both grids are NColumns by NRows, as given in the flow dir file; the
+   flow directions are one-byte ArcInfo codes (see d8dir.h) */
+#define DIR(i,j) GCELL(dir,unsigned char,i,j)
+#define BASLEN(i,j) GCELL(baslen,double,i,j)
 
-struct CellCoord        /* Structure stores the coords of a cell */
-{
-        int x;
-        int y;
-};
-
-struct CellCoord nbr[NColumns][NRows];
+long NColumns, NRows;
+Grid *dir;
 int NoDataValue;
-double baslen[NColumns][NRows];
+int nthreads;        /* Threads to read with (--threads N) */
+Grid *baslen;
 
 
 
@@ -29,133 +32,23 @@ char *basename;
 }
 
 
-int ReadHeaderLine( fp )
-FILE *fp;
-{
-        int i;
-
-        /* Read the text part and discard */
-        for( i=1; i<=14; i++ )
-                fgetc( fp );
-
-        /* Read the integer */
-        fscanf( fp, "%d", &i );
-
-        /* Read the line feed character */
-        fgetc( fp );
-
-        return( i );
-}
-
-
 void ReadFlowDirFile( filename )
 char *filename;
 {
-  FILE *fp;
-  int i,j,jj,nrows,ncols,tmp;
-  short temparr[NColumns][NRows];
-  char tempstr[80];
-
-  if( (fp=fopen( filename, "r" ))==NULL ) {
-    printf("Unable to find '%s'\n", filename );
-    exit( 0 );
-  }
-
-  /* Read the header (ARC/INFO ascii format is assumed) */
-  ncols = ReadHeaderLine( fp );
-  nrows = ReadHeaderLine( fp );
-  fgets( tempstr, 80, fp );
-  fgets( tempstr, 80, fp );
-  fgets( tempstr, 80, fp );
-  NoDataValue = ReadHeaderLine( fp );
-  printf("NoDataValue is %d\n",NoDataValue);
-
-  /* Check that data have the right dimensions */
-  if( ncols!=NColumns || nrows!=NRows )
-  {
-    printf("Program must be recompiled for %d by %d data\n",
-            ncols, nrows );
-    exit( 0 );
-  }
-
-  /* Convert from 1,2,4,... code to neighbor cell coords */
+  /* Read the flow directions, one byte each: an ARC/INFO ascii file or
+     a .d8 file from flowdir. The grids are sized to fit, and the halo of
+     dir is marked as no-data. */
   printf( "Reading <%s>...\n", filename );
-        for( j=0; j<NRows; j++ )
-                for( i=0; i<NColumns; i++ )
-                {
-                        jj = (NRows-1)-j;
-                        fscanf( fp, "%d", &tmp );
-                        switch( tmp ) {
-                                case 1: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj;
-                                        break;
-                                case 2: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 4: nbr[i][jj].x = i;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 8: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 16: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj;
-                                        break;
-                                case 32: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                case 64: nbr[i][jj].x = i;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                case 128: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                default:
-                                        if( tmp==NoDataValue ) nbr[i][jj].x = NoDataValue;
-                                        else printf("Undefined flow direction %d at %d,%d\n", tmp, i, jj );
-                        }
-                }
-
-  fclose( fp );
+  dir = ReadFlowDirections( filename, 'a', &NoDataValue, nthreads );
+  printf("NoDataValue is %d\n",NoDataValue);
+  NColumns = dir->nx;
+  NRows = dir->ny;
+  baslen = NewGrid( NColumns, NRows, sizeof( double ) );
 
   printf("done.\n");
 }
 
 
-double lengthtopoint( i,j,x,y,lmax,reclvl)
-int i,j,x,y;
-double lmax;
-int reclvl;
-{
-  double localdist;
-  int ii,jj;
-
-  /* Check recursion level to avoid endless loops */
-  reclvl=reclvl+1;
-  if( reclvl>NColumns*NRows)
-  {
-    printf("Recursion level too high!\n");
-    exit(1);
-  }
-
-  /* Compute local distance to the outlet (i,j), and record it as the max
-   * if it's larger than current max */
-  localdist = sqrt( (double)(abs(i-x)*abs(i-x) + 
-                    abs(j-y)*abs(j-y)) ) + 1;
-  if( localdist > lmax ) lmax = localdist;
-
-  /* Check each adjacent node: if it flows here, then call ourself again
-   * with the upstream neighbor coords */
-  for( ii=x-1; ii<=x+1; ii++ )
-    for( jj=y-1; jj<=y+1; jj++ )
-      if( nbr[ii][jj].x==x & nbr[ii][jj].y==y )
-        lmax=lengthtopoint(i,j,ii,jj,lmax,reclvl);
-
-  return lmax;
-
-}
-
-
 void main( argc, argv )
 int argc;
 char **argv;
@@ -163,31 +56,37 @@ char **argv;
   int i,j;
   FILE *fp;
 
+  nthreads = ThreadsOption( &argc, argv );
+
   /* Check that input files have been specified */
   if( argc < 2 ) {
-    printf( "USAGE: basinlength <flow dir file>\n" );
+    printf( "USAGE: basinlength <flow dir file> [--threads N]\n" );
     exit( 0 );
   }
 
-  /* Read flow directions file and convert to "neighbor cell" format */
+  /* Read flow directions file and convert to one-byte codes */
   ReadFlowDirFile( argv[1] );
 
-  /* For each cell, find the maximum basin length */
-  for( i=1; i<NColumns-1; i++ )
+  /* Find the basin length of every cell in one pass (see baslen.c),
+     then keep those of the interior cells with data */
+  if( BasinLengths( dir, baslen, 0 )>0 )
+  {
+    printf("There appears to be a loop in the flow direction data.\n");
+    exit(0);
+  }
+  for( i=0; i<NColumns; i++ )
   {
-    printf("Col %d\n",i);
-    for( j=1; j<NRows-1; j++ )
-      if( nbr[i][j].x != NoDataValue ) 
-      {
-        baslen[i][j] = lengthtopoint(i,j,i,j,0,0);
-        printf("(%d,%d) %f\n",i,j,baslen[i][j]);
-      }
+    if( i>0 && i<NColumns-1 ) printf("Col %d\n",i);
+    for( j=0; j<NRows; j++ )
+      if( i>0 && j>0 && i<NColumns-1 && j<NRows-1 && DIR(i,j)!=D8NoData )
+        printf("(%d,%d) %f\n",i,j,BASLEN(i,j));
+      else BASLEN(i,j) = 0;
   }
 
   /* Write the data in binary format */
   printf("Writing 'baslen.dat'...");
-  fp = fopen("baslen.dat","w");
-  fwrite( baslen, sizeof( baslen ), 1, fp );
+  fp = CreateGridFile( "baslen.dat", baslen, GridFloat64, NULL, 0 );
+  WriteGridData( baslen, fp );
   fclose( fp );
   printf("all done.\n");
 
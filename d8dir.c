@@ -0,0 +1,222 @@
+/*
+**  d8dir.c: One-byte D8 flow directions shared by the DEM tools (see
+**  d8dir.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "d8dir.h"
+
+/* x and y steps for each ArcInfo code; zero for everything else */
+const signed char D8DX[256] = {
+  [1] = 1, [2] = 1, [4] = 0, [8] = -1,
+  [16] = -1, [32] = -1, [64] = 0, [128] = 1 };
+const signed char D8DY[256] = {
+  [1] = 0, [2] = -1, [4] = -1, [8] = -1,
+  [16] = 0, [32] = 1, [64] = 1, [128] = 1 };
+
+/* The codes for the eight neighbors of a cell, in the order the old
+   "for( i=x-1..x+1 ) for( j=y-1..y+1 )" loops visited them */
+const unsigned char D8Neighbors[8] = { 8, 16, 32, 4, 64, 2, 1, 128 };
+
+/* The code for a step of (dx,dy), as D8Code[dx+1][dy+1] */
+const unsigned char D8Code[3][3] = {
+  { 8, 16, 32 }, { 4, D8None, 64 }, { 2, 1, 128 } };
+
+/* Tarboton's codes 1 (east) to 8 (southeast) go counterclockwise */
+static const unsigned char TarbotonCode[9] = {
+  D8None, 1, 128, 64, 32, 16, 8, 4, 2 };
+
+#define D8Magic "D8DIR"
+
+
+/*
+** D8Offsets: fills |off| with the linear index step for each code in grid
+** |g|, so that the cell at index k drains to the one at k+off[code].
+** Codes that aren't directions get a step of zero.
+*/
+void D8Offsets( Grid *g, GridIndex off[256] )
+{
+  int c;
+
+  for( c=0; c<256; c++ )
+    off[c] = D8DX[c]*g->stride + D8DY[c];
+}
+
+
+/*
+** ReadD8Grid: reads an ASCII flow direction file (already opened with
+** OpenAsciiGrid) into a new grid of one-byte codes. |encoding| is 'a' for
+** ArcInfo codes (1, 2, 4, ... 128) or 't' for Tarboton's (1 to 8); cells
+** holding |nodata| become D8NoData. Any other code is reported, and the
+** cell treated as having no data.
+*/
+Grid *ReadD8Grid( AsciiGrid *f, int encoding, int nodata, int nthreads )
+{
+  Grid *code, *dir;
+  unsigned char d, halo = D8NoData;
+  long i, j;
+  int c;
+
+  code = NewGrid( f->ncols, f->nrows, sizeof( int ) );
+  ReadAsciiInts( f, code, nthreads );
+  dir = NewGrid( f->ncols, f->nrows, sizeof( unsigned char ) );
+  FillHalo( dir, &halo );
+
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+    {
+      c = GCELL(code,int,i,j);
+      if( c==nodata ) d = D8NoData;
+      else if( encoding=='t' && c>=1 && c<=8 ) d = TarbotonCode[c];
+      else if( encoding=='a' && c>0 && c<=128 && IsD8Dir(c) ) d = c;
+      else
+      {
+        printf("Undefined flow direction %d at %ld,%ld\n", c, i, j );
+        d = D8NoData;
+      }
+      GCELL(dir,unsigned char,i,j) = d;
+    }
+
+  FreeGrid( code );
+  return dir;
+}
+
+
+/*
+** WriteD8File: saves a direction grid as a ".d8" file (see d8dir.h), with
+** ArcInfo's codes if |encoding| is 'a' or Tarboton's if it is 't'.
+*/
+void WriteD8File( char *filename, Grid *dir, int encoding )
+{
+  FILE *fp;
+  unsigned char tocode[256], *col;
+  long i, j;
+  int c;
+
+  if( (fp = fopen( filename, "w" ))==NULL )
+  {
+    printf("Unable to create '%s'\n", filename );
+    exit(1);
+  }
+  fprintf( fp, "%s %c %ld %ld\n", D8Magic, encoding, dir->nx, dir->ny );
+  if( encoding=='a' )
+    WriteGridData( dir, fp );
+  else
+  {
+    /* Translate a column at a time into Tarboton's codes */
+    for( c=0; c<256; c++ ) tocode[c] = D8NoData;
+    for( c=0; c<=8; c++ ) tocode[TarbotonCode[c]] = c;
+    col = (unsigned char *)malloc( dir->ny );
+    for( i=0; i<dir->nx; i++ )
+    {
+      for( j=0; j<dir->ny; j++ )
+        col[j] = tocode[GCELL(dir,unsigned char,i,j)];
+      fwrite( col, 1, dir->ny, fp );
+    }
+    free( col );
+  }
+  fclose( fp );
+}
+
+
+/*
+** OpenD8File: opens a ".d8" file and reads its header, leaving the file
+** positioned at the first cell. Returns NULL, having read nothing, if the
+** file isn't a ".d8" file.
+*/
+FILE *OpenD8File( char *filename, long *nx, long *ny, int *encoding )
+{
+  FILE *fp;
+  char line[80], magic[8], e;
+
+  if( (fp = fopen( filename, "r" ))==NULL )
+  {
+    printf("Unable to find '%s'\n", filename );
+    exit( 0 );
+  }
+  if( fgets( line, sizeof( line ), fp )==NULL
+      || sscanf( line, "%7s %c %ld %ld", magic, &e, nx, ny )!=4
+      || strcmp( magic, D8Magic )!=0 )
+  {
+    fclose( fp );
+    return NULL;
+  }
+  if( e!='a' && e!='t' )
+  {
+    printf("'%s' has an unknown direction encoding '%c'\n", filename, e );
+    exit(1);
+  }
+  *encoding = e;
+  return fp;
+}
+
+
+/*
+** D8Decode: converts |n| codes read from a ".d8" file in the given
+** |encoding| to ArcInfo's, in place.
+*/
+void D8Decode( unsigned char *d, size_t n, int encoding )
+{
+  size_t k;
+
+  if( encoding=='t' )
+    for( k=0; k<n; k++ )
+      d[k] = d[k]<=8 ? TarbotonCode[d[k]] : D8NoData;
+}
+
+
+/*
+** ReadD8File: reads a ".d8" file into a new direction grid of ArcInfo
+** codes, with a no-data halo. Returns NULL, having read nothing, if the
+** file isn't a ".d8" file, so callers can try it as an ASCII grid instead.
+*/
+Grid *ReadD8File( char *filename )
+{
+  FILE *fp;
+  Grid *dir;
+  unsigned char halo = D8NoData;
+  long nx, ny, i;
+  int encoding;
+
+  if( (fp = OpenD8File( filename, &nx, &ny, &encoding ))==NULL )
+    return NULL;
+  dir = NewGrid( nx, ny, sizeof( unsigned char ) );
+  FillHalo( dir, &halo );
+  ReadGridData( dir, fp );
+  fclose( fp );
+
+  for( i=0; i<nx; i++ )
+    D8Decode( &GCELL(dir,unsigned char,i,0), ny, encoding );
+
+  return dir;
+}
+
+
+/*
+** ReadFlowDirections: reads a flow direction file, either a ".d8" file or
+** an ASCII grid with |encoding| 'a' (ArcInfo) or 't' (Tarboton), into a
+** new direction grid. Sets |*nodata| to the code the file uses for cells
+** without data: the NODATA_value of an ArcInfo grid if it gives one,
+** -9999 if not, and -1 for Tarboton's.
+*/
+Grid *ReadFlowDirections( char *filename, int encoding, int *nodata,
+                          int nthreads )
+{
+  AsciiGrid *f;
+  Grid *dir;
+
+  if( (dir = ReadD8File( filename ))!=NULL )
+  {
+    *nodata = encoding=='t' ? -1 : -9999;
+    return dir;
+  }
+
+  f = OpenAsciiGrid( filename );
+  if( encoding=='t' ) *nodata = -1;
+  else *nodata = f->hasnodata ? (int)f->nodata : -9999;
+  dir = ReadD8Grid( f, encoding, *nodata, nthreads );
+  CloseAsciiGrid( f );
+  return dir;
+}
@@ -0,0 +1,53 @@
+/*
+**  d8dir.h: One-byte D8 flow directions shared by the DEM tools.
+**
+**  A flow direction grid holds one unsigned char per cell: ArcInfo's code
+**  for the neighbor the cell drains to, one bit per neighbor going
+**  clockwise from east (1 = +x, 2 = +x-y, 4 = -y, ... 128 = +x+y). A cell
+**  that drains nowhere holds D8None, one without data holds D8NoData, and
+**  the halo of the grid is D8NoData too, so a walk that steps off the edge
+**  stops there.
+**
+**  D8DX and D8DY give the x and y step for each code (zero for anything
+**  that isn't a direction). D8Offsets turns them into steps of linear
+**  index for a given grid, so following the flow costs one table lookup
+**  and one addition per cell.
+**
+**  flowdir can save a direction grid as a ".d8" file: a one-line text
+**  header, "D8DIR a ncols nrows" (or "t" for Tarboton's codes 1 to 8),
+**  followed by one byte per cell in the same [x][y] order as the other
+**  binary grids. Cells with no flow direction are 0 and those with no
+**  data 255 in either encoding. ReadFlowDirections reads either kind of
+**  file, so every tool that takes an ASCII flow direction file takes a
+**  ".d8" file as well.
+*/
+
+#ifndef D8DIR_H
+#define D8DIR_H
+
+#include "demgrid.h"
+#include "asciigrid.h"
+
+#define D8None 0
+#define D8NoData 255
+
+/* True if |c| is one of the eight direction codes */
+#define IsD8Dir(c) ( (c)!=0 && ((c)&((c)-1))==0 )
+
+/* The code pointing back the other way: east <-> west, etc. */
+#define D8Opposite(c) ( (unsigned char)(((c)<<4) | ((c)>>4)) )
+
+extern const signed char D8DX[256], D8DY[256];
+extern const unsigned char D8Neighbors[8];
+extern const unsigned char D8Code[3][3];
+
+void D8Offsets( Grid *g, GridIndex off[256] );
+Grid *ReadD8Grid( AsciiGrid *f, int encoding, int nodata, int nthreads );
+void WriteD8File( char *filename, Grid *dir, int encoding );
+FILE *OpenD8File( char *filename, long *nx, long *ny, int *encoding );
+void D8Decode( unsigned char *d, size_t n, int encoding );
+Grid *ReadD8File( char *filename );
+Grid *ReadFlowDirections( char *filename, int encoding, int *nodata,
+                          int nthreads );
+
+#endif
@@ -0,0 +1,439 @@
+/*
+**  d8find.c: Finds D8 flow directions, and the slopes along them, from a
+**            grid of short elevations (see d8find.h).
+**
+**  Each interior cell with an elevation above zero drains to the neighbor
+**  with the steepest drop (diagonal drops divided by root 2), and only a
+**  drop greater than |mindrop| counts: -1 lets a cell drain to a neighbor
+**  of the same elevation, 0 leaves every cell without a lower neighbor as
+**  D8None for ResolveD8Flats. Cells at or below zero, and the edges of the
+**  grid, have no data. The elevations may be a mapped file, since only
+**  the neighbors of interior cells are looked at.
+**
+**  Slopes are the drop from a cell to the neighbor it drains to, divided
+**  by 30 (meter cells), or 42.4264 on a diagonal, as steepslp has always
+**  worked them out; a cell that drains nowhere has SlopeNoData.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "d8find.h"
+#include "d8dir.h"
+
+/* What the threads of a search share */
+typedef struct
+{
+  Grid *elev, *dir, *slope;
+  float mindrop;
+} D8Search;
+
+#define ELEV(i,j) GCELL(s->elev,short,i,j)
+#define DIR(i,j) GCELL(s->dir,unsigned char,i,j)
+#define SLOPE(i,j) GCELL(s->slope,float,i,j)
+
+
+/*
+** The steepest-descent search is done a strip of cells at a time with
+** AVX2 (8 cells) or SSE4.1 (4 cells) instructions when the compiler is
+** allowed to use them (e.g. cc -O2 -march=native), and a cell at a time
+** otherwise. Both visit the nine cells of the 3x3 neighborhood in the
+** same order, compute the same float drops, and keep the first of any
+** equal steepest drops, so the directions are identical either way.
+*/
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#define StripWidth 8
+#elif defined( __SSE4_1__ )
+#include <smmintrin.h>
+#define StripWidth 4
+#endif
+
+static const float Root2Recip = 0.70710678;  /* 1/sqrt(2) */
+
+
+/*
+** SlopeCell: works out the slope from cell (i,j) to the neighbor it
+** drains to. The search calls it just after finding the cell's direction,
+** while the 3x3 neighborhood is still in the cache.
+*/
+static void SlopeCell( D8Search *s, long i, long j )
+{
+  unsigned char c = DIR(i,j);
+
+  if( IsD8Dir(c) )
+  {
+    SLOPE(i,j) = ELEV(i,j) - ELEV(i+D8DX[c],j+D8DY[c]);
+    if( D8DX[c]==0 || D8DY[c]==0 ) SLOPE(i,j) = SLOPE(i,j) / 30.0;
+    else SLOPE(i,j) = SLOPE(i,j) / 42.4264;
+  }
+}
+
+
+/*
+** FlowDirCell: finds the flow direction of interior cell (i,j), adding
+** to the counts of sinks and of ambiguous flow directions.
+*/
+static void FlowDirCell( D8Search *s, long i, long j, int *nsink,
+                         int *nambig )
+{
+  long ii, jj;
+  unsigned char c;
+  float drop, maxdrop;
+
+  /* Don't consider points with zero or lower elevation */
+  if( ELEV(i,j)<=0 ) return;
+
+  /* Find max drop to one of eight surrounding nodes, and store the code
+     for that neighbor in dir (D8None if it's the cell itself). With a
+     |mindrop| of 0 only a drop above zero counts, so a cell with no lower
+     neighbor is left as D8None for ResolveD8Flats. */
+  maxdrop = s->mindrop;
+  c = D8None;
+  for( ii=i-1; ii<=i+1; ii++ )
+    for( jj=j-1; jj<=j+1; jj++ )
+    {
+      drop = ELEV(i,j)-ELEV(ii,jj);
+      if( i!=ii && j!=jj ) drop *= Root2Recip;
+      if( drop>maxdrop )
+      {
+        maxdrop = drop;
+        c = D8Code[ii-i+1][jj-j+1];
+      }
+      else if( drop==maxdrop ) (*nambig)++;
+    }
+  DIR(i,j) = c;
+  if( c==D8None ) (*nsink)++;
+  if( s->slope!=NULL ) SlopeCell( s, i, j );
+}
+
+
+#ifdef StripWidth
+/*
+** FlowDirStrip: does the same for the StripWidth cells starting at
+** interior cell (i,j), all at once. A lane's drop replaces the steepest
+** so far only if it is strictly greater, as in FlowDirCell; the lanes
+** that tie are counted from a bit mask of the comparison.
+*/
+static void FlowDirStrip( D8Search *s, long i, long j, int *nsink,
+                          int *nambig )
+{
+  short *e = &ELEV(i,j);
+  GridIndex stride = s->elev->stride;
+  unsigned char *d = &DIR(i,j);
+  int di, dj, n, valid;
+  int code[StripWidth];
+#if StripWidth==8
+  __m256i centre, c;
+  __m256 drop, maxdrop, gt, eq;
+
+  centre = _mm256_cvtepi16_epi32( _mm_loadu_si128( (__m128i *)e ) );
+  valid = _mm256_movemask_ps( _mm256_castsi256_ps(
+            _mm256_cmpgt_epi32( centre, _mm256_setzero_si256() ) ) );
+  maxdrop = _mm256_set1_ps( s->mindrop );
+  c = _mm256_set1_epi32( D8None );
+  for( di=-1; di<=1; di++ )
+    for( dj=-1; dj<=1; dj++ )
+    {
+      drop = _mm256_cvtepi32_ps( _mm256_sub_epi32( centre,
+               _mm256_cvtepi16_epi32( _mm_loadu_si128(
+                 (__m128i *)(e + di*stride + dj) ) ) ) );
+      if( di!=0 && dj!=0 )
+        drop = _mm256_mul_ps( drop, _mm256_set1_ps( Root2Recip ) );
+      gt = _mm256_cmp_ps( drop, maxdrop, _CMP_GT_OQ );
+      eq = _mm256_cmp_ps( drop, maxdrop, _CMP_EQ_OQ );
+      maxdrop = _mm256_blendv_ps( maxdrop, drop, gt );
+      c = _mm256_blendv_epi8( c, _mm256_set1_epi32( D8Code[di+1][dj+1] ),
+                              _mm256_castps_si256( gt ) );
+      *nambig += __builtin_popcount( _mm256_movemask_ps( eq ) & valid );
+    }
+  *nsink += __builtin_popcount( valid & _mm256_movemask_ps(
+              _mm256_castsi256_ps( _mm256_cmpeq_epi32( c,
+                _mm256_set1_epi32( D8None ) ) ) ) );
+  _mm256_storeu_si256( (__m256i *)code, c );
+#else
+  __m128i centre, c;
+  __m128 drop, maxdrop, gt, eq;
+
+  centre = _mm_cvtepi16_epi32( _mm_loadl_epi64( (__m128i *)e ) );
+  valid = _mm_movemask_ps( _mm_castsi128_ps(
+            _mm_cmpgt_epi32( centre, _mm_setzero_si128() ) ) );
+  maxdrop = _mm_set1_ps( s->mindrop );
+  c = _mm_set1_epi32( D8None );
+  for( di=-1; di<=1; di++ )
+    for( dj=-1; dj<=1; dj++ )
+    {
+      drop = _mm_cvtepi32_ps( _mm_sub_epi32( centre,
+               _mm_cvtepi16_epi32( _mm_loadl_epi64(
+                 (__m128i *)(e + di*stride + dj) ) ) ) );
+      if( di!=0 && dj!=0 )
+        drop = _mm_mul_ps( drop, _mm_set1_ps( Root2Recip ) );
+      gt = _mm_cmpgt_ps( drop, maxdrop );
+      eq = _mm_cmpeq_ps( drop, maxdrop );
+      maxdrop = _mm_blendv_ps( maxdrop, drop, gt );
+      c = _mm_blendv_epi8( c, _mm_set1_epi32( D8Code[di+1][dj+1] ),
+                           _mm_castps_si128( gt ) );
+      *nambig += __builtin_popcount( _mm_movemask_ps( eq ) & valid );
+    }
+  *nsink += __builtin_popcount( valid & _mm_movemask_ps(
+              _mm_castsi128_ps( _mm_cmpeq_epi32( c,
+                _mm_set1_epi32( D8None ) ) ) ) );
+  _mm_storeu_si128( (__m128i *)code, c );
+#endif
+
+  /* Cells at or below zero elevation keep the no-data code */
+  for( n=0; n<StripWidth; n++ )
+    if( valid & (1<<n) )
+    {
+      d[n] = code[n];
+      if( s->slope!=NULL ) SlopeCell( s, i, j+n );
+    }
+}
+#endif
+
+
+/*
+** FlowDirBand: finds the flow directions in one band of columns, a strip
+** at a time where possible, keeping its own counts of sinks and
+** ambiguous directions.
+*/
+static void FlowDirBand( GridBand *b )
+{
+  D8Search *s = (D8Search *)b->arg;
+  long i, j, jhi = s->dir->ny-1;
+  int nsink=0, nambig=0;
+
+  for( i=b->lo; i<b->hi; i++ )
+  {
+    j = 1;
+#ifdef StripWidth
+    for( ; j+StripWidth<=jhi; j+=StripWidth )
+      FlowDirStrip( s, i, j, &nsink, &nambig );
+#endif
+    for( ; j<jhi; j++ )
+      FlowDirCell( s, i, j, &nsink, &nambig );
+  }
+  b->count[0] = nsink;
+  b->count[1] = nambig;
+}
+
+
+/*
+** FindD8Directions: finds the flow direction of every cell of |elev| and
+** puts it in |dir|, a byte grid of the same size, and the slope along it
+** in |slope| (a float grid) unless that is NULL. The interior columns
+** are split into bands, one per thread; each band writes only its own
+** columns, so nothing depends on the number of threads. Returns the
+** number of sinks (cells with data left as D8None), and sets |*nambig| to
+** the number of ties for the steepest drop.
+*/
+long FindD8Directions( Grid *elev, Grid *dir, Grid *slope, float mindrop,
+                       int nthreads, long *nambig )
+{
+  D8Search s;
+  unsigned char nodata = D8NoData;
+  float nodataslope = SlopeNoData;
+  long count[4] = { 0, 0, 0, 0 };
+
+  s.elev = elev;
+  s.dir = dir;
+  s.slope = slope;
+  s.mindrop = mindrop;
+  FillGrid( dir, &nodata );
+  if( slope!=NULL ) FillGrid( slope, &nodataslope );
+  RunBands( 1, dir->nx-1, nthreads, FlowDirBand, &s, count );
+  *nambig = count[1];
+  return count[0];
+}
+
+
+/*
+** Flat areas are given directions as by Barnes, Lehman & Mulla (2014):
+** with a |mindrop| of 0, FindD8Directions leaves every cell without a
+** strictly lower neighbor as D8None, and ResolveD8Flats routes each
+** connected flat of such cells towards the cells of the same elevation
+** that do drain (its outlets, which include edge cells), and away from
+** the higher terrain around it. Two breadth-first sweeps over the flat
+** cells give each one its distance L from the outlets and its distance H
+** from the higher ground; a cell then drains to the neighbor in its flat
+** with the least 2L-H, or straight to an outlet if it is next to one.
+** 2L-H falls by at least one at each step towards an outlet, so no loops
+** can form, and every flat with an outlet is drained. Only flat cells are
+** visited: they're found with memchr over the direction columns. The one
+** extra grid, flat, holds L and then 2L-H (offset to be positive); it
+** stays zero everywhere else. A routed flat cell drains to a cell of the
+** same elevation, so its slope is zero.
+*/
+#define FlatMark 3          /* Not a direction: a flat cell H has reached */
+#define ELEVK(k) GCELL(elev,short,(k)/dir->stride-dir->halo, \
+                       (k)%dir->stride-dir->halo)
+
+
+static int OnEdge( Grid *dir, GridIndex k )
+{
+  long i = k/dir->stride - dir->halo, j = k%dir->stride - dir->halo;
+
+  return i==0 || j==0 || i==dir->nx-1 || j==dir->ny-1;
+}
+
+
+/*
+** ResolveD8Flats: gives directions to the flat cells among the |nsinks|
+** sinks FindD8Directions left. Returns the number of cells routed.
+*/
+long ResolveD8Flats( Grid *elev, Grid *dir, Grid *slope, long nsinks )
+{
+  Grid *flat;
+  unsigned char *d;
+  int *f;
+  GridIndex *list, *high, k, m, off[256];
+  long i, j, n, nlist = 0, nhigh = 0, head, end;
+  int dist, best, c;
+  unsigned char *p, *col;
+
+  flat = NewGrid( dir->nx, dir->ny, sizeof( int ) );
+  D8Offsets( dir, off );
+  d = (unsigned char *)dir->data;
+  f = (int *)flat->data;
+  list = (GridIndex *)malloc( (nsinks+1)*sizeof( GridIndex ) );
+  high = (GridIndex *)malloc( (nsinks+1)*sizeof( GridIndex ) );
+  if( list==NULL || high==NULL )
+  {
+    printf("Unable to allocate room for %ld flat cells\n", nsinks );
+    exit(1);
+  }
+
+  /* Find the flat cells next to an outlet (L=1) and those next to higher
+     ground (H=1). The elevation grid may be mapped without a halo, so it
+     is indexed by (x,y) rather than by dir's linear index. */
+  for( i=1; i<dir->nx-1; i++ )
+  {
+    col = &GCELL(dir,unsigned char,i,0);
+    for( p = col; (p = memchr( p, D8None, col+dir->ny-p ))!=NULL; p++ )
+    {
+      j = p-col;
+      k = GIDX(dir,i,j);
+      for( n=0; n<8; n++ )
+      {
+        c = D8Neighbors[n];
+        m = k + off[c];
+        if( GCELL(elev,short,i+D8DX[c],j+D8DY[c])>GCELL(elev,short,i,j) )
+        {
+          if( nhigh==0 || high[nhigh-1]!=k ) high[nhigh++] = k;
+        }
+        else if( GCELL(elev,short,i+D8DX[c],j+D8DY[c])
+                   ==GCELL(elev,short,i,j)
+                 && (IsD8Dir(d[m]) || OnEdge( dir, m )) && f[k]==0 )
+        {
+          f[k] = 1;
+          list[nlist++] = k;
+        }
+      }
+    }
+  }
+
+  /* Sweep out from the outlets: L is one more than the neighbor's that
+     reached it first */
+  for( head=0; head<nlist; head++ )
+  {
+    k = list[head];
+    for( n=0; n<8; n++ )
+    {
+      m = k + off[D8Neighbors[n]];
+      if( d[m]==D8None && f[m]==0 && ELEVK(m)==ELEVK(k) )
+      {
+        f[m] = f[k]+1;
+        list[nlist++] = m;
+      }
+    }
+  }
+
+  /* Sweep in from the higher ground, a distance at a time, over the flat
+     cells that drain, turning L into 2L-H */
+  for( i=j=0; i<nhigh; i++ )
+    if( f[high[i]]>0 )
+    {
+      high[j++] = high[i];
+      d[high[i]] = FlatMark;
+      f[high[i]] = 2*f[high[i]]-1;
+    }
+  nhigh = j;
+  for( head=0, dist=1; head<nhigh; dist++ )
+    for( end=nhigh; head<end; head++ )
+    {
+      k = high[head];
+      for( n=0; n<8; n++ )
+      {
+        m = k + off[D8Neighbors[n]];
+        if( d[m]==D8None && f[m]>0 && ELEVK(m)==ELEVK(k) )
+        {
+          d[m] = FlatMark;
+          f[m] = 2*f[m]-(dist+1);
+          high[nhigh++] = m;
+        }
+      }
+    }
+
+  /* Flats no higher ground reached have H=0; then lift every value above
+     zero, which keeps marking the flat cells */
+  for( head=0; head<nlist; head++ )
+  {
+    k = list[head];
+    if( d[k]!=FlatMark ) f[k] *= 2;
+    f[k] += dist+1;
+  }
+
+  /* Send each flat cell straight to an outlet if it is next to one, or
+     else down the steepest fall in 2L-H */
+  for( head=0; head<nlist; head++ )
+  {
+    k = list[head];
+    best = D8None;
+    for( n=0; n<8 && (best==D8None || f[k+off[best]]>0); n++ )
+    {
+      c = D8Neighbors[n];
+      m = k + off[c];
+      if( ELEVK(m)!=ELEVK(k) ) continue;
+      if( f[m]==0 ) best = c;
+      else if( f[m]<f[k] && (best==D8None || f[m]<f[k+off[best]]) )
+        best = c;
+    }
+    d[k] = best;
+    if( slope!=NULL && best!=D8None ) ((float *)slope->data)[k] = 0;
+  }
+
+  free( list );
+  free( high );
+  FreeGrid( flat );
+  return nlist;
+}
+
+
+static void SlopeBand( GridBand *b )
+{
+  D8Search *s = (D8Search *)b->arg;
+  long i, j;
+
+  for( i=b->lo; i<b->hi; i++ )
+    for( j=1; j<s->dir->ny-1; j++ )
+      SlopeCell( s, i, j );
+}
+
+
+/*
+** FindD8Slopes: works out the slope of every cell of |dir| from |elev|,
+** for directions found earlier, in bands of columns on |nthreads|
+** threads. Only interior cells can have directions, so the elevations
+** may be a mapped file here too.
+*/
+void FindD8Slopes( Grid *elev, Grid *dir, Grid *slope, int nthreads )
+{
+  D8Search s;
+  float nodataslope = SlopeNoData;
+
+  s.elev = elev;
+  s.dir = dir;
+  s.slope = slope;
+  FillGrid( slope, &nodataslope );
+  RunBands( 1, dir->nx-1, nthreads, SlopeBand, &s, NULL );
+}
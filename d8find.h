@@ -0,0 +1,18 @@
+/*
+**  d8find.h: Finds D8 flow directions, and the slopes along them, from a
+**            grid of short elevations.
+*/
+
+#ifndef D8FIND_H
+#define D8FIND_H
+
+#include "demgrid.h"
+
+#define SlopeNoData -9999  /* Slope of a cell that drains nowhere */
+
+long FindD8Directions( Grid *elev, Grid *dir, Grid *slope, float mindrop,
+                       int nthreads, long *nambig );
+long ResolveD8Flats( Grid *elev, Grid *dir, Grid *slope, long nsinks );
+void FindD8Slopes( Grid *elev, Grid *dir, Grid *slope, int nthreads );
+
+#endif
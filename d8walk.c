@@ -0,0 +1,171 @@
+/*
+**  d8walk.c: Walks over a D8 flow network without recursion (see
+**            d8walk.h).
+**
+**  Recursive walks upstream overflow the stack on big basins, and walks
+**  with a fixed step limit give up on long rivers. These keep their own
+**  stacks on the heap, and bound their steps only by the number of cells
+**  in the grid, which no walk can exceed unless it goes round a loop.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "d8walk.h"
+#include "d8dir.h"
+
+#define Done 0xFF   /* Donor count of a cell that has been visited */
+#define OnGrid(g,p,q) ( (p)>=0 && (q)>=0 && (p)<(g)->nx && (q)<(g)->ny )
+
+
+/*
+** D8Donors: finds the neighbors of cell |k| that drain to it. Fills
+** |code| with the codes of the steps from the cell to each of them, in
+** the order of D8Neighbors, and returns how many there are. (A neighbor
+** drains here if its code points back the way we look at it; the halo
+** never does.)
+*/
+int D8Donors( Grid *dir, GridIndex k, unsigned char code[8] )
+{
+  unsigned char *d = (unsigned char *)dir->data, c;
+  int n, ndon = 0;
+
+  for( n=0; n<8; n++ )
+  {
+    c = D8Neighbors[n];
+    if( d[k+D8DX[c]*dir->stride+D8DY[c]]==D8Opposite(c) )
+      code[ndon++] = c;
+  }
+  return ndon;
+}
+
+
+/*
+** D8WalkDown: visits cell (i,j) and then each cell below it in turn, as
+** far as a cell that drains nowhere or one at which the visitor says to
+** stop. Returns the number of cells visited, or -1 if the path runs into
+** a loop.
+*/
+long D8WalkDown( Grid *dir, long i, long j, D8Visitor visit, void *arg )
+{
+  unsigned char *d = (unsigned char *)dir->data, c;
+  GridIndex k;
+  long n;
+
+  for( n=1; n<=dir->nx*dir->ny; n++ )
+  {
+    k = GIDX(dir,i,j);
+    if( !visit( k, i, j, arg ) ) return n;
+    c = d[k];
+    if( !IsD8Dir(c) || !OnGrid( dir, i+D8DX[c], j+D8DY[c] ) ) return n;
+    i += D8DX[c];
+    j += D8DY[c];
+  }
+  return -1;
+}
+
+
+/*
+** D8WalkUp: visits cell (i,j) and every cell that drains to it, depth
+** first, with a stack of its own. The cells above a cell at which the
+** visitor says to stop aren't visited. Returns the number of cells
+** visited, or -1 if the cells above (i,j) include a loop.
+*/
+long D8WalkUp( Grid *dir, long i, long j, D8Visitor visit, void *arg )
+{
+  GridIndex k, *stack;
+  long n = 0, top = 0, size = 64;
+  unsigned char code[8];
+  int m, ndon;
+
+  if( (stack = (GridIndex *)malloc( size*sizeof( GridIndex ) ))==NULL )
+  {
+    printf("Unable to allocate a walk stack\n");
+    exit(1);
+  }
+  stack[top++] = GIDX(dir,i,j);
+  while( top>0 )
+  {
+    if( ++n > dir->nx*dir->ny )
+    {
+      n = -1;
+      break;
+    }
+    k = stack[--top];
+    i = k/dir->stride - dir->halo;
+    j = k%dir->stride - dir->halo;
+    if( !visit( k, i, j, arg ) ) continue;
+    ndon = D8Donors( dir, k, code );
+    if( top+ndon > size )
+    {
+      size *= 2;
+      if( (stack = (GridIndex *)realloc( stack,
+                     size*sizeof( GridIndex ) ))==NULL )
+      {
+        printf("Unable to allocate a walk stack\n");
+        exit(1);
+      }
+    }
+    for( m=ndon-1; m>=0; m-- )
+      stack[top++] = k + D8DX[code[m]]*dir->stride + D8DY[code[m]];
+  }
+  free( stack );
+  return n;
+}
+
+
+/*
+** D8Topological: visits every cell of the grid once, each after all the
+** cells that drain to it, so that a visitor can hand on whatever it has
+** gathered to the cell's receiver. The order is that of flowacc.c: the
+** grid is scanned for cells with no donors left, and each is followed
+** downstream for as long as the cells reached have had all of their
+** donors visited. Returns the number of cells never visited because they
+** lie on a loop.
+*/
+long D8Topological( Grid *dir, D8TopoVisitor visit, void *arg )
+{
+  unsigned char *d = (unsigned char *)dir->data, *ndon, c;
+  Grid *donors;
+  GridIndex k, r, off[256];
+  long i, j, p, q, nleft;
+
+  /* Count the donors of every cell */
+  D8Offsets( dir, off );
+  donors = NewGrid( dir->nx, dir->ny, sizeof( unsigned char ) );
+  ndon = (unsigned char *)donors->data;
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+    {
+      c = d[k = GIDX(dir,i,j)];
+      if( IsD8Dir(c) && OnGrid( dir, i+D8DX[c], j+D8DY[c] ) )
+        ndon[k+off[c]]++;
+    }
+
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+    {
+      k = GIDX(dir,i,j);
+      p = i;
+      q = j;
+      while( ndon[k]==0 )
+      {
+        ndon[k] = Done;
+        c = d[k];
+        r = -1;
+        if( IsD8Dir(c) && OnGrid( dir, p+D8DX[c], q+D8DY[c] ) ) r = k+off[c];
+        visit( k, p, q, r, arg );
+        if( r<0 ) break;
+        ndon[r]--;
+        k = r;
+        p += D8DX[c];
+        q += D8DY[c];
+      }
+    }
+
+  nleft = 0;
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+      if( ndon[GIDX(dir,i,j)]!=Done ) nleft++;
+  FreeGrid( donors );
+  return nleft;
+}
@@ -0,0 +1,32 @@
+/*
+**  d8walk.h: Walks over a D8 flow network without recursion.
+**
+**  The network is a grid of one-byte ArcInfo codes (see d8dir.h). A cell
+**  drains to the neighbor its code points to, if that neighbor is on the
+**  grid; cells with any other code (D8None, D8NoData), and cells pointing
+**  off the grid, drain nowhere. Every walk calls a visitor with the linear
+**  index of each cell it reaches (GIDX in the direction grid), the cell's
+**  coordinates, and an argument of the caller's own. The direction grid
+**  must have its halo (i.e. not be a mapped file).
+*/
+
+#ifndef D8WALK_H
+#define D8WALK_H
+
+#include "demgrid.h"
+
+/* Visitor for D8WalkDown and D8WalkUp: returns nonzero to carry on past
+   the cell, zero to stop there */
+typedef int (*D8Visitor)( GridIndex k, long i, long j, void *arg );
+
+/* Visitor for D8Topological: |r| is the index of the cell's receiver, or
+   -1 if it has none */
+typedef void (*D8TopoVisitor)( GridIndex k, long i, long j, GridIndex r,
+                               void *arg );
+
+int D8Donors( Grid *dir, GridIndex k, unsigned char code[8] );
+long D8WalkDown( Grid *dir, long i, long j, D8Visitor visit, void *arg );
+long D8WalkUp( Grid *dir, long i, long j, D8Visitor visit, void *arg );
+long D8Topological( Grid *dir, D8TopoVisitor visit, void *arg );
+
+#endif
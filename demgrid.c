@@ -0,0 +1,575 @@
+/*
+**  demgrid.c: Run-time sized grids shared by the DEM tools (see demgrid.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "demgrid.h"
+#include "gridcodec.h"
+
+#define GridAlignment 64   /* Bytes; one cache line */
+#define GridMagic "DEMGRID"
+#define GridVersion 1
+
+/* Names and sizes of the element types, in the order of their codes */
+static const char *GridTypeName[] = { "unknown", "int8", "uint8", "int16",
+  "int32", "int64", "float32", "float64" };
+static const size_t GridTypeSize[] = { 0, 1, 1, 2, 4, 8, 4, 8 };
+#define NGridTypes 8
+
+/* Threads to decode tiled files with, as given to ThreadsOption */
+static int GridThreads = 1;
+
+
+/*
+** NewGrid: allocates an nx by ny grid of cells |elsize| bytes long, plus
+** the halo, and sets every cell (halo included) to zero, as the old
+** global arrays were.
+*/
+Grid *NewGrid( long nx, long ny, size_t elsize )
+{
+  Grid *g;
+  void *p;
+
+  if( nx<1 || ny<1 )
+  {
+    printf("Invalid grid dimensions %ld by %ld\n", nx, ny );
+    exit(1);
+  }
+  if( (g = (Grid *)malloc( sizeof( Grid ) ))==NULL )
+  {
+    printf("Unable to allocate a %ld by %ld grid\n", nx, ny );
+    exit(1);
+  }
+  g->nx = nx;
+  g->ny = ny;
+  g->halo = 1;
+  g->mapsize = 0;
+  g->mapskip = 0;
+  g->type = GridUnknown;
+  g->stride = (GridIndex)ny + 2;
+  g->ncells = ((GridIndex)nx + 2) * g->stride;
+  g->elsize = elsize;
+  if( posix_memalign( &p, GridAlignment, (size_t)g->ncells*elsize )!=0 )
+  {
+    printf("Unable to allocate a %ld by %ld grid\n", nx, ny );
+    exit(1);
+  }
+  memset( p, 0, (size_t)g->ncells*elsize );
+  g->data = p;
+
+  return g;
+}
+
+
+void FreeGrid( Grid *g )
+{
+  if( g==NULL ) return;
+  if( g->mapsize>0 ) munmap( (char *)g->data - g->mapskip, g->mapsize );
+  else free( g->data );
+  free( g );
+}
+
+
+/*
+** FillGrid: sets every cell, halo included, to |*value|.
+*/
+void FillGrid( Grid *g, const void *value )
+{
+  GridIndex k;
+  char *p = (char *)g->data;
+
+  for( k=0; k<g->ncells; k++ )
+    memcpy( p + k*g->elsize, value, g->elsize );
+}
+
+
+/*
+** FillHalo: sets the ring of cells just outside the grid to |*value|,
+** typically the no-data code, so that kernels looking past the edge of
+** the data see something harmless.
+*/
+void FillHalo( Grid *g, const void *value )
+{
+  long i, j;
+  char *p = (char *)g->data;
+
+  if( g->halo==0 ) return;
+  for( j=-1; j<=g->ny; j++ )
+  {
+    memcpy( p + GIDX(g,-1,j)*g->elsize, value, g->elsize );
+    memcpy( p + GIDX(g,g->nx,j)*g->elsize, value, g->elsize );
+  }
+  for( i=0; i<g->nx; i++ )
+  {
+    memcpy( p + GIDX(g,i,-1)*g->elsize, value, g->elsize );
+    memcpy( p + GIDX(g,i,g->ny)*g->elsize, value, g->elsize );
+  }
+}
+
+
+/*
+** ReadGridData: reads the interior of the grid from a headerless binary
+** file laid out like the old [nx][ny] arrays (y varying fastest).
+*/
+void ReadGridData( Grid *g, FILE *fp )
+{
+  long i;
+  char *p = (char *)g->data;
+
+  for( i=0; i<g->nx; i++ )
+    if( fread( p + GIDX(g,i,0)*g->elsize, g->elsize, g->ny, fp )
+        != (size_t)g->ny )
+    {
+      printf("Input file is too short for a %ld by %ld grid\n",
+             g->nx, g->ny );
+      exit(1);
+    }
+}
+
+
+/*
+** WriteGridData: writes the interior of the grid (no halo) in the same
+** layout that ReadGridData reads.
+*/
+void WriteGridData( Grid *g, FILE *fp )
+{
+  long i;
+  char *p = (char *)g->data;
+
+  for( i=0; i<g->nx; i++ )
+    fwrite( p + GIDX(g,i,0)*g->elsize, g->elsize, g->ny, fp );
+}
+
+
+
+/*
+** HostByteOrder: "little" or "big", for this machine.
+*/
+static const char *HostByteOrder( void )
+{
+  unsigned short one = 1;
+
+  return *(unsigned char *)&one ? "little" : "big";
+}
+
+
+static void BadGridHeader( char *filename, char *why )
+{
+  printf("The header of '%s' %s\n", filename, why );
+  exit(1);
+}
+
+
+/*
+** ParseGridHeader: reads the header of a grid file from the first |n|
+** bytes of the file, at |buf|. Returns 0 if the file has no header.
+*/
+static int ParseGridHeader( const char *buf, size_t n, GridHeader *h,
+                            char *filename )
+{
+  char text[GridHeaderLen+1], key[32], val[64], *line, *next;
+  int t, version, codec = 0;
+
+  memset( h, 0, sizeof( GridHeader ) );
+  if( n<GridHeaderLen || strncmp( buf, GridMagic " ", 8 )!=0 ) return 0;
+  memcpy( text, buf, GridHeaderLen );
+  text[GridHeaderLen] = '\0';
+  if( sscanf( text+8, "%d", &version )!=1 || version!=GridVersion )
+    BadGridHeader( filename, "has a version this program doesn't know" );
+
+  h->nx = h->ny = -1;
+  for( line=strchr( text, '\n' ); line!=NULL; line=next )
+  {
+    if( (next = strchr( ++line, '\n' ))!=NULL ) *next = '\0';
+    if( sscanf( line, "%31s %63s", key, val )!=2 ) continue;
+    if( strcmp( key, "ncols" )==0 ) h->nx = atol( val );
+    else if( strcmp( key, "nrows" )==0 ) h->ny = atol( val );
+    else if( strcmp( key, "type" )==0 )
+    {
+      for( t=1; t<NGridTypes && strcmp( val, GridTypeName[t] )!=0; t++ ) ;
+      if( t==NGridTypes )
+        BadGridHeader( filename, "gives an unknown element type" );
+      h->type = t;
+      h->elsize = GridTypeSize[t];
+    }
+    else if( strcmp( key, "nodata" )==0 )
+    {
+      h->nodata = atof( val );
+      h->hasnodata = 1;
+    }
+    else if( strcmp( key, "cellsize" )==0 ) h->cellsize = atof( val );
+    else if( strcmp( key, "tile" )==0 ) h->tile = atol( val );
+    else if( strcmp( key, "codec" )==0 )
+    {
+      if( strcmp( val, GridCodecName )!=0 )
+        BadGridHeader( filename, "gives a codec this program doesn't know" );
+      codec = 1;
+    }
+    else if( strcmp( key, "order" )==0 && strcmp( val, "xy" )!=0 )
+      BadGridHeader( filename, "gives an order of cells other than xy" );
+    else if( strcmp( key, "byteorder" )==0
+             && strcmp( val, HostByteOrder() )!=0 )
+      BadGridHeader( filename, "gives the other byte order" );
+  }
+  if( h->nx<1 || h->ny<1 || h->type==GridUnknown || h->tile<0 )
+    BadGridHeader( filename, "is missing its size or type" );
+  if( h->tile>GridMaxTile || (h->tile>0 && !codec) )
+    BadGridHeader( filename, "gives tiles this program can't read" );
+  return 1;
+}
+
+
+/*
+** WriteGridHeader: creates a grid file for |g|, as CreateGridFile does,
+** with its cells in |tile| by |tile| tiles if |tile| isn't 0.
+*/
+static FILE *WriteGridHeader( char *filename, Grid *g, int type,
+                              const double *nodata, double cellsize,
+                              long tile )
+{
+  char buf[GridHeaderLen+1];
+  int n;
+  FILE *fp;
+
+  if( (fp = fopen( filename, "wb" ))==NULL )
+  {
+    printf("Unable to create '%s'\n", filename );
+    exit(1);
+  }
+  n = sprintf( buf, "%s %d\nncols %ld\nnrows %ld\ntype %s\n", GridMagic,
+               GridVersion, g->nx, g->ny, GridTypeName[type] );
+  if( nodata!=NULL ) n += sprintf( buf+n, "nodata %.17g\n", *nodata );
+  if( cellsize>0 ) n += sprintf( buf+n, "cellsize %.17g\n", cellsize );
+  n += sprintf( buf+n, "order xy\ntile %ld\n", tile );
+  if( tile>0 ) n += sprintf( buf+n, "codec %s\n", GridCodecName );
+  n += sprintf( buf+n, "byteorder %s\n", HostByteOrder() );
+  memset( buf+n, ' ', GridHeaderLen-n );
+  buf[GridHeaderLen-1] = '\n';
+  fwrite( buf, 1, GridHeaderLen, fp );
+  return fp;
+}
+
+
+/*
+** CreateGridFile: creates a grid file for |g|, with cells of element
+** type |type|, and writes its header. |nodata| points to the no-data
+** value, if there is one, and |cellsize| is 0 if it isn't known. Returns
+** the file, ready for the cells (with WriteGridData, say).
+*/
+FILE *CreateGridFile( char *filename, Grid *g, int type,
+                      const double *nodata, double cellsize )
+{
+  return WriteGridHeader( filename, g, type, nodata, cellsize, 0 );
+}
+
+
+/*
+** WriteGridFile: writes all of |g| to a grid file, as CreateGridFile and
+** WriteGridData would, or if |tile| isn't 0 compressed in |tile| by
+** |tile| tiles (see gridcodec.h), on |nthreads| threads.
+*/
+void WriteGridFile( char *filename, Grid *g, int type, const double *nodata,
+                    double cellsize, long tile, int nthreads )
+{
+  FILE *fp;
+
+  if( GridTypeSize[type]!=g->elsize )
+  {
+    printf("A grid of %lu-byte cells can't be written as %s\n",
+           (unsigned long)g->elsize, GridTypeName[type] );
+    exit(1);
+  }
+  fp = WriteGridHeader( filename, g, type, nodata, cellsize, tile );
+  if( tile>0 ) WriteTiledGrid( g, tile, fp, nthreads );
+  else WriteGridData( g, fp );
+  if( fclose( fp )!=0 )
+  {
+    printf("Unable to write '%s'\n", filename );
+    exit(1);
+  }
+}
+
+
+/*
+** OpenGridFile: opens a grid file and reads its header into |h|, leaving
+** the file at the first cell. A file without a header is left at its
+** start, with h->type GridUnknown. (If h->tile isn't 0, what follows is
+** the index of the tiles; see gridcodec.h.)
+*/
+FILE *OpenGridFile( char *filename, GridHeader *h )
+{
+  char buf[GridHeaderLen];
+  size_t n;
+  FILE *fp;
+
+  if( (fp = fopen( filename, "rb" ))==NULL )
+  {
+    printf("Unable to find '%s'\n", filename );
+    exit( 0 );
+  }
+  n = fread( buf, 1, GridHeaderLen, fp );
+  if( !ParseGridHeader( buf, n, h, filename ) ) rewind( fp );
+  return fp;
+}
+
+
+/*
+** GridFileSize: sets |nx| and |ny| to the size of a grid file, if it has
+** a header. Returns 1 if it does.
+*/
+int GridFileSize( char *filename, long *nx, long *ny )
+{
+  GridHeader h;
+
+  fclose( OpenGridFile( filename, &h ) );
+  if( h.type==GridUnknown ) return 0;
+  *nx = h.nx;
+  *ny = h.ny;
+  return 1;
+}
+
+
+/*
+** MapGrid: maps a grid file (see MapGridFile). If |anyint| is set, a file
+** with a header may hold signed integers of any width; otherwise its
+** cells must be |elsize| bytes long.
+*/
+static Grid *MapGrid( char *filename, long nx, long ny, size_t elsize,
+                      int anyint, int sequential )
+{
+  Grid *g;
+  GridHeader h;
+  struct stat st;
+  char buf[GridHeaderLen];
+  size_t size, skip = 0;
+  ssize_t n;
+  void *p;
+  int fd;
+
+  if( (fd = open( filename, O_RDONLY ))<0 || fstat( fd, &st )!=0 )
+  {
+    printf("Unable to find '%s'\n", filename );
+    exit( 0 );
+  }
+  n = pread( fd, buf, GridHeaderLen, 0 );
+  if( ParseGridHeader( buf, n>0 ? n : 0, &h, filename ) )
+  {
+    if( nx>0 && (h.nx!=nx || h.ny!=ny) )
+    {
+      printf("'%s' is %ld by %ld, not %ld by %ld\n", filename, h.nx, h.ny,
+             nx, ny );
+      exit(1);
+    }
+    if( anyint ? h.type<GridInt8 || h.type>GridInt64 || h.type==GridUInt8
+               : h.elsize!=elsize )
+    {
+      printf("'%s' holds %s cells, not the kind wanted\n", filename,
+             GridTypeName[h.type] );
+      exit(1);
+    }
+    if( h.tile>0 )
+    {
+      close( fd );
+      return ReadTiledGrid( filename, GridThreads );
+    }
+    nx = h.nx;
+    ny = h.ny;
+    elsize = h.elsize;
+    skip = GridHeaderLen;
+  }
+  else if( nx<1 || ny<1 )
+  {
+    printf("'%s' has no header, so its size must be given\n", filename );
+    exit(1);
+  }
+  size = skip + (size_t)nx*ny*elsize;
+  if( (size_t)st.st_size < size )
+  {
+    printf("'%s' is too short for a %ld by %ld grid\n", filename, nx, ny );
+    exit(1);
+  }
+  p = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( p==MAP_FAILED )
+  {
+    printf("Unable to map '%s' into memory\n", filename );
+    exit(1);
+  }
+  madvise( p, size, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED );
+
+  g = (Grid *)malloc( sizeof( Grid ) );
+  g->nx = nx;
+  g->ny = ny;
+  g->halo = 0;
+  g->stride = ny;
+  g->ncells = (GridIndex)nx*ny;
+  g->elsize = elsize;
+  g->data = (char *)p + skip;
+  g->mapsize = size;
+  g->mapskip = skip;
+  g->type = h.type;
+
+  return g;
+}
+
+
+/*
+** MapGridFile: maps a binary grid file of |nx| by |ny| cells into memory,
+** read-only, and returns it as a grid without a halo. If the file has a
+** header, its size must match, and its cells must be |elsize| bytes
+** long; |nx| and |ny| may be 0 to take the size from the header. The
+** cells are read straight from the page cache as they are used. If
+** |sequential| is set, the kernel is told we'll be reading the file from
+** front to back, so it can read ahead aggressively.
+**
+** A tiled file can't be mapped like that, so it is decoded instead into
+** a new grid (with a halo), on as many threads as ThreadsOption was
+** given; callers that use GCELL and GIDX can't tell the difference.
+*/
+Grid *MapGridFile( char *filename, long nx, long ny, size_t elsize,
+                   int sequential )
+{
+  return MapGrid( filename, nx, ny, elsize, 0, sequential );
+}
+
+
+/*
+** MapIntGridFile: maps a grid file of signed integers (drainage areas,
+** say) as MapGridFile does. If the file has a header the integers may be
+** of any width, to be read with GINTK; without one they are longs.
+*/
+Grid *MapIntGridFile( char *filename, long nx, long ny, int sequential )
+{
+  return MapGrid( filename, nx, ny, sizeof( long ), 1, sequential );
+}
+
+
+/*
+** ThreadsOption: looks for "--threads N" among the command line arguments
+** and removes it, so that the other arguments keep their usual positions.
+** Returns N, or 1 if the option isn't there. N is also remembered for
+** decoding tiled files.
+*/
+int ThreadsOption( int *argc, char **argv )
+{
+  int i, n = 1;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--threads" )==0 )
+    {
+      if( i+1>=*argc || (n = atoi( argv[i+1] ))<1 )
+      {
+        printf("--threads needs a positive number of threads\n");
+        exit(1);
+      }
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      break;
+    }
+  return GridThreads = n;
+}
+
+
+/*
+** FlagOption: looks for the option |name| (e.g. "--fill") among the
+** command line arguments and removes it. Returns 1 if it is there, 0 if
+** not.
+*/
+int FlagOption( int *argc, char **argv, char *name )
+{
+  int i;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], name )==0 )
+    {
+      memmove( &argv[i], &argv[i+1], (*argc-i)*sizeof( char * ) );
+      (*argc)--;
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** CompressOption: looks for "--compress N" among the command line
+** arguments, as ThreadsOption does, for writing grid files compressed in
+** N by N tiles. Returns N, or 0 (no tiles) if the option isn't there.
+*/
+long CompressOption( int *argc, char **argv )
+{
+  int i;
+  long n = 0;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--compress" )==0 )
+    {
+      if( i+1>=*argc || (n = atol( argv[i+1] ))<1 || n>GridMaxTile )
+      {
+        printf("--compress needs a tile width from 1 to %d\n", GridMaxTile );
+        exit(1);
+      }
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      break;
+    }
+  return n;
+}
+
+
+static void *BandThread( void *b )
+{
+  ((GridBand *)b)->work( (GridBand *)b );
+  return NULL;
+}
+
+
+/*
+** RunBands: splits columns |lo| to |hi|-1 into |nthreads| bands of nearly
+** equal width and calls |work| on each band on its own thread. Each band
+** starts with its |count| tallies at zero; once all are done, they are
+** added into |count| (if it isn't NULL) in band order.
+*/
+void RunBands( long lo, long hi, int nthreads,
+               void (*work)( GridBand *b ), void *arg, long count[4] )
+{
+  GridBand *b;
+  pthread_t *thread;
+  int t, k;
+
+  if( nthreads<1 ) nthreads = 1;
+  if( nthreads>hi-lo ) nthreads = hi>lo ? hi-lo : 1;
+  b = (GridBand *)calloc( nthreads, sizeof( GridBand ) );
+  thread = (pthread_t *)malloc( nthreads*sizeof( pthread_t ) );
+  for( t=0; t<nthreads; t++ )
+  {
+    b[t].lo = lo + (hi-lo)*t/nthreads;
+    b[t].hi = lo + (hi-lo)*(t+1)/nthreads;
+    b[t].arg = arg;
+    b[t].work = work;
+  }
+
+  if( nthreads==1 ) work( &b[0] );
+  else
+  {
+    for( t=0; t<nthreads; t++ )
+      if( pthread_create( &thread[t], NULL, BandThread, &b[t] )!=0 )
+      {
+        printf("Unable to start thread %d\n", t );
+        exit(1);
+      }
+    for( t=0; t<nthreads; t++ ) pthread_join( thread[t], NULL );
+  }
+
+  if( count!=NULL )
+    for( t=0; t<nthreads; t++ )
+      for( k=0; k<4; k++ ) count[k] += b[t].count[k];
+  free( thread );
+  free( b );
+}
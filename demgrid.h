@@ -0,0 +1,126 @@
+/*
+**  demgrid.h: Run-time sized grids shared by the DEM tools.
+**
+**  A Grid holds an nx by ny array of cells of any element type. Cells are
+**  stored contiguously with the second (y) index varying fastest, just as
+**  in the old compile-time arrays such as elev[XSIZE][YSIZE], so a grid is
+**  read from and written to the same binary layout as before.
+**  Each grid carries a one-cell halo all the way around: cells (-1,-1)
+**  through (nx,ny) may be addressed, so 3x3 neighborhoods never need
+**  bounds checks. Linear indices are 64 bits wide so that grids of more
+**  than 2^31 cells work.
+**
+**  A grid may instead be a read-only view of a binary file mapped into
+**  memory (MapGridFile). Such a grid has no halo, since its cells are the
+**  bytes of the file itself, but it costs no copying, and several programs
+**  reading the same file share the same pages of memory.
+**
+**  Binary grid files start with a GridHeaderLen-byte text header, made by
+**  CreateGridFile and read by MapGridFile, OpenGridFile and GridFileSize:
+**  a line "DEMGRID 1", then "keyword value" lines giving the number of
+**  columns and rows, the element type (int8, uint8, int16, int32, int64,
+**  float32 or float64), the no-data value and cell size if known, the
+**  order of the cells ("xy": columns from west to east, each listed from
+**  south to north, y varying fastest), the tile size (0 for none) and the
+**  byte order, padded out with spaces. The cells follow, as before. So a
+**  program can tell how big a grid is and what it holds without being
+**  told, and map it without converting it. Files without a header are
+**  still read as before, given their size.
+**
+**  WriteGridFile can instead compress the cells in square tiles (the
+**  "--compress N" option of the programs that write grids; see
+**  gridcodec.h). MapGridFile reads such a file by decoding it into an
+**  ordinary grid, so programs that map their input take either kind.
+**
+**  RunBands splits the columns of a grid into bands and works on each
+**  band on its own thread. It suits 3x3 stencils: each band writes only
+**  its own columns, and reads one column into its neighbors' bands.
+*/
+
+#ifndef DEMGRID_H
+#define DEMGRID_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef long long GridIndex;   /* Linear index of a cell, halo included */
+
+#define GridHeaderLen 512     /* Bytes of header before the cells of a file */
+
+/* Element types of grid files */
+enum { GridUnknown, GridInt8, GridUInt8, GridInt16, GridInt32, GridInt64,
+       GridFloat32, GridFloat64 };
+
+/* The element type for the C integer type |t|, e.g. GridIntType(long) */
+#define GridIntType(t) \
+  ( sizeof(t)==1 ? GridInt8 : sizeof(t)==2 ? GridInt16 \
+    : sizeof(t)==4 ? GridInt32 : GridInt64 )
+
+/* What a grid file's header says */
+typedef struct
+{
+  long nx, ny;
+  int type;             /* GridUnknown if the file has no header */
+  size_t elsize;
+  double nodata;
+  int hasnodata;
+  double cellsize;      /* 0 if not known */
+  long tile;            /* Width of a square tile, or 0 if not tiled */
+} GridHeader;
+
+typedef struct
+{
+  long nx, ny;          /* Dimensions, not counting the halo */
+  int halo;             /* Width of the halo: 1, or 0 for a mapped file */
+  GridIndex stride;     /* Distance between cells (i,j) and (i+1,j) */
+  GridIndex ncells;     /* Total number of cells, halo included */
+  size_t elsize;        /* Size of one cell in bytes */
+  void *data;           /* Cell storage (cache-line aligned) */
+  size_t mapsize;       /* Length of the mapping, if the grid is a view */
+  size_t mapskip;       /* Bytes of header mapped before the cells */
+  int type;             /* From the file's header, if any; else 0 */
+} Grid;
+
+/* A band of columns lo to hi-1 of a grid, for RunBands */
+typedef struct GridBand
+{
+  long lo, hi;
+  void *arg;            /* Whatever the work function needs */
+  long count[4];        /* Tallies kept by the work function */
+  void (*work)( struct GridBand *b );
+} GridBand;
+
+/* Linear index of cell (i,j), and the cell itself viewed as a |type| */
+#define GIDX(g,i,j) \
+  (((GridIndex)(i)+(g)->halo)*(g)->stride + (j)+(g)->halo)
+#define GCELL(g,type,i,j) (((type *)(g)->data)[GIDX(g,i,j)])
+
+/* The cell at linear index k of a grid of signed integers of any width */
+#define GINTK(g,k) \
+  ( (g)->elsize==8 ? ((long long *)(g)->data)[k] \
+    : (g)->elsize==4 ? (long long)((int *)(g)->data)[k] \
+    : (g)->elsize==2 ? (long long)((short *)(g)->data)[k] \
+    : (long long)((signed char *)(g)->data)[k] )
+
+Grid *NewGrid( long nx, long ny, size_t elsize );
+void FreeGrid( Grid *g );
+void FillGrid( Grid *g, const void *value );
+void FillHalo( Grid *g, const void *value );
+void ReadGridData( Grid *g, FILE *fp );
+void WriteGridData( Grid *g, FILE *fp );
+Grid *MapGridFile( char *filename, long nx, long ny, size_t elsize,
+                   int sequential );
+Grid *MapIntGridFile( char *filename, long nx, long ny, int sequential );
+int GridFileSize( char *filename, long *nx, long *ny );
+FILE *OpenGridFile( char *filename, GridHeader *h );
+FILE *CreateGridFile( char *filename, Grid *g, int type,
+                      const double *nodata, double cellsize );
+void WriteGridFile( char *filename, Grid *g, int type, const double *nodata,
+                    double cellsize, long tile, int nthreads );
+int ThreadsOption( int *argc, char **argv );
+int FlagOption( int *argc, char **argv, char *name );
+long CompressOption( int *argc, char **argv );
+void RunBands( long lo, long hi, int nthreads,
+               void (*work)( GridBand *b ), void *arg, long count[4] );
+
+#endif
@@ -0,0 +1,518 @@
+/*
+** dempipe: runs the whole slope-area chain on a DEM in memory: depression
+**          filling (optional), flow directions, flow accumulation,
+**          steepest-descent slopes, and the slope-area data, without
+**          writing or re-reading anything in between.
+**
+**    The chain is a small graph of stages, each waiting only for the
+**    stages whose grids it reads: once the directions are found, the
+**    areas and the slopes are worked out at the same time, on their own
+**    threads. Each grid is freed as soon as the last stage that reads it
+**    is done, and only the outputs asked for are written (--out):
+**
+**      d8     <name>.d8, the flow directions (as flowdir --d8 a)
+**      area   <name>.flowacc, the drainage areas (as flowaccum)
+**      slope  steepslope.dat, the slopes (as steepslp)
+**      sa     slope.dat and area.dat, the slope-area data (as samask, or
+**             samask --bins N given --bins N); the default
+**
+**    Stages nothing asked for depend on are never run. The elevations are
+**    2-byte integers, as for flowdir, with no data at or below zero, and
+**    may come compressed in tiles; given --compress N, the area and
+**    slope grids are written that way too (see gridcodec.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "demgrid.h"
+#include "d8dir.h"
+#include "fill.h"
+#include "d8find.h"
+#include "flowacc.h"
+#include "sasort.h"
+#include "sabins.h"
+
+#define ELEV(i,j) GCELL(elevbuf.grid,short,i,j)
+#define DIR(i,j) GCELL(dirbuf.grid,unsigned char,i,j)
+#define AREA(i,j) GCELL(areabuf.grid,int,i,j)
+#define SLOPE(i,j) GCELL(slopebuf.grid,float,i,j)
+#define MASK(i,j) GCELL(mask,char,i,j)
+
+long XSIZE, YSIZE;
+int nthreads;       /* Threads for each stage (--threads N) */
+long ctile;         /* Tile width to compress the grids in (--compress N) */
+int fill;           /* Fill depressions first (--fill) */
+int flats;          /* Route flow across flats (--flats, or --fill) */
+int perdecade;      /* Area bins per decade (--bins N), or 0 to sort */
+long navg = 1;      /* Points to average in the sorted data (--avg N) */
+char *maskname;     /* Mask of the cells for the slope-area data (--mask) */
+char basename[80];
+
+
+/* A grid passed from stage to stage, and the number of stages yet to
+   read it */
+typedef struct
+{
+  Grid *grid;
+  int users;
+} Buffer;
+
+Buffer elevbuf, dirbuf, areabuf, slopebuf;
+
+
+/* The stages, in an order in which they could be run one at a time */
+enum { Fill, FlowDir, Accumulate, Slope, SlopeArea, NStages };
+enum { Waiting, Running, Ended, Finished };
+
+typedef struct
+{
+  char *name;
+  void (*run)();
+  int need[2];          /* Stages whose grids this one reads, or -1 */
+  Buffer *uses[2];      /* The grids it reads */
+  Buffer *makes;        /* The grid it makes, if any */
+  int wanted;           /* Needed for an output asked for */
+  int output;           /* Its output was asked for */
+  int nleft;            /* Stages it still waits for */
+  int state;
+  pthread_t thread;
+} Stage;
+
+void FillStage(), FlowDirStage(), AccumulateStage(), SlopeStage(),
+     SlopeAreaStage();
+
+Stage stage[NStages] = {
+  { "fill", FillStage, { -1, -1 }, { NULL, NULL }, NULL },
+  { "flowdir", FlowDirStage, { Fill, -1 }, { &elevbuf, NULL }, &dirbuf },
+  { "accumulate", AccumulateStage, { FlowDir, -1 }, { &dirbuf, NULL },
+    &areabuf },
+  { "slope", SlopeStage, { FlowDir, -1 }, { &elevbuf, &dirbuf },
+    &slopebuf },
+  { "slope-area", SlopeAreaStage, { Accumulate, Slope },
+    { &areabuf, &slopebuf }, NULL }
+};
+
+char *outname[NStages] = { NULL, "d8", "area", "slope", "sa" };
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ended = PTHREAD_COND_INITIALIZER;
+
+
+/*
+** FillStage: copies the mapped elevations into a grid of our own and
+** fills its depressions (see fill.c).
+*/
+void FillStage()
+{
+  Grid *filled;
+  long i, n;
+
+  filled = NewGrid( XSIZE, YSIZE, sizeof( short ) );
+  for( i=0; i<XSIZE; i++ )
+    memcpy( &GCELL(filled,short,i,0), &ELEV(i,0), YSIZE*sizeof( short ) );
+  FreeGrid( elevbuf.grid );
+  elevbuf.grid = filled;
+  n = FillDepressions( filled );
+  printf("fill: %ld cells raised.\n", n );
+}
+
+
+/*
+** FlowDirStage: finds the flow directions as flowdir does (see d8find.c),
+** routing flow across flats with --flats or --fill.
+*/
+void FlowDirStage()
+{
+  long nsinks, nambig, nrouted = 0;
+  char outfile[90];
+
+  dirbuf.grid = NewGrid( XSIZE, YSIZE, sizeof( unsigned char ) );
+  nsinks = FindD8Directions( elevbuf.grid, dirbuf.grid, NULL,
+                             flats ? 0 : -1, nthreads, &nambig );
+  if( flats )
+    nrouted = ResolveD8Flats( elevbuf.grid, dirbuf.grid, NULL, nsinks );
+  printf("flowdir: %ld sinks, %ld ambiguous flow directions.\n",
+         nsinks-nrouted, nambig );
+  if( stage[FlowDir].output )
+  {
+    sprintf( outfile, "%s.d8", basename );
+    WriteD8File( outfile, dirbuf.grid, 'a' );
+    printf("flowdir: wrote %s.\n", outfile );
+  }
+}
+
+
+/*
+** AccumulateStage: finds the drainage areas as flowaccum does: every
+** interior cell has an area of its own of one, and hands its area on to
+** the neighbor it drains to.
+*/
+void AccumulateStage()
+{
+  Grid *rcv;
+  long nloop;
+  char outfile[90];
+
+  areabuf.grid = NewGrid( XSIZE, YSIZE, sizeof( int ) );
+  rcv = BuildReceivers( dirbuf.grid, areabuf.grid, 0 );
+  nloop = AccumulateFlowParallel( rcv, areabuf.grid, nthreads );
+  FreeGrid( rcv );
+  if( nloop>0 )
+    printf("accumulate: %ld cells in or below flow loops.\n", nloop );
+  if( stage[Accumulate].output )
+  {
+    sprintf( outfile, "%s.flowacc", basename );
+    WriteGridFile( outfile, areabuf.grid, GridIntType( int ), NULL, 0, ctile,
+                   nthreads );
+    printf("accumulate: wrote %s.\n", outfile );
+  }
+}
+
+
+/*
+** SlopeStage: finds the slope along each cell's flow direction, as
+** steepslp does. (flowdir --slope finds them in the same pass as the
+** directions; here they're a stage of their own, so that they are worked
+** out while the areas are.)
+*/
+void SlopeStage()
+{
+  double nodata = SlopeNoData;
+
+  slopebuf.grid = NewGrid( XSIZE, YSIZE, sizeof( float ) );
+  FindD8Slopes( elevbuf.grid, dirbuf.grid, slopebuf.grid, nthreads );
+  if( stage[Slope].output )
+  {
+    WriteGridFile( "steepslope.dat", slopebuf.grid, GridFloat32, &nodata, 0,
+                   ctile, nthreads );
+    printf("slope: wrote steepslope.dat.\n");
+  }
+}
+
+
+/*
+** SlopeAreaStage: makes the slope-area data of the cells that have a
+** slope (and are set in the mask, given --mask), as samask does with a
+** slope ordinate: slopes are taken as percent rise, and areas converted
+** to square kilometers for 30m cells. Without --bins, the pairs are
+** sorted by area, and every navg of them averaged; with it, they are
+** gathered into bins of log area instead.
+*/
+void SlopeAreaStage()
+{
+  Grid *mask = NULL;
+  AreaBins *bins;
+  DataPair *data;
+  float *slp, *area;
+  long i, j, k, n, npts, nout;
+  FILE *fp;
+
+  if( maskname!=NULL )
+    mask = MapGridFile( maskname, XSIZE, YSIZE, sizeof( char ), 1 );
+
+  if( perdecade>0 )
+  {
+    bins = NewAreaBins( perdecade );
+    for( i=0; i<XSIZE; i++ )
+      for( j=0; j<YSIZE; j++ )
+        if( SLOPE(i,j)!=SlopeNoData && (mask==NULL || MASK(i,j)) )
+          AddToBins( bins, AREA(i,j), 0.01*SLOPE(i,j) );
+    printf("slope-area: %ld bins with data.\n", WriteAreaBins( bins ) );
+    FreeAreaBins( bins );
+    FreeGrid( mask );
+    return;
+  }
+
+  for( npts=0, i=0; i<XSIZE; i++ )
+    for( j=0; j<YSIZE; j++ )
+      if( SLOPE(i,j)!=SlopeNoData && (mask==NULL || MASK(i,j)) ) npts++;
+  if( npts==0 )
+  {
+    printf("slope-area: no cells have a slope.\n");
+    FreeGrid( mask );
+    return;
+  }
+  if( (data = (DataPair *)malloc( npts*sizeof( DataPair ) ))==NULL )
+  {
+    printf("Unable to allocate room for %ld data pairs\n", npts );
+    exit(1);
+  }
+  for( k=0, i=0; i<XSIZE; i++ )
+    for( j=0; j<YSIZE; j++ )
+      if( SLOPE(i,j)!=SlopeNoData && (mask==NULL || MASK(i,j)) )
+      {
+        data[k].sl = SLOPE(i,j);
+        data[k].ar = AREA(i,j);
+        k++;
+      }
+  FreeGrid( mask );
+  SortByArea( data, npts, nthreads );
+
+  /* Average every navg pairs; the last group may have fewer */
+  nout = (npts+navg-1)/navg;
+  slp = (float *)calloc( nout, sizeof( float ) );
+  area = (float *)calloc( nout, sizeof( float ) );
+  for( k=0; k<nout; k++ )
+  {
+    n = k<nout-1 ? navg : npts-k*navg;
+    for( i=k*navg; i<k*navg+n; i++ )
+    {
+      slp[k] += data[i].sl;
+      area[k] += data[i].ar;
+    }
+    slp[k] = slp[k]/(float)n;
+    slp[k] *= 0.01;
+    area[k] = 0.0009*area[k]/(float)n;
+  }
+  free( data );
+  fp = fopen( "slope.dat", "w" );
+  fwrite( slp, sizeof( float ), nout, fp );
+  fclose( fp );
+  fp = fopen( "area.dat", "w" );
+  fwrite( area, sizeof( float ), nout, fp );
+  fclose( fp );
+  free( slp );
+  free( area );
+  printf("slope-area: %ld pairs, %ld averaged points.\n", npts, nout );
+}
+
+
+void *StageThread( arg )
+void *arg;
+{
+  Stage *s = (Stage *)arg;
+
+  s->run();
+  pthread_mutex_lock( &lock );
+  s->state = Ended;
+  pthread_cond_signal( &ended );
+  pthread_mutex_unlock( &lock );
+  return NULL;
+}
+
+
+/*
+** Release: one reader of a buffer is done with it; the grid is freed
+** once the last one is.
+*/
+void Release( b )
+Buffer *b;
+{
+  if( b!=NULL && --b->users==0 )
+  {
+    FreeGrid( b->grid );
+    b->grid = NULL;
+  }
+}
+
+
+/*
+** RunStages: runs every stage wanted, each on its own thread as soon as
+** the stages it needs are finished, and waits for them all.
+*/
+void RunStages()
+{
+  int n, m, b, nleft = 0;
+  Stage *s;
+
+  /* Count what each stage waits for, and the readers of each grid */
+  for( n=0; n<NStages; n++ )
+  {
+    s = &stage[n];
+    if( !s->wanted ) continue;
+    nleft++;
+    s->state = Waiting;
+    for( m=0; m<2; m++ )
+    {
+      if( s->need[m]>=0 && stage[s->need[m]].wanted ) s->nleft++;
+      if( s->uses[m]!=NULL ) s->uses[m]->users++;
+    }
+  }
+
+  pthread_mutex_lock( &lock );
+  while( nleft>0 )
+  {
+    for( n=0; n<NStages; n++ )
+    {
+      s = &stage[n];
+      if( s->wanted && s->state==Waiting && s->nleft==0 )
+      {
+        printf("Starting %s...\n", s->name );
+        s->state = Running;
+        if( pthread_create( &s->thread, NULL, StageThread, s )!=0 )
+        {
+          printf("Unable to start the %s stage\n", s->name );
+          exit(1);
+        }
+      }
+    }
+
+    /* Wait for a stage to end, then let the stages that need it go, and
+       free the grids nobody reads any more */
+    for( ;; )
+    {
+      for( n=0; n<NStages && stage[n].state!=Ended; n++ );
+      if( n<NStages ) break;
+      pthread_cond_wait( &ended, &lock );
+    }
+    s = &stage[n];
+    pthread_join( s->thread, NULL );
+    s->state = Finished;
+    nleft--;
+    printf("Finished %s.\n", s->name );
+    for( m=0; m<NStages; m++ )
+      for( b=0; b<2; b++ )
+        if( stage[m].need[b]==n ) stage[m].nleft--;
+    for( b=0; b<2; b++ ) Release( s->uses[b] );
+    if( s->makes!=NULL && s->makes->users==0 )
+    {
+      FreeGrid( s->makes->grid );
+      s->makes->grid = NULL;
+    }
+  }
+  pthread_mutex_unlock( &lock );
+}
+
+
+/*
+** Want: marks a stage, and every stage it needs, as one to run.
+*/
+void Want( n )
+int n;
+{
+  int m;
+
+  if( n<0 || stage[n].wanted ) return;
+  if( n==Fill && !fill ) return;
+  stage[n].wanted = 1;
+  for( m=0; m<2; m++ ) Want( stage[n].need[m] );
+}
+
+
+/*
+** OutputOption: looks for "--out list" among the command line arguments
+** and removes it, marking the stages whose outputs are in the comma-
+** separated list. Without it, the slope-area data are the only output.
+*/
+void OutputOption( argc, argv )
+int *argc;
+char **argv;
+{
+  int i, n;
+  char *list = "sa", *p;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--out" )==0 )
+    {
+      if( i+1>=*argc )
+      {
+        printf("--out needs a list of outputs: d8, area, slope, sa\n");
+        exit(1);
+      }
+      list = argv[i+1];
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      break;
+    }
+
+  for( p=strtok( strdup( list ), "," ); p!=NULL; p=strtok( NULL, "," ) )
+  {
+    for( n=0; n<NStages && (outname[n]==NULL || strcmp( p, outname[n] )!=0);
+         n++ );
+    if( n==NStages )
+    {
+      printf("I don't know the output '%s': use d8, area, slope or sa\n", p );
+      exit(1);
+    }
+    stage[n].output = 1;
+    Want( n );
+  }
+}
+
+
+/*
+** ValueOption: looks for the option |name| followed by a value among the
+** command line arguments and removes both. Returns the value, or NULL if
+** the option isn't there.
+*/
+char *ValueOption( argc, argv, name )
+int *argc;
+char **argv, *name;
+{
+  int i;
+  char *value;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], name )==0 )
+    {
+      if( i+1>=*argc )
+      {
+        printf("%s needs a value\n", name );
+        exit(1);
+      }
+      value = argv[i+1];
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      return value;
+    }
+  return NULL;
+}
+
+
+void main( argc, argv )
+int argc;
+char **argv;
+{
+  char *value;
+  int i;
+
+  nthreads = ThreadsOption( &argc, argv );
+  ctile = CompressOption( &argc, argv );
+  fill = FlagOption( &argc, argv, "--fill" );
+  flats = FlagOption( &argc, argv, "--flats" ) || fill;
+  if( (value = ValueOption( &argc, argv, "--bins" ))!=NULL
+      && (perdecade = atoi( value ))<1 )
+  {
+    printf("--bins needs a positive number of bins per decade\n");
+    exit(1);
+  }
+  if( (value = ValueOption( &argc, argv, "--avg" ))!=NULL
+      && (navg = atol( value ))<1 )
+  {
+    printf("--avg needs a positive number of points\n");
+    exit(1);
+  }
+  maskname = ValueOption( &argc, argv, "--mask" );
+  OutputOption( &argc, argv );
+  if( argc < 2 )
+  {
+    printf("USAGE: %s <elevation file> [--fill] [--flats] [--out d8,area,slope,sa] [--bins N] [--avg N] [--mask file] [--threads N] [--compress N]\n",
+           argv[0] );
+    exit(0);
+  }
+
+  /* The output files go in the current directory, named after the
+     elevation file, up to any . */
+  value = strrchr( argv[1], '/' ) ? strrchr( argv[1], '/' )+1 : argv[1];
+  for( i=0; value[i]!='.' && value[i]!='\0' && i<79; i++ )
+    basename[i] = value[i];
+  basename[i] = '\0';
+
+  if( !GridFileSize( argv[1], &XSIZE, &YSIZE ) )
+  {
+    printf("Enter number of columns and rows in the elevation file: ");
+    if( scanf( "%ld %ld", &XSIZE, &YSIZE )!=2 ) XSIZE = 0;
+  }
+  if( XSIZE<3 || YSIZE<3 )
+  {
+    printf("Invalid grid dimensions\n");
+    exit(1);
+  }
+  printf("Reading <%s>...\n", argv[1] );
+  elevbuf.grid = MapGridFile( argv[1], XSIZE, YSIZE, sizeof( short ), 1 );
+
+  RunStages();
+  printf("All done!\n");
+}
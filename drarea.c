@@ -3,13 +3,25 @@
 */
 
 #include <stdio.h>
-
-#define XSIZE 609
-#define YSIZE 1765
-
-int area[XSIZE][YSIZE];
-short nbrx[XSIZE][YSIZE];
-short nbry[XSIZE][YSIZE];
+#include <stdlib.h>
+#include <string.h>
+#include "demgrid.h"
+#include "d8dir.h"
+#include "flowacc.h"
+
+/* Grid dimensions are read at run time; area and dir are XSIZE by YSIZE,
+   indexed [x][y] as in the flow direction files. The directions are kept
+   as one-byte ArcInfo codes (see d8dir.h), whether they come from a .d8
+   file or from a pair of .nbrx and .nbry files. */
+#define AREA(i,j) GCELL(area,int,i,j)
+#define DIR(i,j) GCELL(dir,unsigned char,i,j)
+#define NBRX(i,j) GCELL(nbrx,short,i,j)
+#define NBRY(i,j) GCELL(nbry,short,i,j)
+
+long XSIZE, YSIZE;
+Grid *area, *dir;
+int nthreads;       /* Threads to use for accumulation (--threads N) */
+long ctile;         /* Tile width to compress the areas in (--compress N) */
 
 
 void GetFileName( basename )
@@ -20,88 +32,119 @@ char *basename;
 }
 
 
+/*
+** GetGridSize: reads the size of the grid from the header of |filename|,
+** or asks for it if the file has none.
+*/
+void GetGridSize( filename )
+char *filename;
+{
+  if( !GridFileSize( filename, &XSIZE, &YSIZE ) )
+  {
+    printf("Enter number of columns and rows in the flow direction files: ");
+    if( scanf( "%ld %ld", &XSIZE, &YSIZE )!=2 ) XSIZE = 0;
+  }
+  if( XSIZE<3 || YSIZE<3 )
+  {
+    printf("Invalid grid dimensions\n");
+    exit(1);
+  }
+}
+
+
+/*
+** ReadFlowDirFiles: reads <basename>.d8 if there is one. Otherwise finds
+** the size of the grid (asking for it if the files have no header) and
+** reads the neighbor coordinates in
+** <basename>.nbrx and .nbry, converting them to direction codes. (The
+** .nbrx file holds the neighbor's y coordinate, and .nbry its x.)
+*/
 void ReadFlowDirFiles( basename )
 char *basename;
 {
-  int i;
-  FILE *fp;
   char outfile[80];
+  FILE *fp;
+  Grid *nbrx, *nbry;
+  long i, j;
+  int dx, dy;
+  unsigned char nodata = D8NoData;
 
-  /* Write x-direction file */
+  /* Read the one-byte direction file, if it's there */
   strcpy( outfile, basename );
-  strcat( outfile, ".nbrx" );
-  if( (fp = fopen( outfile, "r" ))==NULL )
+  strcat( outfile, ".d8" );
+  if( (fp = fopen( outfile, "r" ))!=NULL )
   {
-    printf( "Sorry, I can't find %s\n",outfile );
-    exit(1);
+    fclose( fp );
+    printf( "Reading %s...", outfile );
+    if( (dir = ReadD8File( outfile ))==NULL )
+    {
+      printf( "\n%s isn't a flow direction file\n", outfile );
+      exit(1);
+    }
+    XSIZE = dir->nx;
+    YSIZE = dir->ny;
+    printf( "done.\n" );
+    return;
   }
+
+  /* Map x-direction file into memory */
+  strcpy( outfile, basename );
+  strcat( outfile, ".nbrx" );
+  GetGridSize( outfile );
   printf( "Reading %s...", outfile );
-  fread( nbrx, sizeof( nbrx ), 1, fp );
-  fclose( fp );
+  nbrx = MapGridFile( outfile, XSIZE, YSIZE, sizeof( short ), 1 );
   printf( "done.\n" );
-printf("Area at (64,944) = %d\n",nbrx[64][944]);
 
-  /* Write y-direction file */
+  /* Map y-direction file into memory */
   strcpy( outfile, basename );
   strcat( outfile, ".nbry" );
-  if( (fp = fopen( outfile, "r" ))==NULL )
-  {
-    printf( "Sorry, I can't find %s\n",outfile );
-    exit(1);
-  }
   printf( "Reading %s...", outfile );
-  fread( nbry, sizeof( nbry ), 1, fp );
-  fclose( fp );
+  nbry = MapGridFile( outfile, XSIZE, YSIZE, sizeof( short ), 1 );
   printf( "done.\n" );
 
+  /* Convert to codes. Edge cells and cells without a direction (nbrx of
+     -1) have no data; a cell that points at itself is a sink. */
+  dir = NewGrid( XSIZE, YSIZE, sizeof( unsigned char ) );
+  FillGrid( dir, &nodata );
+  for( i=1; i<XSIZE-1; i++ ) for( j=1; j<YSIZE-1; j++ )
+    if( NBRX(i,j)> -1 )
+    {
+      dx = NBRY(i,j) - i;
+      dy = NBRX(i,j) - j;
+      if( dx>=-1 && dx<=1 && dy>=-1 && dy<=1 )
+        DIR(i,j) = D8Code[dx+1][dy+1];
+    }
+  FreeGrid( nbrx );
+  FreeGrid( nbry );
+
 }
 
 
-void StreamTrace()
+void FindContributingAreas()
 {
- int i, j,       /* counters for x and y coords    */
-     p, q,   /* x and y coords of cells traced along stream line */
-     newp,   /* used so that old value of p won't get lost   */
-     test;   /* counter tests for endless loops when cells   */
-             /*      point to one another.                   */
+  long i, j;
+  long nloop;    /* number of cells caught in flow loops */
+  Grid *rcv;
 
   printf("Computing contibuting areas...");
-  for( i=1; i<XSIZE-1; i++ )
-    for( j=1; j<YSIZE-1; j++ )
-      area[i][j] = 0;
+  area = NewGrid( XSIZE, YSIZE, sizeof( int ) );
 
-  for( i=1; i<XSIZE-2; i++ ) for( j=1; j<YSIZE-2; j++ )
-  {
-if( i>=64 ) {printf("\n[%d,%d] ",i,j);
-printf("<nbrx: %d> ",nbrx[i][j]);
-}    if( nbrx[i][j]> -1 )
-    {
-      p = i;
-      q = j;
-printf("bad ");
-      test = 0;
-printf("iw ");
-      while( p>0 && q>0 && p<XSIZE-1 && q<YSIZE-1 )
-      {
-        printf("(%d,%d) ",p,q);
-        area[p][q] ++;
-        test++;
-printf("yuk ");
-        if( test > 9980 )
-          printf( "-> (%d,%d) \n",p,q );
-        if( test > 10000 )
-        {
-          printf( "There seems to be an endless loop in StreamTrace.\n" );
-          exit( 0 );
-        }
-        newp = nbry[p][q];
-        q = nbrx[p][q];
-        p = newp;
-      }
-    }
-  }
+  /* Build the network of receivers for AccumulateFlow. Each interior
+     cell with data counts itself and passes its area on to its
+     neighbor, as long as that neighbor is interior too. Sinks, and cells
+     with no data, keep what they receive. As when every raindrop was
+     traced, none starts in the last interior column or row. */
+  rcv = BuildReceivers( dir, area, 1 );
+  for( i=1; i<XSIZE-1; i++ ) AREA(i,YSIZE-2) = 0;
+  for( j=1; j<YSIZE-1; j++ ) AREA(XSIZE-2,j) = 0;
+
+  nloop = AccumulateFlowParallel( rcv, area, nthreads );
+  FreeGrid( rcv );
 
   printf("done.\n");
+  if( nloop>0 )
+    printf("There are %ld cells in or below flow loops; their areas are incomplete.\n",
+           nloop );
 }
 
 
@@ -109,30 +152,31 @@ printf("yuk ");
 void WriteAreaFile( basename )
 char *basename;
 {
-  int i;
-  FILE *fp;
   char outfile[80];
 
-  /* Write x-direction file */
   strcpy( outfile, basename );
   strcat( outfile, ".area" );
-  fp = fopen( outfile, "w" );
   printf( "Writing %s...", outfile );
-  fwrite( area, sizeof( area ), 1, fp );
-  fclose( fp );
+  WriteGridFile( outfile, area, GridIntType( int ), NULL, 0, ctile,
+                 nthreads );
   printf( "done.\n" );
 }
 
 
 
 
-main()
+main( argc, argv )
+int argc;
+char **argv;
 {
   char fname[80];
 
+  nthreads = ThreadsOption( &argc, argv );
+  ctile = CompressOption( &argc, argv );
+
   GetFileName( fname );
   ReadFlowDirFiles( fname );
-  StreamTrace();
+  FindContributingAreas();
   WriteAreaFile( fname );
   printf( "All done!\n");
 
@@ -0,0 +1,150 @@
+/*
+**  fill.c: Fills the depressions (pits) of a DEM by priority-flood (see
+**          fill.h), so that every cell has a path down to the edge of
+**          the data that never goes uphill.
+**
+**  The flood starts from the cells on the edge of the data: those on the
+**  edge of the grid, and those next to a cell without data. Cells are
+**  taken in order of elevation, lowest first. Each one's neighbors that
+**  haven't been reached yet are added to the flood; any that lie below
+**  the cell are raised to its level, since water could only leave them
+**  by passing through it. Every cell is reached once, so the work is
+**  proportional to the number of cells plus the cost of the priority
+**  queue. Since the elevations are shorts, as everywhere else in the
+**  tools, the queue is an array of buckets, one per elevation, each a
+**  plain first-in-first-out list. The flood never goes back down to a
+**  lower bucket, so taking and adding a cell are O(1).
+**
+**  The grids must have a halo (i.e. not be mapped files).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fill.h"
+#include "d8dir.h"
+
+#define NLevels 32768       /* Number of possible (positive) short levels */
+
+typedef struct
+{
+  GridIndex *cell;
+  long head, n, size;       /* Next to take, number added, room */
+} CellQueue;
+
+
+static void Push( CellQueue *q, GridIndex k )
+{
+  if( q->n==q->size )
+  {
+    q->size = q->size ? 2*q->size : 64;
+    if( (q->cell = (GridIndex *)realloc( q->cell,
+                      q->size*sizeof( GridIndex ) ))==NULL )
+    {
+      printf("Unable to allocate the flood queue\n");
+      exit(1);
+    }
+  }
+  q->cell[q->n++] = k;
+}
+
+
+/*
+** MarkEdges: sets up the grid of cells the flood has reached. The halo
+** counts as reached, so the flood never leaves the grid; cells without
+** data are marked too, so it never enters them. Returns the grid.
+*/
+static Grid *MarkEdges( Grid *elev )
+{
+  Grid *closed;
+  unsigned char one = 1, *done;
+  long i, j;
+  GridIndex k;
+
+  closed = NewGrid( elev->nx, elev->ny, sizeof( unsigned char ) );
+  FillHalo( closed, &one );
+  done = (unsigned char *)closed->data;
+  for( i=0; i<elev->nx; i++ )
+    for( j=0; j<elev->ny; j++ )
+    {
+      k = GIDX(elev,i,j);
+      if( ((short *)elev->data)[k]<=0 ) done[k] = 1;
+    }
+  return closed;
+}
+
+
+/*
+** IsSeed: true if cell k (which has data) is on the edge of the data.
+*/
+static int IsSeed( Grid *elev, unsigned char *done, GridIndex k,
+                   GridIndex off[256], long i, long j )
+{
+  int n;
+
+  if( i==0 || j==0 || i==elev->nx-1 || j==elev->ny-1 ) return 1;
+  for( n=0; n<8; n++ )
+    if( done[k+off[D8Neighbors[n]]] ) return 1;
+  return 0;
+}
+
+
+/*
+** FillDepressions: fills the depressions of a grid of short elevations,
+** in which cells at or below zero have no data (as in flowdir). Returns
+** the number of cells raised.
+*/
+long FillDepressions( Grid *elev )
+{
+  short *e = (short *)elev->data;
+  unsigned char *done;
+  Grid *closed;
+  CellQueue *bucket;
+  GridIndex k, m, off[256];
+  long i, j, nraised = 0;
+  int level, n;
+
+  D8Offsets( elev, off );
+  closed = MarkEdges( elev );
+  done = (unsigned char *)closed->data;
+  bucket = (CellQueue *)calloc( NLevels, sizeof( CellQueue ) );
+
+  /* The edge of the data goes in first, each cell at its own level. (The
+     seeds are marked afterwards, so that marking one doesn't make its
+     neighbors look like edge cells.) */
+  for( i=0; i<elev->nx; i++ )
+    for( j=0; j<elev->ny; j++ )
+    {
+      k = GIDX(elev,i,j);
+      if( !done[k] && IsSeed( elev, done, k, off, i, j ) )
+        Push( &bucket[e[k]], k );
+    }
+  for( level=1; level<NLevels; level++ )
+    for( n=0; n<bucket[level].n; n++ ) done[bucket[level].cell[n]] = 1;
+
+  /* Work up through the levels; a bucket may grow while we empty it */
+  for( level=1; level<NLevels; level++ )
+  {
+    while( bucket[level].head < bucket[level].n )
+    {
+      k = bucket[level].cell[bucket[level].head++];
+      for( n=0; n<8; n++ )
+      {
+        m = k + off[D8Neighbors[n]];
+        if( done[m] ) continue;
+        done[m] = 1;
+        if( e[m]<level )
+        {
+          e[m] = level;
+          nraised++;
+        }
+        Push( &bucket[e[m]], m );
+      }
+    }
+    free( bucket[level].cell );
+  }
+
+  free( bucket );
+  FreeGrid( closed );
+  return nraised;
+}
@@ -0,0 +1,12 @@
+/*
+**  fill.h: Depression filling by priority-flood.
+*/
+
+#ifndef FILL_H
+#define FILL_H
+
+#include "demgrid.h"
+
+long FillDepressions( Grid *elev );
+
+#endif
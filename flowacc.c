@@ -0,0 +1,338 @@
+/*
+**  flowacc.c: Computes flow accumulation (contributing area) in one pass
+**             over the grid.
+**
+**  The flow network is given as a grid of receivers: for each cell, the
+**  linear index (GIDX) of the cell it drains to, or -1 if flow stops
+**  there. Each cell's area is its own contribution plus the areas of all
+**  the cells that drain to it. Rather than tracing a raindrop from every
+**  cell to the outlet, we count the donors of each cell and hand a cell's
+**  area on to its receiver only once all of its own donors have handed
+**  theirs in (a topological ordering, as in Kahn's algorithm). Every cell
+**  is visited exactly once, so the work is proportional to the number of
+**  cells no matter how long the rivers are.
+**
+**  Cells that never become ready lie on a loop in the flow directions (or
+**  downstream of one); they are counted rather than traced forever.
+**
+**  AccumulateFlowParallel does the same work on several threads. The D8
+**  network is a forest: every chain of cells started at a ridge runs down
+**  its own subtree until it reaches a confluence, and only the last chain
+**  to arrive at a confluence carries on below it. Donor counts are updated
+**  atomically, so whichever thread brings the count to zero owns the cell.
+**  Areas are integer sums, so the result is identical to the serial one
+**  whatever order the threads finish in. Ridges are handed out a row at a
+**  time from per-thread queues, and an idle thread steals rows from the
+**  far end of a busy thread's queue.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "flowacc.h"
+#include "d8dir.h"
+
+#define Done 0xFF   /* Donor count of a cell whose area is final */
+
+/* True if (i,j) is inside grid g and not on its edge */
+#define Interior(g,i,j) \
+  ( (i)>0 && (j)>0 && (i)<(g)->nx-1 && (j)<(g)->ny-1 )
+
+
+/*
+** BuildReceivers: makes the grid of receivers for AccumulateFlow from the
+** D8 direction grid |dir|, and sets each cell's own area in |area| (an
+** int grid of the same size). Every interior cell (one not on the edge
+** of the grid) has an area of one and drains to the neighbor its code
+** points at. Edge cells have no area of their own and drain nowhere,
+** though, like cells with no direction, they keep what drains to them.
+** If |interior| is set, as drarea has always done it, cells with no data
+** have no area of their own either, and a cell drains nowhere if its
+** neighbor is on the edge. Either way every receiver is on the grid.
+*/
+Grid *BuildReceivers( Grid *dir, Grid *area, int interior )
+{
+  Grid *rcv;
+  GridIndex off[256];
+  long i, j;
+  unsigned char c;
+
+  rcv = NewGrid( dir->nx, dir->ny, sizeof( GridIndex ) );
+  D8Offsets( rcv, off );
+  for( i=0; i<dir->nx; i++ )
+    for( j=0; j<dir->ny; j++ )
+    {
+      c = GCELL(dir,unsigned char,i,j);
+      GCELL(rcv,GridIndex,i,j) = -1;
+      GCELL(area,int,i,j) = 0;
+      if( !Interior(dir,i,j) || (interior && c==D8NoData) ) continue;
+      GCELL(area,int,i,j) = 1;
+      if( IsD8Dir(c)
+          && (!interior || Interior(dir,i+D8DX[c],j+D8DY[c])) )
+        GCELL(rcv,GridIndex,i,j) = GIDX(rcv,i,j) + off[c];
+    }
+  return rcv;
+}
+
+
+/*
+** AccumulateFlow: on entry |area| (an int grid) holds each cell's own
+** contribution, usually 1 or 0; on return it holds the total drainage
+** area of each cell. |rcv| is a GridIndex grid of the same size giving
+** each cell's receiver, which must be another cell of the grid (not the
+** halo), or -1. Returns the number of cells whose area could not be
+** completed because they are on or below a flow loop.
+*/
+long AccumulateFlow( Grid *rcv, Grid *area )
+{
+  GridIndex *to = (GridIndex *)rcv->data;
+  int *a = (int *)area->data;
+  unsigned char *ndon;
+  Grid *donors;
+  GridIndex k, c;
+  long i, j, nleft;
+
+  /* Count the donors of every cell. A D8 cell has at most 8 donors, plus
+     itself if it is a pit, so a byte is plenty. */
+  donors = NewGrid( rcv->nx, rcv->ny, sizeof( unsigned char ) );
+  ndon = (unsigned char *)donors->data;
+  for( i=0; i<rcv->nx; i++ )
+    for( j=0; j<rcv->ny; j++ )
+    {
+      k = GIDX(rcv,i,j);
+      if( to[k]>=0 ) ndon[to[k]]++;
+    }
+
+  /* Start from every cell that has no donors left and follow it
+     downstream, handing on its area, for as long as the cells we reach
+     have received from all of their donors. Each cell is finished, and
+     marked Done, exactly once. */
+  nleft = 0;
+  for( i=0; i<rcv->nx; i++ )
+    for( j=0; j<rcv->ny; j++ )
+    {
+      c = GIDX(rcv,i,j);
+      while( ndon[c]==0 )
+      {
+        ndon[c] = Done;
+        if( to[c]<0 ) break;
+        a[to[c]] += a[c];
+        c = to[c];
+        ndon[c]--;
+      }
+    }
+
+  /* Whatever is not Done is on or below a loop */
+  for( i=0; i<rcv->nx; i++ )
+    for( j=0; j<rcv->ny; j++ )
+      if( ndon[GIDX(rcv,i,j)]!=Done ) nleft++;
+
+  FreeGrid( donors );
+  return nleft;
+}
+
+
+/*
+** Per-thread state for AccumulateFlowParallel. Each thread's queue is the
+** range of rows [lo,hi) it has yet to scan for ridge cells; the owner takes
+** rows from the low end and thieves take them from the high end.
+*/
+typedef struct
+{
+  pthread_mutex_t lock;
+  long lo, hi;
+  double busy;          /* CPU seconds spent working */
+} RowQueue;
+
+typedef struct
+{
+  Grid *rcv, *area;
+  unsigned char *ndon;
+  RowQueue *queue;
+  int nthreads;
+  pthread_barrier_t counted;
+} AccumJob;
+
+typedef struct
+{
+  AccumJob *job;
+  int id;
+} AccumWorker;
+
+
+static double Seconds( clockid_t clock )
+{
+  struct timespec t;
+
+  clock_gettime( clock, &t );
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+
+/*
+** NextRow: returns the next row for thread |id| to scan, stealing one from
+** another thread if its own queue is empty, or -1 if no rows are left.
+*/
+static long NextRow( AccumJob *job, int id )
+{
+  RowQueue *q;
+  long row = -1;
+  int k;
+
+  q = &job->queue[id];
+  pthread_mutex_lock( &q->lock );
+  if( q->lo < q->hi ) row = q->lo++;
+  pthread_mutex_unlock( &q->lock );
+
+  for( k=1; row<0 && k<job->nthreads; k++ )
+  {
+    q = &job->queue[(id+k) % job->nthreads];
+    pthread_mutex_lock( &q->lock );
+    if( q->lo < q->hi ) row = --q->hi;
+    pthread_mutex_unlock( &q->lock );
+  }
+  return row;
+}
+
+
+/*
+** Claim: a cell may be finished by the thread that scans it as a ridge or
+** by the thread that delivers its last donor's area; whichever turns its
+** donor count from 0 to Done first does the work.
+*/
+static int Claim( unsigned char *ndon, GridIndex c )
+{
+  unsigned char zero = 0;
+
+  return __atomic_compare_exchange_n( &ndon[c], &zero, Done, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+}
+
+
+static void *AccumulateRows( void *arg )
+{
+  AccumWorker *w = (AccumWorker *)arg;
+  AccumJob *job = w->job;
+  Grid *rcv = job->rcv;
+  GridIndex *to = (GridIndex *)rcv->data;
+  int *a = (int *)job->area->data;
+  unsigned char *ndon = job->ndon;
+  GridIndex c, r;
+  long i, j, lo, hi;
+  double start = Seconds( CLOCK_THREAD_CPUTIME_ID );
+
+  /* Count donors over this thread's share of the rows */
+  lo = rcv->nx * w->id / job->nthreads;
+  hi = rcv->nx * (w->id+1) / job->nthreads;
+  for( i=lo; i<hi; i++ )
+    for( j=0; j<rcv->ny; j++ )
+    {
+      r = to[GIDX(rcv,i,j)];
+      if( r>=0 ) __atomic_add_fetch( &ndon[r], 1, __ATOMIC_RELAXED );
+    }
+  pthread_barrier_wait( &job->counted );
+
+  /* Walk down from each ridge cell for as long as we are the last donor
+     to arrive */
+  while( (i = NextRow( job, w->id ))>=0 )
+    for( j=0; j<rcv->ny; j++ )
+    {
+      c = GIDX(rcv,i,j);
+      if( !Claim( ndon, c ) ) continue;
+      while( (r = to[c])>=0 )
+      {
+        __atomic_add_fetch( &a[r], a[c], __ATOMIC_RELAXED );
+        if( __atomic_sub_fetch( &ndon[r], 1, __ATOMIC_ACQ_REL )!=0
+            || !Claim( ndon, r ) ) break;
+        c = r;
+      }
+    }
+  job->queue[w->id].busy = Seconds( CLOCK_THREAD_CPUTIME_ID ) - start;
+
+  return NULL;
+}
+
+
+/*
+** AccumulateFlowParallel: as AccumulateFlow, using |nthreads| threads, and
+** reports the speedup: to have something to compare with, AccumulateFlow
+** is first timed doing the same job on a copy of |area|, and the speedup
+** is its time divided by that of the threads. Also reported is how busy
+** the threads were: the CPU time they spent (atomics, stealing and all)
+** divided by the elapsed time, i.e. how many were working on average.
+*/
+long AccumulateFlowParallel( Grid *rcv, Grid *area, int nthreads )
+{
+  AccumJob job;
+  AccumWorker *worker;
+  pthread_t *thread;
+  Grid *donors, *copy;
+  double start, serial, elapsed, busy = 0.0;
+  long i, j, nleft = 0;
+  int t;
+
+  if( nthreads<=1 ) return AccumulateFlow( rcv, area );
+
+  /* Time the serial version first, on a copy of the areas */
+  copy = NewGrid( area->nx, area->ny, sizeof( int ) );
+  memcpy( copy->data, area->data, (size_t)area->ncells*sizeof( int ) );
+  start = Seconds( CLOCK_MONOTONIC );
+  AccumulateFlow( rcv, copy );
+  serial = Seconds( CLOCK_MONOTONIC ) - start;
+  FreeGrid( copy );
+
+  start = Seconds( CLOCK_MONOTONIC );
+  donors = NewGrid( rcv->nx, rcv->ny, sizeof( unsigned char ) );
+  job.rcv = rcv;
+  job.area = area;
+  job.ndon = (unsigned char *)donors->data;
+  job.nthreads = nthreads;
+  job.queue = (RowQueue *)malloc( nthreads*sizeof( RowQueue ) );
+  worker = (AccumWorker *)malloc( nthreads*sizeof( AccumWorker ) );
+  thread = (pthread_t *)malloc( nthreads*sizeof( pthread_t ) );
+  if( job.queue==NULL || worker==NULL || thread==NULL )
+  {
+    printf("Unable to allocate %d threads\n", nthreads );
+    exit(1);
+  }
+  pthread_barrier_init( &job.counted, NULL, nthreads );
+  for( t=0; t<nthreads; t++ )
+  {
+    pthread_mutex_init( &job.queue[t].lock, NULL );
+    job.queue[t].lo = rcv->nx * t / nthreads;
+    job.queue[t].hi = rcv->nx * (t+1) / nthreads;
+    worker[t].job = &job;
+    worker[t].id = t;
+  }
+  for( t=0; t<nthreads; t++ )
+    if( pthread_create( &thread[t], NULL, AccumulateRows, &worker[t] )!=0 )
+    {
+      printf("Unable to start thread %d\n", t );
+      exit(1);
+    }
+  for( t=0; t<nthreads; t++ )
+  {
+    pthread_join( thread[t], NULL );
+    busy += job.queue[t].busy;
+    pthread_mutex_destroy( &job.queue[t].lock );
+  }
+  pthread_barrier_destroy( &job.counted );
+
+  for( i=0; i<rcv->nx; i++ )
+    for( j=0; j<rcv->ny; j++ )
+      if( job.ndon[GIDX(rcv,i,j)]!=Done ) nleft++;
+  elapsed = Seconds( CLOCK_MONOTONIC ) - start;
+  printf("Accumulated flow on %d threads in %.3f s, against %.3f s on one "
+         "(speedup %.2f; busy %.1f of %d threads)\n", nthreads, elapsed,
+         serial, elapsed>0.0 ? serial/elapsed : 1.0,
+         elapsed>0.0 ? busy/elapsed : 1.0, nthreads );
+
+  FreeGrid( donors );
+  free( job.queue );
+  free( worker );
+  free( thread );
+  return nleft;
+}
+
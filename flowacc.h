@@ -0,0 +1,14 @@
+/*
+**  flowacc.h: Linear-time flow accumulation over a D8 flow network.
+*/
+
+#ifndef FLOWACC_H
+#define FLOWACC_H
+
+#include "demgrid.h"
+
+Grid *BuildReceivers( Grid *dir, Grid *area, int interior );
+long AccumulateFlow( Grid *rcv, Grid *area );
+long AccumulateFlowParallel( Grid *rcv, Grid *area, int nthreads );
+
+#endif
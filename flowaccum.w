@@ -8,10 +8,18 @@
 (drainage area) for a DEM, using a precomputed array of flow directions
 in ArcInfo format. The rationale behind the program is simply that
 ArcInfo's own flow accumulation function produces strange results.
+The optional argument \.{--threads N} spreads the work of reading the
+flow directions and accumulating flow over |N| threads.
+
+DEMs too big to fit in memory can be done a piece at a time: given
+\.{--tile N}, and a \.{.d8} flow direction file from \.{flowdir}, the
+program works on tiles of |N| by |N| cells, and only a tile per thread
+is in memory at once. The areas are written uncompressed then; otherwise
+\.{--compress N} compresses them in |N| by |N| tiles (see
+\.{gridcodec.h}).
 
 @c
 @<Header files to include@>@/
-@<Type declarations@>@/
 @<Global variables@>@/
 @<Function declarations@>
 
@@ -21,52 +29,67 @@ char **argv;
 {
         @<Variables local to |main|@>@#
 
-        @<Open input file, read flow directions and convert@>;
-	@<Compute flow accumulation@>;
-        @<Write output file@>;
+        nthreads = ThreadsOption( &argc, argv );
+        tile = TileOption( &argc, argv );
+        ctile = CompressOption( &argc, argv );
+        if( tile>0 ) {
+                @<Accumulate flow a tile at a time@>;
+        }
+        else {
+                @<Open input file, read flow directions and convert@>;
+                @<Compute flow accumulation@>;
+                @<Write output file@>;
+        }
         printf( "Done.\n" );
 }
 
 
-@ We'll need |stdio| to do file I/O.
+@ We'll need |stdio| to do file I/O, and the shared grid routines in
+\.{demgrid.c} to hold the data, those in \.{d8dir.c} for the flow
+directions, and those in \.{flowacc.c} to accumulate flow.
 
 @<Header files...@>=
 
 #include <stdio.h>
-
-
-@ Variable type |CellCoord| is used for |nbr| array.
-
-@<Type declarations@>=
-
-struct CellCoord        /* Structure stores the coords of a cell */
-{
-        int x;
-        int y;
-};
-
-
-@ We'll use 2 arrays: |flowdir| for the Arc-coded flow directions,
-and |area| to store the drainage area (in cells) for each cell.
+#include <stdlib.h>
+#include <string.h>
+#include "demgrid.h"
+#include "asciigrid.h"
+#include "d8dir.h"
+#include "flowacc.h"
+#include "tileacc.h"
+
+
+@ We'll use 2 grids: |dir| for the flow directions, kept as one-byte
+ArcInfo codes, and |area| to store the drainage area (in cells)
+for each cell. Both are |XSIZE| by |YSIZE|, dimensions that are taken
+from the header of the flow directions file, and both are allocated
+once we know them. The macros |DIR| and |AREA| give access to the
+cells just as the fixed arrays used to.
 |NoDataValue| is the code used by ArcInfo to indicate a cell for
 which data is missing or can't be computed.
 
-@d XSIZE 1765
-@d YSIZE 609
+@d DIR(i,j) GCELL(dir,unsigned char,i,j)
+@d AREA(i,j) GCELL(area,int,i,j)
 
 @<Global variables@>=
 
-struct CellCoord nbr[XSIZE][YSIZE];
-int area[XSIZE][YSIZE];
+long XSIZE, YSIZE;
+Grid *dir, *area;
 int NoDataValue;
+int nthreads;   /* Number of threads to accumulate flow with */
+long ctile;     /* Tile width to compress the areas in (--compress N) */
 
 
 @ @<Function declarations@>=
 
+long TileOption();
+
 
 @ @<Variables local to |main|@>=
 
 int i,j;
+long tile;      /* Width of the tiles, or 0 to do the grid in one go */
 
 
 @ Reading the input file and converting is placed in a separate function 
@@ -84,199 +107,106 @@ so as to minimize memory usage.
 	ReadAndConvert( filename )
 	char *filename;
 	{
-		FILE *fp;
-                int i,j,jj,nrows,ncols,tmp;
-                short temparr[XSIZE][YSIZE];
-		char tempstr[80];
-
-		@<Open the flow directions file@>;
-		@<Read the header@>;
-		@<Check that data file has the correct dimensions@>; 
-		@<Read the data and convert to cell coordinates@>;
-		fclose( fp );
-	}
-
-
-@ If the file can't be opened (i.e. found) exit with an error message.
-
-@<Open the flow directions file@>=
-
-        if( (fp=fopen( filename, "r" ))==NULL ) {
-                printf("Unable to find '%s'\n", filename );
-		exit( 0 );
-        }
-
-
-@ When ArcInfo creates an ASCII file from a grid, it writes a header 
-containing information about the file. Here we read the header, keeping
-some bits and discarding others.
+                int i,j;
 
-@<Read the header@>=
-
-        ncols = ReadHeaderLine( fp );
-        nrows = ReadHeaderLine( fp );
-        fgets( tempstr, 80, fp );
-        fgets( tempstr, 80, fp );
-        fgets( tempstr, 80, fp );
-        NoDataValue = ReadHeaderLine( fp );
-
-
-@ The function |ReadHeaderLine| reads 14 text characters (discarding them)
-followed by an integer, and finally the linefeed character after the 
-integer.
-
-@c
-int ReadHeaderLine( fp )
-FILE *fp;
-{
-        int i;
-
-        /* Read the text part and discard */
-        for( i=1; i<=14; i++ )
-                fgetc( fp );
-
-        /* Read the integer */
-        fscanf( fp, "%d", &i );
-
-        /* Read the line feed character */
-        fgetc( fp );
-
-        return( i );
-}
-
-
-@ The program is compiled for a grid of dimensions |XSIZE| by |YSIZE|.
-If these aren't the dimensions of the data file, we've got problems.
-
-@<Check that data...@>=
-
-        if( ncols!=XSIZE || nrows!=YSIZE )
-        {
-                printf("Program must be recompiled for %d by %d data\n",
-                        ncols, nrows );
-                exit( 0 );
-        }
+		@<Read the flow directions@>;
+		@<Allocate the area grid to fit@>;
+	}
 
 
-@ Here's the meat of the function: we read each flow direction one by
-one, and |switch| on it to find the appropriate neighbor coords.
+@ Here's the meat of the function: |ReadFlowDirections| (in
+\.{d8dir.c}) reads the flow directions in one go and keeps each as a
+single byte, which takes an eighth of the memory the old pairs of
+neighbor coordinates did. The file may be the ASCII kind that ArcInfo
+writes, whose header |OpenAsciiGrid| (in \.{asciigrid.c}) picks apart,
+or a \.{.d8} file written by \.{flowdir}. If the file can't be opened
+(i.e. found) it exits with an error message. |NoDataValue| is taken from
+the header's \.{NODATA\_value} line; if there isn't one we use
+ArcInfo's usual code.
 If the flow direction isn't a power of 2 (1, 2, ... 128), then the 
 flow direction is undefined (this shouldn't happen with a properly
-filled DEM).
+filled DEM); it is reported, and the cell treated as no-data.
 
-@<Read the data and convert...@>=
+@<Read the flow directions@>=
 
 	printf( "Reading <%s>\n", filename );
-        for( j=0; j<YSIZE; j++ )
-                for( i=0; i<XSIZE; i++ )
-                {
-			jj = (YSIZE-1)-j;
-			fscanf( fp, "%d", &tmp );
-			switch( tmp ) {
-				case 1:	nbr[i][jj].x = i+1; 
-					nbr[i][jj].y = jj; 
-					break;
-				case 2:	nbr[i][jj].x = i+1; 
-					nbr[i][jj].y = jj-1; 
-					break;
-				case 4:	nbr[i][jj].x = i; 
-					nbr[i][jj].y = jj-1; 
-					break;
-				case 8:	nbr[i][jj].x = i-1; 
-					nbr[i][jj].y = jj-1; 
-					break;
-				case 16: nbr[i][jj].x = i-1; 
-					nbr[i][jj].y = jj; 
-					break;
-				case 32: nbr[i][jj].x = i-1; 
-					nbr[i][jj].y = jj+1; 
-					break;
-				case 64: nbr[i][jj].x = i; 
-					nbr[i][jj].y = jj+1; 
-					break;
-				case 128: nbr[i][jj].x = i+1; 
-					nbr[i][jj].y = jj+1; 
-					break;
-				default:
-					printf("Undefined flow direction %d at %d,%d\n", tmp, i, jj );
-			}
-                }
+        dir = ReadFlowDirections( filename, 'a', &NoDataValue, nthreads );
         for( j=4; j>=0; j-- )
 	{
                 for( i=0; i<=4; i++ )
-			printf("(%d,%d)    ", nbr[i][j].x, nbr[i][j].y );
+			printf("(%d,%d)    ", i+D8DX[DIR(i,j)], j+D8DY[DIR(i,j)] );
 		printf( "\n" );
 	} 
 
 
-@ This function calculates flow accumulation.
+@ The grids are sized to match the data file, so any size of DEM can be
+processed without recompiling; the halo around |dir| is marked as
+no-data, and |area| starts out at zero.
 
-@<Compute flow...@>=
+@<Allocate the area grid...@>=
 
-        printf( "Computing flow accumulation...\n" );
-        StreamTrace();
+        XSIZE = dir->nx;
+        YSIZE = dir->ny;
+        area = NewGrid( XSIZE, YSIZE, sizeof( int ) );
 
 
-@ |StreamTrace| computes flow accumulation by incrementing each cell's
-drainage area by one (itself) and then moving from cell to cell down
-the network to increment all the cells to which the current cell drains.
-Think of it as a raindrop landing on each cell (incrementing its drainage
-area) and then flowing downhill to increment all the others in its path.
-The procedure is computationally more simple-minded (and less efficient)
-than, for example, working upstream along drainage networks first.
+@ This function calculates flow accumulation.
 
-@c
+@<Compute flow...@>=
 
-    StreamTrace()
-    {
-           int i, j,       /* counters for x and y coords    */
-                p, q,   /* x and y coords of cells traced along stream line */
-                newp,   /* used so that old value of p won't get lost   */
-                test;   /* counter tests for endless loops when cells   */
-                        /*      point to one another.                   */
-
-	for( i=1; i<XSIZE-1; i++ )
-	    for( j=1; j<YSIZE-1; j++ )
-                area[i][j] = 0;
-
-	for( i=1; i<XSIZE-1; i++ )
-	    for( j=1; j<YSIZE-1; j++ )
-            {
-                p = i;
-                q = j;
-                area[i][j] ++;
-                test = 0;
-                @<Trace down the net until reaching a boundary or NoData cell@>;
-            }
-    }
+        printf( "Computing flow accumulation...\n" );
+        FindFlowAccumulation();
 
 
-@ Here we flow downhill from cell to cell, incrementing the drainage area
-of each as we go, until reaching the edge of the grid or a depression.
+@ |FindFlowAccumulation| computes flow accumulation by giving each
+interior cell a drainage area of one (itself) and adding to it the areas
+of all the cells upstream. Think of it as a raindrop landing on each cell
+and then flowing downhill to increment all the others in its path,
+until it reaches the edge of the grid.
 (Of course there shouldn't be any @.BASIN@>s, but this way you can
 calculate drainage accumulation without first calculating an outlet
 for each depression. This might be useful, for example, in a karst
 terrain.)
 
-@<Trace down the net...@>=
+Rather than actually tracing each raindrop to the edge, which costs
+time in proportion to the length of the rivers, we work downstream from
+the ridges with |AccumulateFlow| (in \.{flowacc.c}), which hands each
+cell's area on to its neighbor only when the cell has heard from all of
+its own upstream neighbors. That way each cell is visited just once.
+Cells whose flow directions form a loop never hear from all their
+neighbors; rather than getting stuck, |AccumulateFlow| reports how many
+cells are in that state. With more than one thread,
+|AccumulateFlowParallel| works on separate branches of the network at
+once, and gives exactly the same areas.
 
-    while( p!=0 && q !=0 && p!=XSIZE-1 && q!=YSIZE-1 )
+@c
+
+    FindFlowAccumulation()
     {
-        test++;
-        if( test > 9980 )
-                printf( "-> (%d,%d) \n",p,q );
-        if( test > 10000 )
-	{
-            printf( "There seems to be an endless loop in StreamTrace.\n" );
-		exit( 0 );
-	}
-        newp = nbr[p][q].x;
-        q = nbr[p][q].y;
-        p = newp;
-        area[p][q] ++;
+           long nloop;     /* number of cells caught in flow loops */
+           Grid *rcv;      /* linear index of the cell each cell drains to */
+
+        @<Build the receiver grid and set each interior cell's own area@>;
+        nloop = AccumulateFlowParallel( rcv, area, nthreads );
+        FreeGrid( rcv );
+        if( nloop>0 )
+                printf( "There are %ld cells in or below flow loops; their areas are incomplete.\n",
+                        nloop );
     }
 
 
+@ Every interior cell drains to the neighbor its |dir| points at. Flow
+stops at the edge of the grid, so edge cells have no receiver and no
+area of their own, though they do collect the area of the cells that
+drain to them. A cell with no flow direction keeps what it receives.
+|BuildReceivers| (in \.{flowacc.c}, shared with \.{drarea} and
+\.{dempipe}) sets up |rcv| and the areas that way.
+
+@<Build the receiver grid...@>=
+
+        rcv = BuildReceivers( dir, area, 0 );
+
+
 
 @ And here we write the output file.
 
@@ -288,7 +218,6 @@ terrain.)
 @ @<Variables local to |main|@>+=
 
         char basename[80], outfile[80];
-	FILE *fp;
 
 
 @ @<Parse the file name...@>=
@@ -298,14 +227,71 @@ terrain.)
                 basename[i] = argv[1][i];
                 i++;
         }
+        basename[i] = '\0';
 
 @ @<Write flow accumulation...@>=
 
         strcpy( outfile, basename );
         strcat( outfile, ".flowacc" );
-        fp = fopen( outfile, "w" );
         printf( "...and '%s'...\n", outfile );
-        fwrite( area, sizeof( area ), 1, fp );
-        fclose( fp );
+        WriteGridFile( outfile, area, GridIntType( int ), NULL, 0, ctile,
+                       nthreads );
+
+
+
+
+@* Working in tiles. |AccumulateFlowTiled| (in \.{tileacc.c}) reads the
+flow directions from the \.{.d8} file a tile at a time and writes the
+areas straight to \.{<filename>.flowacc}, so neither grid has to fit in
+memory. It accumulates each tile on its own, works out how much flow
+crosses from tile to tile along their edges, and then does each tile
+again with that inflow added; see \.{tileacc.c} for the details. The
+areas are the same as those computed in one go.
+
+@<Accumulate flow a tile at a time@>=
+
+        @<Parse the file name...@>;
+        strcpy( outfile, basename );
+        strcat( outfile, ".flowacc" );
+        printf( "Computing flow accumulation in %ld by %ld tiles...\n",
+                tile, tile );
+        nloop = AccumulateFlowTiled( argv[1], outfile, tile, nthreads );
+        if( nloop>0 )
+                printf( "There are %ld cells in or below flow loops; their areas are incomplete.\n",
+                        nloop );
+        printf( "...and '%s'...\n", outfile );
+
+@ @<Variables local to |main|@>+=
 
+        long nloop;
 
+
+@ |TileOption| looks for \.{--tile N} among the arguments and removes it,
+as |ThreadsOption| does for \.{--threads}. Tiles are limited to 46340
+cells on a side, so that a cell can be numbered within its tile by an
+|int|.
+
+@c
+    long TileOption( argc, argv )
+    int *argc;
+    char **argv;
+    {
+        int i;
+        long n = 0;
+
+        for( i=1; i<*argc; i++ )
+                if( strcmp( argv[i], "--tile" )==0 )
+                {
+                        if( i+1>=*argc || (n = atol( argv[i+1] ))<2
+                            || n>46340 )
+                        {
+                                printf( "--tile needs a tile width from 2 to 46340\n" );
+                                exit( 1 );
+                        }
+                        memmove( &argv[i], &argv[i+2],
+                                 (*argc-i-1)*sizeof( char * ) );
+                        *argc -= 2;
+                        break;
+                }
+        return n;
+    }
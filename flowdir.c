@@ -3,34 +3,60 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "demgrid.h"
+#include "d8dir.h"
+#include "fill.h"
+#include "d8find.h"
 
-/*#define XSIZE 609 
-#define YSIZE 1765
-*/#define YSIZE 609 
-#define XSIZE 1765
+/* Grid dimensions are read at run time; elev and dir are both XSIZE by
+   YSIZE, indexed [x][y] as in the elevation file. Flow directions are
+   kept as one-byte ArcInfo codes (see d8dir.h) and only turned into
+   neighbor coordinates if they're written out as .nbrx and .nbry. */
+#define ELEV(i,j) GCELL(elev,short,i,j)
+#define DIR(i,j) GCELL(dir,unsigned char,i,j)
 
-short elev[XSIZE][YSIZE];
-short nbrx[XSIZE][YSIZE];
-short nbry[XSIZE][YSIZE];
+long XSIZE, YSIZE;
+Grid *elev, *dir;
+int d8format;       /* 'a' or 't' to write a .d8 file (--d8), else 0 */
+int nthreads;       /* Threads to search with (--threads N) */
+int fill;           /* Fill depressions first (--fill) */
+int flats;          /* Route flow across flats (--flats, or --fill) */
+float mindrop = -1; /* Drops must beat this to be taken (0 with --flats) */
+long nunresolved;   /* Cells found with no direction (sinks) */
+Grid *slope;        /* Steepest-descent slopes (--slope), else NULL */
+long ctile;         /* Tile width to compress the grids in (--compress N) */
 
 
 void ReadElevationFile( fname )
 char *fname;
 {
-  FILE *fp;
-  int i,j;
+  /* Map the binary file into memory (if not successful, quit with
+     error); the elevations are read in order, a column at a time */
+  elev = MapGridFile( fname, XSIZE, YSIZE, sizeof( short ), 1 );
 
-  /* Open the file (if not successful, quit with error) */
-  if( (fp=fopen(fname,"rb"))==NULL )
-  {
-    printf("Unable to open %s\n",fname);
-    exit(1);
-  }
+}
 
-  /* Read data in binary format, and close file */
-  fread( elev, sizeof( elev ), 1, fp );
-  fclose( fp );
 
+/*
+** FillElevations: copies the mapped elevations into a grid of our own and
+** fills its depressions, so that every cell with data has a way down to
+** the edge of the DEM and FindFlowDirections leaves no sinks inside it.
+** (Cells in a filled depression are left flat.)
+*/
+void FillElevations()
+{
+  Grid *filled;
+  long i;
+
+  printf("Filling depressions...");
+  filled = NewGrid( XSIZE, YSIZE, sizeof( short ) );
+  for( i=0; i<XSIZE; i++ )
+    memcpy( &GCELL(filled,short,i,0), &ELEV(i,0), YSIZE*sizeof( short ) );
+  FreeGrid( elev );
+  elev = filled;
+  printf("done. %ld cells raised.\n", FillDepressions( elev ) );
 }
 
 
@@ -42,53 +68,84 @@ char *elevname;
 }
 
 
+/*
+** GetGridSize: reads the size of the grid from the header of the
+** elevation file, or asks for it if the file has none.
+*/
+void GetGridSize( elevname )
+char *elevname;
+{
+  if( GridFileSize( elevname, &XSIZE, &YSIZE ) )
+    printf("The elevation file is %ld by %ld\n", XSIZE, YSIZE );
+  else
+  {
+    printf("Enter number of columns and rows in the elevation file: ");
+    if( scanf( "%ld %ld", &XSIZE, &YSIZE )!=2 ) XSIZE = 0;
+  }
+  if( XSIZE<3 || YSIZE<3 )
+  {
+    printf("Invalid grid dimensions\n");
+    exit(1);
+  }
+
+  /* The .nbrx and .nbry files hold neighbor coordinates as shorts */
+  if( d8format==0 && (XSIZE>32767 || YSIZE>32767) )
+  {
+    printf("Flow direction files can't address a %ld by %ld grid\n",
+           XSIZE, YSIZE );
+    exit(1);
+  }
+}
+
+
+/*
+** FindFlowDirections: searches each interior cell's neighbors for the
+** steepest drop (see d8find.c). Points with zero or lower elevation, and
+** the edges, have no data. With --slope, each cell's slope is found
+** along with its direction; cells that don't drain anywhere get the
+** no-data slope.
+*/
 void FindFlowDirections()
 {
-  int i, j, ii, jj;
-  float drop, maxdrop, root2recip = 0.70710678;  /* 1/sqrt(2) */
-  int nsink=0,            /* Number of sinks in the data */
-      nambig=0;           /* Number of locations w/ ambiguous flow dir'n */
+  long nambig;    /* Number of locations w/ ambiguous flow dir'n */
 
-  /* For each node in grid, not including edges, search neighbors and find
-     steepest drop. Don't consider points with zero or lower elevation */
   printf( "Computing flow directions...");
-  for( i=1; i<XSIZE-1; i++ )  
-    for( j=1; j<YSIZE-1; j++ )  
-      if( elev[i][j]>0 )
-      {
-        /* Find max drop to one of eight surrounding nodes, and store the
-           neighbor coordinates in nbrx and nbry arrays */
-        maxdrop = -1;
-        for( ii=i-1; ii<=i+1; ii++ )
-          for( jj=j-1; jj<=j+1; jj++ )
-          {
-            drop = elev[i][j]-elev[ii][jj];
-            if( i!=ii && j!=jj ) drop *= root2recip;
-            if( drop>maxdrop )
-            {
-              maxdrop = drop;
-              nbry[i][j] = ii;
-              nbrx[i][j] = jj;
-            }
-            else if( drop==maxdrop ) nambig++;
-          }
-          if( nbry[i][j]==i && nbrx[i][j]==j ) nsink++;
-      } 
-      else nbrx[i][j] = -1;
-
+  dir = NewGrid( XSIZE, YSIZE, sizeof( unsigned char ) );
+  nunresolved = FindD8Directions( elev, dir, slope, mindrop, nthreads,
+                                  &nambig );
   printf("done.\n");
-  printf("There are %d sinks in the data set.\n",nsink);
-  printf("There are %d ambiguous flow directions.\n",nambig);
+  printf("There are %ld sinks in the data set.\n",nunresolved);
+  printf("There are %ld ambiguous flow directions.\n",nambig);
 
 }
 
 
+/*
+** ResolveFlats: with --flats, FindFlowDirections leaves every cell
+** without a strictly lower neighbor as D8None, and ResolveD8Flats routes
+** each flat towards its outlets and away from the higher ground around
+** it, without loops (see d8find.c). With --slope, routed flat cells get
+** a slope of zero.
+*/
+void ResolveFlats()
+{
+  long nrouted;
+
+  printf("Resolving flats...");
+  nrouted = ResolveD8Flats( elev, dir, slope, nunresolved );
+  printf("done.\n");
+  printf("%ld flat cells routed, %ld sinks left.\n", nrouted,
+          nunresolved-nrouted );
+}
+
+
 void WriteFlowDirFiles( fname )
 char *fname;
 {
-  int i;
-  FILE *fp;
-  char basename[80], outfile[80];
+  int i, j;
+  unsigned char c;
+  Grid *nbrx, *nbry;
+  char basename[80], outfile[80], yfile[80];
 
   /* Parse the input (elevation) file name to remove anything following a . */
   i=0;
@@ -98,38 +155,118 @@ char *fname;
   }
   basename[i] = '\0';
 
-  /* Write x-direction file */
+  /* Write the one-byte direction file, if that's what was asked for */
+  if( d8format )
+  {
+    strcpy( outfile, basename );
+    strcat( outfile, ".d8" );
+    printf( "Writing %s...", outfile );
+    WriteD8File( outfile, dir, d8format );
+    printf( "done.\n" );
+    return;
+  }
+
+  /* Otherwise fill in the x- and y-direction grids and write them. As
+     always, .nbrx holds the neighbor's y coordinate (-1 for an interior
+     cell without data) and .nbry its x coordinate; edge cells are left
+     at zero. WriteGridFile compresses them in tiles with --compress N. */
   strcpy( outfile, basename );
   strcat( outfile, ".nbrx" );
-  fp = fopen( outfile, "w" );
-  printf( "Writing %s...", outfile );
-  fwrite( nbrx, sizeof( nbrx ), 1, fp );
-  fclose( fp );
+  strcpy( yfile, basename );
+  strcat( yfile, ".nbry" );
+  printf( "Writing %s...%s...", outfile, yfile );
+  nbrx = NewGrid( XSIZE, YSIZE, sizeof( short ) );
+  nbry = NewGrid( XSIZE, YSIZE, sizeof( short ) );
+  for( i=0; i<XSIZE; i++ )
+    for( j=0; j<YSIZE; j++ )
+    {
+      c = DIR(i,j);
+      if( c!=D8NoData )
+      {
+        GCELL(nbry,short,i,j) = i + D8DX[c];
+        GCELL(nbrx,short,i,j) = j + D8DY[c];
+      }
+      else if( i>0 && j>0 && i<XSIZE-1 && j<YSIZE-1 )
+        GCELL(nbrx,short,i,j) = -1;
+    }
+  WriteGridFile( outfile, nbrx, GridInt16, NULL, 0, ctile, nthreads );
+  WriteGridFile( yfile, nbry, GridInt16, NULL, 0, ctile, nthreads );
+  FreeGrid( nbrx );
+  FreeGrid( nbry );
   printf( "done.\n" );
 
-  /* Write y-direction file */
-  strcpy( outfile, basename );
-  strcat( outfile, ".nbry" );
-  fp = fopen( outfile, "w" );
-  printf( "Writing %s...", outfile );
-  fwrite( nbry, sizeof( nbry ), 1, fp );
-  fclose( fp );
+}
+
+
+/*
+** WriteSlopeFile: writes the slopes found with the flow directions, as
+** steepslp would: 4-byte floats, with SlopeNoData where a cell has no
+** direction.
+*/
+void WriteSlopeFile()
+{
+  double nodata = SlopeNoData;
+
+  printf( "Writing steepslope.dat..." );
+  WriteGridFile( "steepslope.dat", slope, GridFloat32, &nodata, 0, ctile,
+                 nthreads );
   printf( "done.\n" );
+}
+
 
+/*
+** D8Option: looks for "--d8 a" or "--d8 t" among the command line
+** arguments and removes it. Returns the encoding, or 0 if the option
+** isn't there.
+*/
+int D8Option( argc, argv )
+int *argc;
+char **argv;
+{
+  int i, format = 0;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--d8" )==0 )
+    {
+      if( i+1>=*argc || (argv[i+1][0]!='a' && argv[i+1][0]!='t') )
+      {
+        printf("--d8 needs an encoding: a (Arc/Info) or t (Tarboton)\n");
+        exit(1);
+      }
+      format = argv[i+1][0];
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      break;
+    }
+  return format;
 }
 
 
-main()
+main( argc, argv )
+int argc;
+char **argv;
 {
-  int i,j;
   char elevname[80];
+  int slopes;
+
+  d8format = D8Option( &argc, argv );
+  fill = FlagOption( &argc, argv, "--fill" );
+  flats = FlagOption( &argc, argv, "--flats" ) || fill;
+  if( flats ) mindrop = 0;
+  slopes = FlagOption( &argc, argv, "--slope" );
+  nthreads = ThreadsOption( &argc, argv );
+  ctile = CompressOption( &argc, argv );
 
   GetElevFileName( elevname );
+  GetGridSize( elevname );
+  if( slopes ) slope = NewGrid( XSIZE, YSIZE, sizeof( float ) );
   ReadElevationFile( elevname );
+  if( fill ) FillElevations();
   FindFlowDirections();
+  if( flats ) ResolveFlats();
   WriteFlowDirFiles( elevname );
+  if( slope!=NULL ) WriteSlopeFile();
 
   printf("All done!\n");
    
 }
-
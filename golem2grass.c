@@ -1,9 +1,45 @@
 /*
 ** golem2grass: Converts a GOLEM output file to an ascii file in a format that
 **              can be read by GRASS.
+**
+**              The conversion is pipelined: the input is mapped into memory,
+**              and the main thread (the reader) does nothing but find where
+**              each time step starts and ends, which only means counting
+**              white space. Each time step it finds goes into a queue, and a
+**              pool of worker threads (--threads N of them) takes steps off
+**              the queue and parses and writes them, so that several steps
+**              are converted at once. The queue holds at most QueueSteps
+**              steps per worker; when it is full the reader waits. Each
+**              worker keeps one grid of values, and writes it through the
+**              fixed-size buffers of asciiout.c, so the memory used doesn't
+**              grow with the number of steps. When there are fewer steps to
+**              convert than threads, the threads left over go to parsing and
+**              formatting each step in parallel.
+**
+**              Where each time step starts is kept in an index file,
+**              <input file>.idx, made by the first run on a file and used
+**              by every run after that (until the file changes), so that
+**              the steps wanted can be found without reading the ones
+**              before them. The steps can be picked with --steps, a list
+**              of times and ranges of times, e.g. "--steps 0-500,800,1000-".
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "demgrid.h"
+#include "asciigrid.h"
+#include "asciiout.h"
+
+#define IsSpace(c) ((c)==' ' || (c)=='\n' || (c)=='\r' || (c)=='\t')
+#define QueueSteps 2       /* Time steps waiting in the queue, per worker */
+#define TimeNameLen 20     /* As read by fgets in the original */
+#define IndexMagic "golem2grass index"
 
 
 /* CAUTION: This is the traditional K&R C (only) version of the Numerical
@@ -334,79 +370,465 @@ long nch,ncl,ndh,ndl,nrh,nrl;
 
 
 
+/* One time step: its name, as on its time line, and its values */
+typedef struct
+{
+  char timenm[TimeNameLen];
+  char *lo, *hi;
+} TimeStep;
+
+/* Time steps waiting to be converted */
+struct
+{
+  TimeStep *step;
+  int size, first, count;
+  int done;                       /* Set when the reader has finished */
+  pthread_mutex_t lock;
+  pthread_cond_t notempty, notfull;
+} queue = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+            PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Where a time step's time line starts in the file */
+typedef struct
+{
+  long time;
+  long offset;
+} StepStart;
+
+char *inname;              /* Name of the input file */
+int nx, ny;
+float dx;
+StepStart *stepstart;      /* The index: the start of each time step */
+long nsteps;
+long indexend;             /* Offset just past the last complete step */
+long (*steprange)[2];      /* Ranges of times picked by --steps */
+int nranges;
+float maxtime;             /* Without --steps, the last time step wanted */
+int readjustone;           /* ...and whether it's the only one */
+
+
+/*
+** GetLine: copies the text at |p| into |buf| as fgets would: up to and
+** including the next newline, but no more than |n|-1 characters.
+** Returns a pointer just past what was copied, or NULL at the end of the
+** file.
+*/
+char *GetLine( p, end, buf, n )
+char *p, *end, *buf;
+int n;
+{
+  int k = 0;
+
+  if( p>=end ) return NULL;
+  while( p<end && k<n-1 )
+    if( (buf[k++] = *p++)=='\n' ) break;
+  buf[k] = '\0';
+  return p;
+}
+
+
+/*
+** SkipValues: skips |n| values starting at |p|, and returns a pointer just
+** past the last, or NULL if the file ends first.
+*/
+char *SkipValues( p, end, n )
+char *p, *end;
+long n;
+{
+  for( ; n>0; n-- )
+  {
+    while( p<end && IsSpace(*p) ) p++;
+    if( p==end ) return NULL;
+    while( p<end && !IsSpace(*p) ) p++;
+  }
+  return p;
+}
+
+
+/*
+** BuildIndex: finds the start of every complete time step in the file,
+** going as the original did, from |p| just after the header: the line
+** after the rest of the current one is a time line, and nx*ny values
+** follow it.
+*/
+void BuildIndex( map, p, end )
+char *map, *p, *end;
+{
+  char timenm[TimeNameLen], *q;
+  long size = 64;
+
+  printf("Indexing the time steps of '%s'...\n", inname );
+  stepstart = (StepStart *)malloc( size*sizeof( StepStart ) );
+  nsteps = 0;
+  indexend = p - map;
+  while( (q = GetLine( p, end, timenm, TimeNameLen ))!=NULL
+         && (q = GetLine( q, end, timenm, TimeNameLen ))!=NULL )
+  {
+    if( nsteps==size )
+      stepstart = (StepStart *)realloc( stepstart,
+                                        (size *= 2)*sizeof( StepStart ) );
+    stepstart[nsteps].offset = q - map - strlen( timenm );
+    stepstart[nsteps].time = atoi( timenm );
+    if( (p = SkipValues( q, end, (long)nx*ny ))==NULL ) {
+      timenm[strlen(timenm)-1] = '\0';
+      printf( "'%s' ends in the middle of time step %s\n", inname, timenm );
+      break;
+    }
+    nsteps++;
+    indexend = p - map;
+  }
+}
+
+
+/*
+** ReadIndex: reads the index file |idxname|, if there is one and it was
+** made from the file as it is now (the same size and time of
+** modification). Returns 1 if it was read.
+*/
+int ReadIndex( idxname, st )
+char *idxname;
+struct stat *st;
+{
+  FILE *fp;
+  long size, mtime, k;
+  int ok;
+
+  if( (fp = fopen( idxname, "r" ))==NULL ) return 0;
+  ok = fscanf( fp, IndexMagic " %ld %ld %ld %ld", &size, &mtime, &nsteps,
+               &indexend )==4
+       && size==(long)st->st_size && mtime==(long)st->st_mtime
+       && nsteps>=0 && indexend<=size;
+  if( ok ) {
+    stepstart = (StepStart *)malloc( (nsteps+1)*sizeof( StepStart ) );
+    for( k=0; k<nsteps && ok; k++ )
+      ok = fscanf( fp, "%ld %ld", &stepstart[k].time,
+                   &stepstart[k].offset )==2
+           && stepstart[k].offset>=0 && stepstart[k].offset<indexend;
+    if( !ok ) free( stepstart );
+  }
+  fclose( fp );
+  return ok;
+}
+
+
+/*
+** WriteIndex: saves the index in |idxname|, as text: a line giving the
+** size and modification time of the file it was made from, the number of
+** complete time steps and where the last one ends, then the time and
+** starting offset of each step. A file that can't be written is no
+** matter; the next run will just index the steps again.
+*/
+void WriteIndex( idxname, st )
+char *idxname;
+struct stat *st;
+{
+  FILE *fp;
+  long k;
+
+  if( (fp = fopen( idxname, "w" ))==NULL ) return;
+  fprintf( fp, IndexMagic " %ld %ld %ld %ld\n", (long)st->st_size,
+           (long)st->st_mtime, nsteps, indexend );
+  for( k=0; k<nsteps; k++ )
+    fprintf( fp, "%ld %ld\n", stepstart[k].time, stepstart[k].offset );
+  fclose( fp );
+}
+
+
+/*
+** StepsOption: looks for "--steps LIST" among the command line arguments
+** and removes it. LIST is a comma-separated list of times (t) and ranges
+** of times (t1-t2, or t1- for t1 onwards). Returns 1 if the option is
+** there.
+*/
+int StepsOption( argc, argv )
+int *argc;
+char **argv;
+{
+  int i;
+  char *p, *q;
+
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--steps" )==0 ) break;
+  if( i==*argc ) return 0;
+  if( i+1>=*argc ) {
+    printf("--steps needs a list of time steps, e.g. 0-500,800,1000-\n");
+    exit(1);
+  }
+  steprange = (long (*)[2])malloc( (strlen( argv[i+1] )/2+1)
+                                   *sizeof( *steprange ) );
+  for( p=argv[i+1]; ; p++ )
+  {
+    steprange[nranges][0] = strtol( p, &q, 10 );
+    if( q==p ) break;
+    steprange[nranges][1] = steprange[nranges][0];
+    if( *q=='-' ) {
+      p = q+1;
+      steprange[nranges][1] = strtol( p, &q, 10 );
+      if( q==p ) steprange[nranges][1] = 2000000000L;
+    }
+    nranges++;
+    p = q;
+    if( *p!=',' ) break;
+  }
+  if( *p!='\0' || nranges==0 ) {
+    printf("I can't make sense of '--steps %s' near '%s'\n", argv[i+1], p );
+    exit(1);
+  }
+  memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+  *argc -= 2;
+  return 1;
+}
+
+
+/*
+** StepWanted: whether the time step at |time| is to be written: if it is
+** picked by --steps, or otherwise, as before, if it is the time step
+** given or (without s) any step before it.
+*/
+int StepWanted( time )
+long time;
+{
+  int r;
+
+  if( nranges==0 ) return !readjustone || time==maxtime;
+  for( r=0; r<nranges; r++ )
+    if( time>=steprange[r][0] && time<=steprange[r][1] ) return 1;
+  return 0;
+}
+
+
+/*
+** PutStep: adds a time step to the queue, waiting while the queue is full.
+*/
+void PutStep( s )
+TimeStep *s;
+{
+  pthread_mutex_lock( &queue.lock );
+  while( queue.count==queue.size )
+    pthread_cond_wait( &queue.notfull, &queue.lock );
+  queue.step[(queue.first+queue.count++) % queue.size] = *s;
+  pthread_cond_signal( &queue.notempty );
+  pthread_mutex_unlock( &queue.lock );
+}
+
+
+/*
+** GetStep: takes the next time step off the queue, waiting while it is
+** empty. Returns 0 once the queue is empty and the reader has finished.
+*/
+int GetStep( s )
+TimeStep *s;
+{
+  pthread_mutex_lock( &queue.lock );
+  while( queue.count==0 && !queue.done )
+    pthread_cond_wait( &queue.notempty, &queue.lock );
+  if( queue.count==0 )
+  {
+    pthread_mutex_unlock( &queue.lock );
+    return 0;
+  }
+  *s = queue.step[queue.first];
+  queue.first = (queue.first+1) % queue.size;
+  queue.count--;
+  pthread_cond_signal( &queue.notfull );
+  pthread_mutex_unlock( &queue.lock );
+  return 1;
+}
+
+
+/*
+** FormatRow: formats row |j| of a time step, each value as a whole number
+** of hundredths followed by a space.
+*/
+char *FormatRow( arg, j, p )
+void *arg;
+long j;
+char *p;
+{
+  Grid *g = (Grid *)arg;
+  float *val = &GCELL(g,float,0,g->ny-1-j);
+  long i;
+
+  for( i=0; i<g->nx; i++ )
+  {
+    p = FormatLong( p, (long)(val[i*g->stride]*100) );
+    *p++ = ' ';
+  }
+  *p++ = '\n';
+  return p;
+}
+
+
+/*
+** WriteStep: parses the values of a time step into |g| and writes them
+** to <input file>.<time>, in GRASS ASCII format, a row at a time in the
+** order they are read, on |nthreads| threads.
+*/
+void WriteStep( s, g, nthreads )
+TimeStep *s;
+Grid *g;
+int nthreads;
+{
+  char outname[256], stepname[256];
+  AsciiGrid f;
+  FILE *fpout;
+
+  sprintf( stepname, "time step %s of %.200s", s->timenm, inname );
+  memset( &f, 0, sizeof( f ) );
+  f.name = stepname;
+  f.ncols = nx;
+  f.nrows = ny;
+  f.map = s->lo;
+  f.size = s->hi - s->lo;
+  ReadAsciiFloats( &f, g, nthreads );
+
+  printf( "Writing time step %s\n", s->timenm );
+  sprintf( outname, "%.200s.%s", inname, &s->timenm[1] );
+  if( (fpout = fopen( outname, "w" ))==NULL ) {
+    printf("Unable to write '%s'\n", outname );
+    exit(1);
+  }
+  fprintf( fpout, "north:   %6.2f\n", dx*ny );
+  fprintf( fpout, "south:   000000.00\n" );
+  fprintf( fpout, "east:    %6.2f\n", dx*nx );
+  fprintf( fpout, "west:    000000.00\n" );
+  fprintf( fpout, "rows:    %d\n", ny );
+  fprintf( fpout, "cols:    %d\n", nx );
+  WriteAsciiRows( fpout, ny, (size_t)nx*21 + 1, FormatRow, g, nthreads );
+  fclose( fpout );
+}
+
+
+/*
+** Worker: converts time steps off the queue until there are no more, each
+** on |*arg| threads of its own.
+*/
+void *Worker( arg )
+void *arg;
+{
+  TimeStep s;
+  Grid *g;
+
+  g = NewGrid( nx, ny, sizeof( float ) );
+  while( GetStep( &s ) ) WriteStep( &s, g, *(int *)arg );
+  FreeGrid( g );
+  return NULL;
+}
+
+
 void main( argc, argv )
 int argc;
 char **argv;
 {
-  float **dat;
-  int nx,ny,i,j;
-  float dx, maxtime, time;
-  int readjustone=0;
-  FILE *fp, *fpout;
-  char timenm[80], outname[80];
+  int nthreads, nworkers, rowthreads, usesteps, t;
+  long time, k, nwanted;
+  char timenm[TimeNameLen], idxname[256], *map, *p, *end, *q;
+  double v[3];
+  TimeStep s;
+  pthread_t *worker;
+  struct stat st;
+  int fd;
+
+  nthreads = ThreadsOption( &argc, argv );
+  usesteps = StepsOption( &argc, argv );
 
   /* Check for correct number of command line arguments */
-  if( argc<3 ) {
-    printf("USAGE: %s <input file> <time step> [s=single time step only]\n",
+  if( argc<(usesteps ? 2 : 3) ) {
+    printf("USAGE: %s <input file> <time step> [s=single time step only] [--threads N]\n",
             argv[0] );
-    exit();
+    printf("       %s <input file> --steps <times, e.g. 0-500,800,1000-> [--threads N]\n",
+            argv[0] );
+    exit(1);
   }
 
-  /* Open the file */
-  if( (fp = fopen( argv[1], "r"))==NULL ) {
+  /* Map the file */
+  inname = argv[1];
+  if( (fd = open( argv[1], O_RDONLY ))<0 || fstat( fd, &st )!=0 ) {
     printf("I can't find '%s'\n",argv[1]);
-    exit();
+    exit(0);
+  }
+  map = (char *)mmap( NULL, st.st_size>0 ? st.st_size : 1, PROT_READ,
+                      MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( map==MAP_FAILED ) {
+    printf("Unable to read '%s'\n", argv[1] );
+    exit(1);
   }
+  end = map + st.st_size;
 
   /* Read the header info */
-  fscanf( fp, "%d", &nx );
-  fscanf( fp, "%d", &ny );
-  fscanf( fp, "%f", &dx );
-
-  /* Allocate memory */
-  dat = matrix(0,nx-1,0,ny-1);
-
-  /* Get the largest time step to read */
-  maxtime = atoi( argv[2] );
-  if( maxtime<0 || maxtime>=1e9 ) {
-    printf("Invalid time step: %f ('%s')\n",maxtime, argv[2] );
-    exit();
+  p = map;
+  for( t=0; t<3; t++ ) {
+    while( p<end && IsSpace(*p) ) p++;
+    if( (q = ScanFloat( p, end, 0, &v[t] ))==NULL ) {
+      printf("I can't make sense of the header of '%s'\n", argv[1] );
+      exit(1);
+    }
+    p = q;
   }
-
-  /* Check for the "read just one" option */
-  if( argc==4 && argv[3][0]=='s' ) readjustone=1;
-
-  /* Read each time step, and write to file */ 
-  do {
-    fgets( timenm, 20, fp );
-    fgets( timenm, 20, fp );
-    timenm[strlen(timenm)-1] = '\0';
-    time = atoi( timenm );
-    printf( "Reading time step %s\n", timenm );
-    for( j=0; j<ny; j++ )
-      for( i=0; i<nx; i++ )
-        fscanf( fp, "%f", &dat[i][j] );
-    if( !readjustone || time==maxtime ) {
-      printf( "Writing time step.\n" );
-      strcpy( outname, argv[1] );
-      strcat( outname, "." );
-      strcat( outname, &timenm[1] );
-      fpout = fopen( outname, "w" );
-      fprintf( fpout, "north:   %6.2f\n", dx*ny );
-      fprintf( fpout, "south:   000000.00\n" );
-      fprintf( fpout, "east:    %6.2f\n", dx*nx );
-      fprintf( fpout, "west:    000000.00\n" );
-      fprintf( fpout, "rows:    %d\n", ny );
-      fprintf( fpout, "cols:    %d\n", nx );
-      for( j=0; j<ny; j++ )
-      {
-        for( i=0; i<nx; i++ )
-          fprintf( fpout, "%d ", (long)(dat[i][j]*100) );
-        fprintf( fpout, "\n" );
-      }
-      fclose( fpout );
+  nx = (int)v[0];
+  ny = (int)v[1];
+  dx = v[2];
+
+  if( !usesteps ) {
+    /* Get the largest time step to read */
+    maxtime = atoi( argv[2] );
+    if( maxtime<0 || maxtime>=1e9 ) {
+      printf("Invalid time step: %f ('%s')\n",maxtime, argv[2] );
+      exit(1);
     }
-  } while( time < maxtime ); 
 
+    /* Check for the "read just one" option */
+    if( argc==4 && argv[3][0]=='s' ) readjustone=1;
+  }
+
+  /* Find where the time steps start, from the index if it's up to date */
+  sprintf( idxname, "%.200s.idx", argv[1] );
+  if( !ReadIndex( idxname, &st ) ) {
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+    BuildIndex( map, p, end );
+    WriteIndex( idxname, &st );
+  }
+
+  /* Share the threads out: one worker per time step, as far as they go,
+     and the rest to each step's parsing and formatting */
+  for( k=0, nwanted=0; k<nsteps; k++ ) {
+    nwanted += StepWanted( stepstart[k].time );
+    if( nranges==0 && stepstart[k].time>=maxtime ) break;
+  }
+  nworkers = nwanted<nthreads ? (nwanted>0 ? nwanted : 1) : nthreads;
+  rowthreads = nthreads/nworkers;
+
+  /* Start the workers */
+  queue.size = QueueSteps*nworkers;
+  queue.step = (TimeStep *)malloc( queue.size*sizeof( TimeStep ) );
+  worker = (pthread_t *)malloc( nworkers*sizeof( pthread_t ) );
+  for( t=0; t<nworkers; t++ )
+    pthread_create( &worker[t], NULL, Worker, &rowthreads );
+
+  /* Queue each time step wanted to be written */
+  for( k=0; k<nsteps; k++ ) {
+    time = stepstart[k].time;
+    if( StepWanted( time ) ) {
+      p = GetLine( map + stepstart[k].offset, end, timenm, TimeNameLen );
+      timenm[strlen(timenm)-1] = '\0';
+      printf( "Reading time step %s\n", timenm );
+      strcpy( s.timenm, timenm );
+      s.lo = p;
+      s.hi = map + (k+1<nsteps ? stepstart[k+1].offset : indexend);
+      PutStep( &s );
+    }
+    if( nranges==0 && time>=maxtime ) break;
+  }
+  if( !usesteps && k==nsteps )
+    printf( "'%s' ends before time step %g\n", argv[1], maxtime );
+
+  /* Let the workers finish what's queued */
+  pthread_mutex_lock( &queue.lock );
+  queue.done = 1;
+  pthread_cond_broadcast( &queue.notempty );
+  pthread_mutex_unlock( &queue.lock );
+  for( t=0; t<nworkers; t++ )
+    pthread_join( worker[t], NULL );
+  munmap( map, st.st_size );
 }
- 
@@ -0,0 +1,445 @@
+/*
+**  gridcodec.c: Lossless compression of grid files, in tiles (see
+**               gridcodec.h).
+**
+**  The coder needs nothing but the grid: prediction from neighbors that
+**  are already decoded, then zero runs and varints, much as PNG predicts
+**  each row from the one before but without a general purpose compressor
+**  after it. DEMs change slowly from cell to cell and flow direction
+**  grids are mostly long runs, so most differences fit in a byte and
+**  many vanish altogether. Tiles are decoded straight into the grid they
+**  belong to, with no copy of the whole file in between.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gridcodec.h"
+
+#define VarintMax 10       /* Longest varint: 64 bits, seven to a byte */
+
+/* What the threads of WriteTiledGrid and ReadTiledGrid share */
+typedef struct
+{
+  Grid *g;
+  TiledGrid *t;             /* For reading */
+  long tile, nty;           /* For writing... */
+  unsigned char **buf;      /* ...each tile, compressed */
+  size_t *len;
+} CodecJob;
+
+
+/*
+** LoadCell: the cell at |p|, |elsize| bytes wide, as a signed integer.
+*/
+static long long LoadCell( const char *p, size_t elsize )
+{
+  switch( elsize )
+  {
+    case 1: return *(const signed char *)p;
+    case 2: return *(const short *)p;
+    case 4: return *(const int *)p;
+    default: return *(const long long *)p;
+  }
+}
+
+
+static void StoreCell( char *p, size_t elsize, unsigned long long v )
+{
+  switch( elsize )
+  {
+    case 1: *(unsigned char *)p = (unsigned char)v; break;
+    case 2: *(unsigned short *)p = (unsigned short)v; break;
+    case 4: *(unsigned int *)p = (unsigned int)v; break;
+    default: *(unsigned long long *)p = v;
+  }
+}
+
+
+/*
+** WrapCell: |v| cut down to |elsize| bytes and sign extended again, so
+** that a difference that wraps around a short cell comes out small.
+*/
+static unsigned long long WrapCell( unsigned long long v, size_t elsize )
+{
+  switch( elsize )
+  {
+    case 1: return (long long)(signed char)v;
+    case 2: return (long long)(short)v;
+    case 4: return (long long)(int)v;
+    default: return v;
+  }
+}
+
+
+static unsigned long long Magnitude( unsigned long long d )
+{
+  return (long long)d<0 ? -d : d;
+}
+
+
+/*
+** Predict: the prediction for cell |b| of the tile column |col|; |west|
+** is the column before it in the tile, or NULL for the first. Encoder and
+** decoder call this with the same cells, so they always agree.
+*/
+static unsigned long long Predict( const char *col, const char *west,
+                                   long b, size_t elsize, int mode )
+{
+  unsigned long long s, w, sw, ps, pw, psw;
+
+  if( b==0 ) return west==NULL ? 0 : LoadCell( west, elsize );
+  s = LoadCell( col + (b-1)*elsize, elsize );
+  if( mode==GridCodecDelta || west==NULL ) return s;
+  w = LoadCell( west + b*elsize, elsize );
+  sw = LoadCell( west + (b-1)*elsize, elsize );
+  ps = Magnitude( w - sw );          /* |(s+w-sw) - s|, and so on */
+  pw = Magnitude( s - sw );
+  psw = Magnitude( s + w - sw - sw );
+  if( ps<=pw && ps<=psw ) return s;
+  return pw<=psw ? w : sw;
+}
+
+
+static size_t PutVarint( unsigned char *p, unsigned long long v )
+{
+  size_t n = 0;
+
+  while( v>=0x80 )
+  {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+
+/*
+** GetVarint: reads a varint at |*p|, no further than |end|, into |*v|.
+** Returns 0 if it runs off the end or is too long.
+*/
+static int GetVarint( const unsigned char **p, const unsigned char *end,
+                      unsigned long long *v )
+{
+  int shift;
+
+  *v = 0;
+  for( shift=0; *p<end && shift<7*VarintMax; shift+=7 )
+  {
+    *v |= (unsigned long long)(**p & 0x7f) << shift;
+    if( (*(*p)++ & 0x80)==0 ) return 1;
+  }
+  return 0;
+}
+
+
+/*
+** EncodeTile: compresses the |w| by |h| cells of |g| from (i0,j0) into
+** |out| with predictor |mode|. Gives up once it has written more than
+** |limit| bytes (|out| must have room for 2*VarintMax+1 more than that).
+** Returns the length.
+*/
+static size_t EncodeTile( Grid *g, long i0, long j0, long w, long h,
+                          int mode, unsigned char *out, size_t limit )
+{
+  size_t elsize = g->elsize, n = 0;
+  const char *col, *west = NULL;
+  unsigned long long r, run = 0;
+  long a, b;
+
+  out[n++] = (unsigned char)mode;
+  for( a=0; a<w; a++ )
+  {
+    col = (const char *)g->data + GIDX(g,i0+a,j0)*elsize;
+    for( b=0; b<h; b++ )
+    {
+      r = WrapCell( LoadCell( col + b*elsize, elsize )
+                    - Predict( col, west, b, elsize, mode ), elsize );
+      if( r==0 )
+      {
+        run++;
+        continue;
+      }
+      if( run>0 )
+      {
+        out[n++] = 0;
+        n += PutVarint( out+n, run-1 );
+        run = 0;
+      }
+      n += PutVarint( out+n, (r<<1) ^ (0 - (r>>63)) );
+      if( n>limit ) return n;
+    }
+    west = col;
+  }
+  if( run>0 )
+  {
+    out[n++] = 0;
+    n += PutVarint( out+n, run-1 );
+  }
+  return n;
+}
+
+
+/*
+** EncodeBand: compresses every tile in tile columns b->lo to b->hi-1,
+** keeping whichever predictor does better, or the cells as they are if
+** neither helps.
+*/
+static void EncodeBand( GridBand *b )
+{
+  CodecJob *job = (CodecJob *)b->arg;
+  Grid *g = job->g;
+  long tile = job->tile, tx, ty, w, h, a;
+  size_t elsize = g->elsize, raw, n, m, room;
+  unsigned char *s1, *s2, *best, *p;
+
+  room = 1 + (size_t)tile*tile*elsize + 2*VarintMax+1;
+  s1 = (unsigned char *)malloc( room );
+  s2 = (unsigned char *)malloc( room );
+  if( s1==NULL || s2==NULL )
+  {
+    printf("Unable to allocate room to compress a tile\n");
+    exit(1);
+  }
+
+  for( tx=b->lo; tx<b->hi; tx++ )
+    for( ty=0; ty<job->nty; ty++ )
+    {
+      w = g->nx - tx*tile < tile ? g->nx - tx*tile : tile;
+      h = g->ny - ty*tile < tile ? g->ny - ty*tile : tile;
+      raw = 1 + (size_t)w*h*elsize;
+      n = EncodeTile( g, tx*tile, ty*tile, w, h, GridCodecDelta, s1, raw );
+      m = EncodeTile( g, tx*tile, ty*tile, w, h, GridCodecPaeth, s2,
+                      n<raw ? n : raw );
+      best = m<n ? s2 : s1;
+      if( m<n ) n = m;
+      if( n>=raw ) n = raw;
+      if( (p = (unsigned char *)malloc( n ))==NULL )
+      {
+        printf("Unable to allocate room for a compressed tile\n");
+        exit(1);
+      }
+      if( n<raw ) memcpy( p, best, n );
+      else
+      {
+        p[0] = GridCodecRaw;
+        for( a=0; a<w; a++ )
+          memcpy( p + 1 + a*h*elsize,
+                  (char *)g->data + GIDX(g,tx*tile+a,ty*tile)*elsize,
+                  h*elsize );
+      }
+      job->buf[tx*job->nty+ty] = p;
+      job->len[tx*job->nty+ty] = n;
+    }
+
+  free( s1 );
+  free( s2 );
+}
+
+
+/*
+** WriteTiledGrid: writes the index and the compressed tiles of |g|, in
+** |tile| by |tile| tiles, to |fp|, which must be just past a header that
+** says so (see WriteGridFile). The tiles are compressed on |nthreads|
+** threads, each taking a band of tile columns, and held in memory until
+** all are done, since the index comes first.
+*/
+void WriteTiledGrid( Grid *g, long tile, FILE *fp, int nthreads )
+{
+  CodecJob job;
+  unsigned long long *index;
+  long ntx, k, n;
+
+  ntx = (g->nx + tile-1)/tile;
+  job.g = g;
+  job.tile = tile;
+  job.nty = (g->ny + tile-1)/tile;
+  n = ntx*job.nty;
+  job.buf = (unsigned char **)malloc( n*sizeof( unsigned char * ) );
+  job.len = (size_t *)malloc( n*sizeof( size_t ) );
+  index = (unsigned long long *)malloc( (n+1)*sizeof( unsigned long long ) );
+  if( job.buf==NULL || job.len==NULL || index==NULL )
+  {
+    printf("Unable to allocate the index of %ld tiles\n", n );
+    exit(1);
+  }
+  RunBands( 0, ntx, nthreads, EncodeBand, &job, NULL );
+
+  index[0] = 0;
+  for( k=0; k<n; k++ ) index[k+1] = index[k] + job.len[k];
+  fwrite( index, sizeof( unsigned long long ), n+1, fp );
+  for( k=0; k<n; k++ )
+  {
+    fwrite( job.buf[k], 1, job.len[k], fp );
+    free( job.buf[k] );
+  }
+  free( job.buf );
+  free( job.len );
+  free( index );
+}
+
+
+/*
+** OpenTiledGrid: maps a tiled grid file into memory and checks its index.
+** Nothing is decoded until asked for.
+*/
+TiledGrid *OpenTiledGrid( char *filename )
+{
+  TiledGrid *t;
+  struct stat st;
+  size_t start, n;
+  void *p;
+  int fd;
+
+  t = (TiledGrid *)malloc( sizeof( TiledGrid ) );
+  t->filename = filename;
+  fclose( OpenGridFile( filename, &t->h ) );
+  if( t->h.type==GridUnknown || t->h.tile<1 )
+  {
+    printf("'%s' isn't a tiled grid file\n", filename );
+    exit(1);
+  }
+  t->ntx = (t->h.nx + t->h.tile-1)/t->h.tile;
+  t->nty = (t->h.ny + t->h.tile-1)/t->h.tile;
+  n = (size_t)t->ntx*t->nty;
+  start = GridHeaderLen + (n+1)*sizeof( unsigned long long );
+
+  if( (fd = open( filename, O_RDONLY ))<0 || fstat( fd, &st )!=0 )
+  {
+    printf("Unable to find '%s'\n", filename );
+    exit( 0 );
+  }
+  if( (size_t)st.st_size < start )
+  {
+    printf("'%s' is too short for its index of tiles\n", filename );
+    exit(1);
+  }
+  p = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( p==MAP_FAILED )
+  {
+    printf("Unable to map '%s' into memory\n", filename );
+    exit(1);
+  }
+  t->map = (char *)p;
+  t->mapsize = st.st_size;
+  t->index = (const unsigned long long *)(t->map + GridHeaderLen);
+  t->data = (const unsigned char *)(t->map + start);
+  t->datalen = st.st_size - start;
+  if( t->index[0]!=0 || t->index[n]>t->datalen )
+  {
+    printf("'%s' is too short for the tiles its index lists\n", filename );
+    exit(1);
+  }
+  return t;
+}
+
+
+void CloseTiledGrid( TiledGrid *t )
+{
+  munmap( t->map, t->mapsize );
+  free( t );
+}
+
+
+static void CorruptTile( TiledGrid *t, long tx, long ty )
+{
+  printf("Tile %ld,%ld of '%s' is corrupt\n", tx, ty, t->filename );
+  exit(1);
+}
+
+
+/*
+** DecodeGridTile: decompresses tile (tx,ty) of |t| into |g|, its cell
+** (0,0) going to cell (i0,j0). |g| may be the whole grid, with i0 and j0
+** tx and ty times the tile size, or just big enough for one tile.
+*/
+void DecodeGridTile( TiledGrid *t, long tx, long ty, Grid *g,
+                     long i0, long j0 )
+{
+  size_t elsize = t->h.elsize;
+  long tile = t->h.tile, k = tx*t->nty+ty, w, h, a, b;
+  const unsigned char *p, *end;
+  unsigned long long z, run = 0;
+  char *col, *west = NULL;
+  int mode;
+
+  w = t->h.nx - tx*tile < tile ? t->h.nx - tx*tile : tile;
+  h = t->h.ny - ty*tile < tile ? t->h.ny - ty*tile : tile;
+  if( g->elsize!=elsize || i0<0 || j0<0 || i0+w>g->nx || j0+h>g->ny )
+  {
+    printf("Tile %ld,%ld of '%s' doesn't fit where it was to go\n", tx, ty,
+           t->filename );
+    exit(1);
+  }
+  if( t->index[k]>=t->index[k+1] || t->index[k+1]>t->datalen )
+    CorruptTile( t, tx, ty );
+  p = t->data + t->index[k];
+  end = t->data + t->index[k+1];
+  mode = *p++;
+
+  if( mode==GridCodecRaw )
+  {
+    if( (size_t)(end-p) != (size_t)w*h*elsize ) CorruptTile( t, tx, ty );
+    for( a=0; a<w; a++ )
+      memcpy( (char *)g->data + GIDX(g,i0+a,j0)*elsize, p + a*h*elsize,
+              h*elsize );
+    return;
+  }
+  if( mode!=GridCodecDelta && mode!=GridCodecPaeth ) CorruptTile( t, tx, ty );
+
+  for( a=0; a<w; a++ )
+  {
+    col = (char *)g->data + GIDX(g,i0+a,j0)*elsize;
+    for( b=0; b<h; b++ )
+    {
+      z = 0;
+      if( run>0 ) run--;
+      else if( p<end && *p==0 )
+      {
+        p++;
+        if( !GetVarint( &p, end, &run ) ) CorruptTile( t, tx, ty );
+      }
+      else if( !GetVarint( &p, end, &z ) ) CorruptTile( t, tx, ty );
+      StoreCell( col + b*elsize, elsize, Predict( col, west, b, elsize, mode )
+                 + ((z>>1) ^ (0 - (z&1))) );
+    }
+    west = col;
+  }
+  if( run>0 || p!=end ) CorruptTile( t, tx, ty );
+}
+
+
+static void DecodeBand( GridBand *b )
+{
+  CodecJob *job = (CodecJob *)b->arg;
+  long tx, ty, tile = job->t->h.tile;
+
+  for( tx=b->lo; tx<b->hi; tx++ )
+    for( ty=0; ty<job->t->nty; ty++ )
+      DecodeGridTile( job->t, tx, ty, job->g, tx*tile, ty*tile );
+}
+
+
+/*
+** ReadTiledGrid: reads a tiled grid file into a new grid (with a halo,
+** of zeros), decoding the tiles on |nthreads| threads, each taking a
+** band of tile columns.
+*/
+Grid *ReadTiledGrid( char *filename, int nthreads )
+{
+  CodecJob job;
+
+  job.t = OpenTiledGrid( filename );
+  madvise( job.t->map, job.t->mapsize, MADV_WILLNEED );
+  job.g = NewGrid( job.t->h.nx, job.t->h.ny, job.t->h.elsize );
+  job.g->type = job.t->h.type;
+  RunBands( 0, job.t->ntx, nthreads, DecodeBand, &job, NULL );
+  CloseTiledGrid( job.t );
+  return job.g;
+}
@@ -0,0 +1,69 @@
+/*
+**  gridcodec.h: Lossless compression of grid files, in tiles.
+**
+**  A grid file whose header gives "tile N" (N>0) and "codec predrle" has
+**  its cells cut into N by N tiles (smaller along the north and east
+**  edges), each compressed on its own. The header is followed by an
+**  index of 8-byte offsets, in the byte order of the header: where each
+**  tile starts, counted from the end of the index, tile (tx,ty) being
+**  number tx*nty+ty, and then where the last one ends. Then come the
+**  tiles, in that order.
+**
+**  Each tile starts with a byte naming how its cells are predicted, and
+**  then its cells follow in the usual order (y fastest). Each cell is
+**  taken as an integer of its own width (a float by its bit pattern) and
+**  replaced by its difference from the prediction, wrapping around, as a
+**  zigzag number (0, -1, 1, -2, ... become 0, 1, 2, 3, ...). The
+**  predictors are
+**
+**    GridCodecDelta: the cell just south, or for the bottom row of the
+**                    tile the cell just west;
+**    GridCodecPaeth: Paeth's choice of the cell just south, just west or
+**                    southwest, whichever is nearest to south + west -
+**                    southwest (as delta on the tile's edges);
+**    GridCodecRaw:   none; the cells are stored as they are, for tiles
+**                    that don't compress.
+**
+**  A run of zero differences is written as a 0 byte and then the length
+**  of the run, less one, as a varint (seven bits to a byte, low bits
+**  first, the top bit set on all but the last byte); any other
+**  difference is written as a varint. The writer tries both predictors
+**  on each tile and keeps whichever comes out shorter.
+**
+**  No tile refers to any other, so a tile can be read from anywhere in
+**  the file with the index, and the tiles can be decoded in parallel,
+**  each straight into its own part of a grid.
+*/
+
+#ifndef GRIDCODEC_H
+#define GRIDCODEC_H
+
+#include "demgrid.h"
+
+#define GridCodecName "predrle"
+#define GridMaxTile 4096       /* Widest tile allowed */
+
+/* How the cells of a tile are predicted: its first byte */
+enum { GridCodecRaw, GridCodecDelta, GridCodecPaeth };
+
+/* A tiled grid file, mapped into memory */
+typedef struct
+{
+  char *filename;
+  GridHeader h;
+  long ntx, nty;                       /* Tiles across and up */
+  char *map;
+  size_t mapsize;
+  const unsigned long long *index;     /* ntx*nty+1 offsets */
+  const unsigned char *data;           /* The tiles */
+  size_t datalen;
+} TiledGrid;
+
+TiledGrid *OpenTiledGrid( char *filename );
+void CloseTiledGrid( TiledGrid *t );
+void DecodeGridTile( TiledGrid *t, long tx, long ty, Grid *g,
+                     long i0, long j0 );
+Grid *ReadTiledGrid( char *filename, int nthreads );
+void WriteTiledGrid( Grid *g, long tile, FILE *fp, int nthreads );
+
+#endif
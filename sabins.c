@@ -0,0 +1,202 @@
+/*
+**  sabins.c: Slope-area statistics gathered in bins of log drainage area
+**            (see sabins.h).
+**
+**  Rather than keep every slope-area pair and sort them by area, each
+**  pair is dropped into a bin by the logarithm of its area as it is read,
+**  and the bin keeps just what it needs to report on its points: how many
+**  there are, their mean area, and the mean and variance of their slopes,
+**  updated a point at a time as Welford does, which stays accurate over
+**  millions of points. For the quantiles, each bin keeps a sample of at
+**  most NSample of its points, every point seen so far being equally
+**  likely to be in it (Vitter's reservoir sampling); the quantiles of a
+**  bin with no more points than that are exact, and those of bigger bins
+**  are estimates that don't mind outliers or ties. The memory used is
+**  fixed by the number of bins, however many points there are, and the
+**  random choices depend only on the order of the points, so a run can be
+**  repeated exactly.
+**
+**  Bin b holds the areas (in cells) from 10^(b/perdecade) up to, but not
+**  including, 10^((b+1)/perdecade). Areas below one cell fit no bin and
+**  are left out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sabins.h"
+
+#define MaxDecades 19      /* A long area is less than 10^19 */
+#define NBinFiles 6        /* Files of floats written by WriteAreaBins */
+
+
+/*
+** NewAreaBins: makes an empty set of bins, |perdecade| of them for each
+** factor of ten in area. A bin's sample isn't allocated until it gets a
+** point.
+*/
+AreaBins *NewAreaBins( int perdecade )
+{
+  AreaBins *b;
+  int i;
+
+  b = (AreaBins *)malloc( sizeof( AreaBins ) );
+  if( b!=NULL )
+  {
+    b->perdecade = perdecade;
+    b->nbins = MaxDecades*perdecade;
+    b->bin = (AreaBin *)calloc( b->nbins, sizeof( AreaBin ) );
+  }
+  if( b==NULL || b->bin==NULL )
+  {
+    printf("Unable to allocate %d area bins\n", MaxDecades*perdecade );
+    exit(1);
+  }
+  for( i=0; i<b->nbins; i++ ) b->bin[i].rng = i+1;
+  return b;
+}
+
+
+void FreeAreaBins( AreaBins *b )
+{
+  int i;
+
+  for( i=0; i<b->nbins; i++ ) free( b->bin[i].sample );
+  free( b->bin );
+  free( b );
+}
+
+
+/*
+** NextRandom: the next of a bin's random numbers (splitmix64).
+*/
+static unsigned long long NextRandom( AreaBin *bin )
+{
+  unsigned long long h;
+
+  h = (bin->rng += 0x9E3779B97F4A7C15ULL);
+  h = (h ^ (h>>30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h>>27)) * 0x94D049BB133111EBULL;
+  return h ^ (h>>31);
+}
+
+
+/*
+** AddToBins: adds a point of drainage area |area| (in cells) and slope
+** (or other ordinate) |y| to the bin for its area. The first NSample
+** points all go in the sample; after that, the nth point replaces one at
+** random with probability NSample/n.
+*/
+void AddToBins( AreaBins *b, long area, double y )
+{
+  AreaBin *bin;
+  double d;
+  unsigned long long r;
+  int i;
+
+  if( area<1 ) return;
+  i = (int)floor( b->perdecade*log10( (double)area ) );
+  if( i>=b->nbins ) i = b->nbins-1;
+  bin = &b->bin[i];
+
+  if( bin->sample==NULL
+      && (bin->sample = (float *)malloc( NSample*sizeof( float ) ))==NULL )
+  {
+    printf("Unable to allocate a bin's sample\n");
+    exit(1);
+  }
+  bin->n++;
+  bin->meanarea += (area - bin->meanarea)/bin->n;
+  d = y - bin->mean;
+  bin->mean += d/bin->n;
+  bin->m2 += d*(y - bin->mean);
+  if( bin->n<=NSample ) bin->sample[bin->n-1] = y;
+  else if( (r = NextRandom( bin ) % bin->n) < NSample ) bin->sample[r] = y;
+}
+
+
+/*
+** BinVariance: the sample variance of the slopes in a bin (0 for fewer
+** than two points).
+*/
+double BinVariance( AreaBin *bin )
+{
+  return bin->n>1 ? bin->m2/(bin->n-1) : 0;
+}
+
+
+static int CompareFloats( const void *a, const void *b )
+{
+  float x = *(const float *)a, y = *(const float *)b;
+
+  return x<y ? -1 : x>y;
+}
+
+
+/*
+** BinQuantile: the quantile |q| (0 to 1) of the slopes in a bin: the
+** point of its sample nearest to that fraction of the way up, in order.
+*/
+double BinQuantile( AreaBin *bin, double q )
+{
+  float *v;
+  long m = bin->n<NSample ? bin->n : NSample;
+  double y;
+
+  if( m==0 ) return 0;
+  v = (float *)malloc( m*sizeof( float ) );
+  memcpy( v, bin->sample, m*sizeof( float ) );
+  qsort( v, m, sizeof( float ), CompareFloats );
+  y = v[(long)( q*(m-1) + 0.5 )];
+  free( v );
+  return y;
+}
+
+
+/*
+** WriteAreaBins: writes one value for every bin with any points in it,
+** in order of increasing area, to each of the files area.dat and
+** slope.dat (the mean area, in square kilometers for 30m cells, and the
+** mean slope), slopevar.dat (the variance of the slopes), slopeq1.dat,
+** slopemed.dat and slopeq3.dat (their quartiles), all as 4-byte floats,
+** and count.dat (the number of points, as longs). Returns the number of
+** bins written.
+*/
+long WriteAreaBins( AreaBins *b )
+{
+  static char *binfile[NBinFiles] = { "area.dat", "slope.dat",
+    "slopevar.dat", "slopeq1.dat", "slopemed.dat", "slopeq3.dat" };
+  AreaBin *bin;
+  float *val;
+  long *count, n = 0;
+  int f, i;
+  FILE *fp;
+
+  val = (float *)malloc( b->nbins*sizeof( float ) );
+  count = (long *)malloc( b->nbins*sizeof( long ) );
+  for( f=0; f<NBinFiles; f++ )
+  {
+    n = 0;
+    for( i=0; i<b->nbins; i++ )
+    {
+      bin = &b->bin[i];
+      if( bin->n==0 ) continue;
+      count[n] = bin->n;
+      if( f==0 ) val[n] = 0.0009*bin->meanarea;
+      else if( f==1 ) val[n] = bin->mean;
+      else if( f==2 ) val[n] = BinVariance( bin );
+      else val[n] = BinQuantile( bin, 0.25*(f-2) );
+      n++;
+    }
+    fp = fopen( binfile[f], "w" );
+    fwrite( val, sizeof( float ), n, fp );
+    fclose( fp );
+  }
+  fp = fopen( "count.dat", "w" );
+  fwrite( count, sizeof( long ), n, fp );
+  fclose( fp );
+  free( val );
+  free( count );
+  return n;
+}
@@ -0,0 +1,35 @@
+/*
+**  sabins.h: Slope-area statistics gathered in bins of log drainage area,
+**            one data point at a time.
+*/
+
+#ifndef SABINS_H
+#define SABINS_H
+
+#define NSample 1024       /* Points kept in each bin for its quantiles */
+
+/* The points of one bin so far */
+typedef struct
+{
+  long n;
+  double meanarea, mean, m2;     /* m2: sum of squared deviations */
+  float *sample;                 /* Up to NSample of the points, chosen at
+                                    random */
+  unsigned long long rng;        /* State of the bin's random numbers */
+} AreaBin;
+
+typedef struct
+{
+  int perdecade;                 /* Bins per factor of ten in area */
+  int nbins;
+  AreaBin *bin;
+} AreaBins;
+
+AreaBins *NewAreaBins( int perdecade );
+void FreeAreaBins( AreaBins *b );
+void AddToBins( AreaBins *b, long area, double y );
+double BinVariance( AreaBin *bin );
+double BinQuantile( AreaBin *bin, double q );
+long WriteAreaBins( AreaBins *b );
+
+#endif
@@ -20,14 +20,19 @@ the analysis; only those slope and area values whose corresponding entry
 in the mask grid is |TRUE| are considered.
 
 This file has been temporarily modified to read all values (no averaging,
-that is n pts to avg equals 1) with up to 171500 data points.
+that is n pts to avg equals 1). There is no limit on the number of data
+points other than memory.
+
+For DEMs too big even for that, the program can instead stream through
+the grids a chunk at a time and gather statistics in bins of log
+drainage area, without keeping or sorting the points at all (see the
+\.{--bins} option below).
 
 
 @c
 @<Header files to include@>@/
-@<Type declarations@>@/
 @<Global variables@>@/
-@<Comparison function for qsort@>@/
+@<Functions@>@/
 
 void main( argc, argv )
 int argc;
@@ -35,10 +40,18 @@ char **argv;
 {
     @<Variables local to |main|@>@#
 
+	@<Make sure input files have been specified@>;
+	@<Ask for the grid dimensions@>;
+	@<Query user for type of data to include for ordinate array@>;
+	if( perdecade>0 ) {
+		@<Stream the grids into log-area bins@>;
+		@<Write the binned output@>;
+		printf( "Done.\n" );
+		exit( 0 );
+	}
 	@<Open file and read slope data@>;
 	@<Open file and read area data@>;
 	@<Open and read mask file@>;
-	@<Query user for type of data to include for ordinate array@>;
 	@<Create list of valid data pairs@>;
 	@<Sort valid data pairs by drainage area@>;
 	@<Average for every n pairs of valid data points@>;
@@ -47,85 +60,139 @@ char **argv;
 }
 
 
-@ We'll need |stdio| to do file I/O and |stdlib| for the |qsort| function.
+@ We'll need |stdio| to do file I/O and |stdlib| for |malloc|.
 The |math| file is needed for the |pow| function, used when an exponential
-slope-area product plot is desired.
+slope-area product plot is desired. The structure |DataPair|, which holds
+a slope value and an area value, and the routine that sorts a list of
+them are in \.{sasort.c}; the bins of the streaming mode are in
+\.{sabins.c}. |string| is for picking out the command line options.
 
 @<Header files...@>=
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-
-
-@ The structure |DataPair| holds a slope value and an area value.
-
-@<Type declarations@>=
-
-typedef struct {
-	float sl;
-	long ar;
-} DataPair;
+#include "demgrid.h"
+#include "sasort.h"
+#include "sabins.h"
 
 
 @ @<Global variables@>=
 
 
-@ Variables used in |main|. The |s| and |a| arrays contain the raw slope and
-drainage area data read from files.
-The |mask| array is a boolean array whose values are either TRUE (1) or
-FALSE (0). This array indicates whether or not the corresponding points
-in the |s| and |a| arrays are to be considered in the analysis. 
+@ Variables used in |main|. The |s| and |a| grids contain the raw slope and
+drainage area data read from files; both are |NColumns| by |NRows|.
+The |mask| grid is a boolean grid whose values are either TRUE (1) or
+FALSE (0). This grid indicates whether or not the corresponding points
+in the |s| and |a| grids are to be considered in the analysis. 
+The macros |S|, |A| and |MASK| give access to the cells of each grid.
 |ordinateType| contains the user's option for type of data to store in
-y-axis ("slope") array.
+y-axis ("slope") array. |nthreads| is the number of threads to sort with,
+and |perdecade| the number of area bins per factor of ten in the streaming
+mode (0 if we aren't streaming).
 The variables |areaexp| and |slopeexp| are only used when the y-axis
 is some power of area and slope. 
 
-@d NColumns	1765
-@d NRows	609
+@d TRUE 1
+@d FALSE 0
+@d S(i,j) GCELL(s,float,i,j)
+@d A(i,j) GINTK(a,GIDX(a,i,j))
+@d MASK(i,j) GCELL(mask,char,i,j)
 
 @<Variables local to |main|@>=
 
 FILE *fp;
 int i,j,ctr;
-float s[NColumns][NRows];
-long a[NColumns][NRows];
-char mask[NColumns][NRows];
+long NColumns, NRows;
+Grid *s, *a, *mask;
 int ordinateType;
 float areaexp, slopeexp;
+int nthreads, perdecade;
 
 
+@ Check to see whether the right number of files have been listed on
+the command line, after taking out the optional \.{--threads N} and
+\.{--bins N}.
 
+@<Make sure...@>=
 
-Here we assume the slope file is a binary 4-byte float file.
-
-@<Open file and read slope...@>=
-
+	nthreads = ThreadsOption( &argc, argv );
+	perdecade = BinsOption( &argc, argv );
 	if( argc < 3 ) {
-		printf("Usage: samask <slopefile> <areafile> {maskfile}\n");
+		printf("Usage: samask <slopefile> <areafile> {maskfile} [--threads N] [--bins N]\n");
 		exit( 0 );
 	}
-	if( (fp=fopen( argv[1], "r" ))==NULL ) {
-		printf("Unable to find '%s'\n", argv[1] );
+
+
+@ |BinsOption| looks for \.{--bins N} among the command line arguments
+and removes it, so that the file names keep their usual places. It
+returns |N|, or 0 if the option isn't there.
+
+@<Functions@>=
+
+int BinsOption( argc, argv )
+int *argc;
+char **argv;
+{
+	int i, n = 0;
+
+	for( i=1; i<*argc; i++ )
+		if( strcmp( argv[i], "--bins" )==0 ) {
+			if( i+1>=*argc || (n = atoi( argv[i+1] ))<1 ) {
+				printf( "--bins needs a positive number of bins per decade\n" );
+				exit( 1 );
+			}
+			memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+			*argc -= 2;
+			break;
+		}
+	return n;
+}
+
+
+@ A grid file written by one of the other tools starts with a header
+giving its size (see \.{demgrid.h}). Older files are plain binary dumps
+with no header, so for those we have to ask how big they are.
+
+@<Ask for the grid...@>=
+
+	if( GridFileSize( argv[1], &NColumns, &NRows ) )
+		printf( "The grids are %ld by %ld\n", NColumns, NRows );
+	else {
+		printf( "Number of columns and rows in the grids: " );
+		if( scanf( "%ld %ld", &NColumns, &NRows )!=2 ) NColumns = 0;
+	}
+	if( NColumns<1 || NRows<1 ) {
+		printf( "Invalid grid dimensions\n" );
 		exit( 0 );
 	}
+
+
+@ Here we assume the slope file is a binary 4-byte float file.
+Rather than reading the grids into memory of our own, we map the files
+(with |MapGridFile|, in \.{demgrid.c}) and read the values straight from
+the operating system's file cache. Since we go through each grid in
+order just once, the system is told to read ahead.
+
+@<Open file and read slope...@>=
+
 	printf( "Reading <%s>...\n", argv[1] );
-	fread( s, sizeof( s ), 1, fp ); 
-	fclose( fp );
+	s = MapGridFile( argv[1], NColumns, NRows, sizeof( float ), 1 );
 
 
 @ Read area data. 
-The area file should be a binary 4-byte-int file.
+The area file should be a binary file of integers. \.{drarea} and
+\.{flowaccum} write 4-byte |int|s, and the header says so; we used to
+read them as |long|s, which are 8 bytes on most 64-bit systems. So the
+areas are now read as integers of whatever width the header gives (with
+|MapIntGridFile|, and |A| above), and only a file with no header is
+taken to hold |long|s.
 
 @<Open file and read area...@>=
 
-	if( (fp=fopen( argv[2], "r" ))==NULL ) {
-		printf("Unable to find '%s'\n", argv[2] );
-		exit( 0 );
-	}
 	printf( "Reading <%s>...\n", argv[2] );
-	fread( a, sizeof( a ), 1, fp ); 
-	fclose( fp );
+	a = MapIntGridFile( argv[2], NColumns, NRows, 1 );
 
 
 @ Read the mask file. 
@@ -137,18 +204,14 @@ considered valid (i.e., they are set to |TRUE|).
 
 	if( argc < 4 ) {
 		printf( "Since you didn't specify a mask file, I'm assuming all points are valid.\n" );
+		mask = NewGrid( NColumns, NRows, sizeof( char ) );
 		for( i=0; i<NColumns; i++ )
 			for( j=0; j<NRows; j++ )
-				mask[i][j] = TRUE;
+				MASK(i,j) = TRUE;
 	}
 	else {
-        if( (fp=fopen( argv[3], "r" ))==NULL ) {
-                printf("Unable to find mask file '%s'\n", argv[3] );
-                exit( 0 );
-        }
 		printf( "Reading <%s>...\n", argv[3] );
-		fread( mask, sizeof( mask ), 1, fp ); 
-		fclose( fp );
+		mask = MapGridFile( argv[3], NColumns, NRows, sizeof( char ), 1 );
 	}
 
 
@@ -166,30 +229,26 @@ if( ordinateType==2 ) {
 
 @ Valid data points are kept in the |data| list, which will be sorted.
 Here we also introduce the arrays |slp| and |area| which will hold the
-averaged data. Since we're averaging over |NPtsToAverage|, the dimension 
-of |slp| and |area| is |NAvgPts|=|MaxValidDataPoints|/|NPtsToAverage|.
+averaged data. Since we're averaging over |NPtsToAverage|, the dimension
+of |slp| and |area| is |navg|, |nvalidpts|/|NPtsToAverage| rounded up.
+All three are allocated once we know how many valid points there are,
+and the counts are |long|s, since a mask can easily select more cells
+than an |int| can count.
 
-@d MaxValidDataPoints	171500	
 @d NPtsToAverage	1
-@d NAvgPts	171500
 
 @<Variables local to |main|@>+=
 
-DataPair data[MaxValidDataPoints];
-float slp[NAvgPts], area[NAvgPts];
-int nvalidpts;
+DataPair *data;
+float *slp, *area;
+long nvalidpts, navg, k;
 
 
-@ We sweep through the |s| (slope) array looking for valid data points.
-If the data point is invalid, it will be coded |FALSE| in the |mask| array. 
-Otherwise,
-it's good and we place it on the list of |DataPairs|.
-After we've gone through all the data, it's likely that there will
-be some empty space at the end of the |data| array. 
-To ensure that this doesn't get confused with data, we assign each
-area a value of -1 for all the entries beyond |nvalidpts|. This
-means that they'll be at the top of the list when we sort, so that
-we can easily skip past them.
+@ We sweep through the |mask| array once to count the valid data points,
+so that the |data| list can be made exactly big enough for them. Then
+we sweep through again: if a data point is invalid, it will be coded
+|FALSE| in the |mask| array. Otherwise, it's good and we place it on the
+list of |DataPairs|.
 
 @d SlopeOrdinate 0
 @d StreamPowerOrdinate 1
@@ -200,49 +259,38 @@ printf( "Computing averages...\n" );
 nvalidpts = 0;
 for( i=0; i<NColumns; i++ )
 	for( j=0; j<NRows; j++ )
-		if( mask[i][j] ) 
+		if( MASK(i,j) ) nvalidpts++;
+printf( "There are %ld total valid slope/area pairs.\n", nvalidpts );
+if( nvalidpts==0 ) exit( 0 );
+if( (data = (DataPair *)malloc( nvalidpts*sizeof( DataPair ) ))==NULL ) {
+	printf( "Unable to allocate room for %ld data pairs\n", nvalidpts );
+	exit( 1 );
+}
+k = 0;
+for( i=0; i<NColumns; i++ )
+	for( j=0; j<NRows; j++ )
+		if( MASK(i,j) ) 
 		{
 			
 			if( ordinateType==SlopeOrdinate )
-				data[nvalidpts].sl = s[i][j];
+				data[k].sl = S(i,j);
 			else if( ordinateType==StreamPowerOrdinate )
-				data[nvalidpts].sl = s[i][j]*a[i][j];
+				data[k].sl = S(i,j)*A(i,j);
 			else
-				data[nvalidpts].sl = pow(a[i][j],areaexp)*pow(0.01*s[i][j],slopeexp); 
-			data[nvalidpts].ar = a[i][j];
-			nvalidpts++;
-			if( nvalidpts > MaxValidDataPoints )
-			{
-				printf( "Sorry, there are too many valid data points for the available array size.\n" );
-				exit( 0 );
-			}
+				data[k].sl = pow(A(i,j),areaexp)*pow(0.01*S(i,j),slopeexp); 
+			data[k].ar = A(i,j);
+			k++;
 		}
-printf( "There are %d total valid slope/area pairs.\n", nvalidpts );
-for( i=nvalidpts; i<MaxValidDataPoints; i++ )
-	data[i].ar = -1;
 
 
-@ Since I'm lazy, we'll just use the UNIX qsort routine to sort the data pairs
-by drainage area. Next we'll divide up the list and average every consecutive
-|NPtsToAverage| data pairs.
+@ The data pairs are sorted by drainage area with |SortByArea| (in
+\.{sasort.c}), a radix sort on the integer areas that splits the work
+among |nthreads| threads. Pairs with equal areas stay in the order in
+which we listed them. Next we'll divide up the list and average every
+consecutive |NPtsToAverage| data pairs.
 
 @<Sort valid data...@>=
-qsort( data, MaxValidDataPoints, sizeof( data[0] ), CompareAreas );
-
-
-@ The |CompareAreas| function is called by |qsort|. It returns a value
-of 1, -1, or 0 depending on whether the area of record |a| is greater,
-less than or equal to that of record |b|.
-
-@<Comparison function...@>=
-
-int CompareAreas( a, b )
-DataPair *a, *b;
-{
-	if( a->ar > b->ar ) return( 1 );
-	else if( a->ar < b->ar ) return( -1 );
-	else return( 0 );
-}
+SortByArea( data, nvalidpts, nthreads );
 
 
 @ These are the variables used in the averaging algorithm, described below.
@@ -252,7 +300,7 @@ track of how many values we've summed up within each interval.
 
 @<Variables local to |main|@>+=
 
-int avgindex, datactr, dataindex; 
+long avgindex, datactr, dataindex; 
 
 
 @ Here's where we do the averaging, and the algorithm is a bit tricky.
@@ -260,11 +308,6 @@ First, we sum all the slope and area values in groups of |NPtsToAverage|.
 The variable |datactr| keeps track of how many values we've stuffed
 into one interval. The loop is finished when we've processed all
 the valid data points. 
-Note that since all the unused entries of |data| are at the beginning
-of the array, we skip past them by setting the |dataindex| value
-to a value equal to the number of unused entries, which is also the
-difference between the array size (|MaxValidDataPoints|) and the
-actual number of valid points |nvalidpts|.
 Next we need to calculate the average value by
 dividing by |NPtsToAverage|...except that the very last group will in
 general have fewer accumulated values than this. 
@@ -278,7 +321,8 @@ This is the one that should be divided by
 |datactr| rather than by |NPtsToAverage|. Since it might be the case
 sometimes that the number of values in this last entry IS exactly
 equal to |NPtsToAverage| (just like the others), we have to check the
-value of |datactr| to avoid a division by zero. 
+value of |datactr|: if it's zero, the loop has already stepped past the
+last full entry, so we step back to it. 
 
 While we're at it we'll also convert drainage area from pixels to
 square kilometers, and convert from percent rise to slope by
@@ -292,9 +336,16 @@ commercial software I'd be a lot richer, too...)
 
 @<Average for every...@>=
 
+navg = (nvalidpts+NPtsToAverage-1)/NPtsToAverage;
+slp = (float *)calloc( navg, sizeof( float ) );
+area = (float *)calloc( navg, sizeof( float ) );
+if( slp==NULL || area==NULL ) {
+	printf( "Unable to allocate room for %ld averaged points\n", navg );
+	exit( 1 );
+}
 avgindex = 0;
 datactr = 0;
-dataindex = MaxValidDataPoints - nvalidpts;
+dataindex = 0;
 do {
 	slp[avgindex] += data[dataindex].sl;
 	area[avgindex] += data[dataindex].ar;
@@ -304,14 +355,17 @@ do {
 		avgindex++;
 	}
 	dataindex++;
-} while( dataindex < MaxValidDataPoints );
-printf( "There are %d averaged data points.\n", avgindex+1 );
-if( datactr==0 ) datactr = NPtsToAverage;
-for( i=0; i<avgindex; i++ )
+} while( dataindex < nvalidpts );
+if( datactr==0 ) {
+	datactr = NPtsToAverage;
+	avgindex--;
+}
+printf( "There are %ld averaged data points.\n", avgindex+1 );
+for( k=0; k<avgindex; k++ )
 {
-	slp[i] = slp[i]/(float)NPtsToAverage;
-	if( ordinateType!=ExponentialOrdinate ) slp[i] *= 0.01;
-	area[i] = 0.0009*area[i]/(float)NPtsToAverage;
+	slp[k] = slp[k]/(float)NPtsToAverage;
+	if( ordinateType!=ExponentialOrdinate ) slp[k] *= 0.01;
+	area[k] = 0.0009*area[k]/(float)NPtsToAverage;
 }
 if( ordinateType!=ExponentialOrdinate ) slp[avgindex] *= 0.01;
 slp[avgindex] = slp[avgindex]/(float)datactr;
@@ -319,14 +373,123 @@ area[avgindex] = 0.0009*area[avgindex]/(float)datactr;
 
 
 
-@ @<Write the output@>=
+@ The output files hold the |navg| averaged points and nothing more.
+
+@<Write the output@>=
 
 fp = fopen( "slope.dat", "w" );
-fwrite( slp, sizeof( slp ), 1, fp );
+fwrite( slp, sizeof( float ), navg, fp );
 fclose( fp );
 fp = fopen( "area.dat", "w" );
-fwrite( area, sizeof( area ), 1, fp );
+fwrite( area, sizeof( float ), navg, fp );
 fclose( fp );
 
 
+@* Streaming into bins. Given \.{--bins N}, we read the slope, area and
+mask files side by side, |NChunk| cells at a time, and drop each valid
+point into a bin by the logarithm of its area (in cells), |N| bins to
+each factor of ten. Each bin keeps a count, the mean area, the mean and
+variance of the ordinate, all updated a point at a time, and a random
+sample of up to |NSample| of its points for its quartiles (see
+\.{sabins.c}), so the memory needed doesn't grow with the size of the
+grids and nothing has to be sorted. The order of the
+cells makes no difference, so we read the files straight through.
+Areas below one cell have no logarithm, and are left out.
+
+@d NChunk 65536
+
+@<Variables local to |main|@>+=
+
+AreaBins *bins;
+FILE *sfp, *afp, *mfp;
+float *sbuf;
+long *abuf;
+char *mbuf, *araw;
+long ncells, nchunk, c;
+size_t asize;
+GridHeader sh, ah, mh;
+double y;
+
+
+@ The ordinate is worked out just as for the list above, and slopes are
+converted from percent rise here rather than after averaging, which
+comes to the same thing. |OpenGridFile| skips the header of each file,
+if it has one, and the areas are read at the width it gives (|long|s if
+there is none) and widened to |long|s a chunk at a time. Files compressed
+in tiles (see \.{gridcodec.h}) can't be read straight through like this,
+so they have to be left to the listing above.
+
+@<Stream the grids...@>=
+
+sfp = OpenGridFile( argv[1], &sh );
+afp = OpenGridFile( argv[2], &ah );
+asize = sizeof( long );
+if( ah.type!=GridUnknown ) {
+	if( ah.type<GridInt8 || ah.type>GridInt64 || ah.type==GridUInt8 ) {
+		printf( "<%s> doesn't hold integer areas\n", argv[2] );
+		exit( 1 );
+	}
+	asize = ah.elsize;
+}
+mfp = NULL;
+if( argc < 4 )
+	printf( "Since you didn't specify a mask file, I'm assuming all points are valid.\n" );
+else mfp = OpenGridFile( argv[3], &mh );
+if( sh.tile>0 || ah.tile>0 || (mfp!=NULL && mh.tile>0) ) {
+	printf( "Compressed grids can't be streamed; leave out --bins to read them\n" );
+	exit( 1 );
+}
+sbuf = (float *)malloc( NChunk*sizeof( float ) );
+abuf = (long *)malloc( NChunk*sizeof( long ) );
+araw = (char *)malloc( NChunk*asize );
+mbuf = (char *)malloc( NChunk );
+if( sbuf==NULL || abuf==NULL || araw==NULL || mbuf==NULL ) {
+	printf( "Unable to allocate the read buffers\n" );
+	exit( 1 );
+}
+bins = NewAreaBins( perdecade );
+
+printf( "Binning the valid slope/area pairs...\n" );
+for( ncells=NColumns*NRows; ncells>0; ncells-=nchunk ) {
+	nchunk = ncells<NChunk ? ncells : NChunk;
+	if( fread( sbuf, sizeof( float ), nchunk, sfp )!=nchunk
+	    || fread( araw, asize, nchunk, afp )!=nchunk
+	    || (mfp!=NULL && fread( mbuf, 1, nchunk, mfp )!=nchunk) ) {
+		printf( "The grid files hold fewer than %ld by %ld cells\n",
+		        NColumns, NRows );
+		exit( 1 );
+	}
+	for( c=0; c<nchunk; c++ )
+		abuf[c] = asize==8 ? ((long long *)araw)[c]
+		        : asize==4 ? ((int *)araw)[c]
+		        : asize==2 ? ((short *)araw)[c] : ((signed char *)araw)[c];
+	for( c=0; c<nchunk; c++ )
+		if( mfp==NULL || mbuf[c] ) {
+			if( ordinateType==SlopeOrdinate )
+				y = sbuf[c];
+			else if( ordinateType==StreamPowerOrdinate )
+				y = sbuf[c]*abuf[c];
+			else
+				y = pow(abuf[c],areaexp)*pow(0.01*sbuf[c],slopeexp);
+			if( ordinateType!=ExponentialOrdinate ) y *= 0.01;
+			AddToBins( bins, abuf[c], y );
+		}
+}
+fclose( sfp );
+fclose( afp );
+if( mfp!=NULL ) fclose( mfp );
+
+
+@ Each output file holds one value for every bin that has any points in
+it, in order of increasing area: \.{area.dat} and \.{slope.dat} hold
+the mean area (in square kilometers, for 30m cells) and mean ordinate,
+just as in the averaged output, \.{slopevar.dat} the variance of the
+ordinate, and \.{slopeq1.dat}, \.{slopemed.dat} and \.{slopeq3.dat} its
+lower quartile, median and upper quartile, all as 4-byte floats;
+\.{count.dat} holds the number of points in each bin, as |long|s. They
+are written by |WriteAreaBins| (in \.{sabins.c}).
+
+@<Write the binned output@>=
 
+printf( "There are %ld bins with data.\n", WriteAreaBins( bins ) );
+FreeAreaBins( bins );
@@ -15,60 +15,61 @@ in the mask grid is |TRUE| are considered.
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include "demgrid.h"
+#include "sasort.h"
 
-#define NColumns 1765
-#define NRows 609
-#define MaxValidDataPoints	171500	
+#define TRUE 1
+#define FALSE 0
+#define SlopeOrdinate 0
+#define StreamPowerOrdinate 1
 #define NPtsToAverage	1
-#define NAvgPts	171500
 
-typedef struct {
-	float sl;
-	long ar;
-} DataPair;
+/* The slope, area and mask grids are NColumns by NRows; the dimensions
+   come from the slope file's header (see GridFileSize), and are asked
+   for only if it has none. The areas are integers of whatever width
+   their header gives, mapped with MapIntGridFile and read through GINTK. */
+#define S(i,j) GCELL(s,float,i,j)
+#define A(i,j) GINTK(a,GIDX(a,i,j))
+#define MASK(i,j) GCELL(mask,char,i,j)
 
 
 void main( argc, argv )
 int argc;
 char **argv;
 {
-  FILE *fp;
   int i,j,ctr;
-  float s[NColumns][NRows];
-  long a[NColumns][NRows];
-  char mask[NColumns][NRows];
+  long NColumns, NRows;
+  Grid *s, *a, *mask;
   int ordinateType;
   float areaexp, slopeexp;
   /* Valid data points are kept in the |data| list, which will be sorted.
-     Here we also introduce the arrays |slp| and |area| which will hold the
-     averaged data. Since we're averaging over |NPtsToAverage|, the dimension 
-     of |slp| and |area| is |NAvgPts|=|MaxValidDataPoints|/|NPtsToAverage|. */
-  DataPair data[MaxValidDataPoints];
-  float slp[NAvgPts], area[NAvgPts];
-  int nvalidpts;
+     It is allocated once we know how many valid points there are; the
+     counts are longs, since a mask can select more cells than an int can
+     count. */
+  DataPair *data;
+  long nvalidpts, k;
 
   /* Here we assume the slope file is a binary 4-byte float file. */
 	if( argc < 3 ) {
 		printf("Usage: samask <slopefile> <areafile> {maskfile}\n");
 		exit( 0 );
 	}
-	if( (fp=fopen( argv[1], "r" ))==NULL ) {
-		printf("Unable to find '%s'\n", argv[1] );
+	if( !GridFileSize( argv[1], &NColumns, &NRows ) ) {
+		printf( "Number of columns and rows in the grids: " );
+		if( scanf( "%ld %ld", &NColumns, &NRows )!=2 ) NColumns = 0;
+	}
+	if( NColumns<1 || NRows<1 ) {
+		printf( "Invalid grid dimensions\n" );
 		exit( 0 );
 	}
 	printf( "Reading <%s>...\n", argv[1] );
-	fread( s, sizeof( s ), 1, fp ); 
-	fclose( fp );
+	s = MapGridFile( argv[1], NColumns, NRows, sizeof( float ), 1 );
 
 	/* Read area data. 
-           The area file should be a binary 4-byte-int file. */
-	if( (fp=fopen( argv[2], "r" ))==NULL ) {
-		printf("Unable to find '%s'\n", argv[2] );
-		exit( 0 );
-	}
+           The area file should be a binary file of integers, of the
+           width its header gives (longs, if it has none). */
 	printf( "Reading <%s>...\n", argv[2] );
-	fread( a, sizeof( a ), 1, fp ); 
-	fclose( fp );
+	a = MapIntGridFile( argv[2], NColumns, NRows, 1 );
 
 	/* Read the mask file. 
            This file should be a binary 1-byte (char) file.
@@ -76,18 +77,14 @@ char **argv;
            considered valid (i.e., they are set to |TRUE|). */
 	if( argc < 4 ) {
 		printf( "Since you didn't specify a mask file, I'm assuming all points are valid.\n" );
+		mask = NewGrid( NColumns, NRows, sizeof( char ) );
 		for( i=0; i<NColumns; i++ )
 			for( j=0; j<NRows; j++ )
-				mask[i][j] = TRUE;
+				MASK(i,j) = TRUE;
 	}
 	else {
-        if( (fp=fopen( argv[3], "r" ))==NULL ) {
-                printf("Unable to find mask file '%s'\n", argv[3] );
-                exit( 0 );
-        }
 		printf( "Reading <%s>...\n", argv[3] );
-		fread( mask, sizeof( mask ), 1, fp ); 
-		fclose( fp );
+		mask = MapGridFile( argv[3], NColumns, NRows, sizeof( char ), 1 );
 	}
 
     printf( "Y-axis will be: slope (0), slope-area (1), or A^m S^n (2)? " );
@@ -99,46 +96,38 @@ char **argv;
 	scanf( "%f", &slopeexp );
     }
 
-    /* We sweep through the |s| (slope) array looking for valid data points.
-     If the data point is invalid, it will be coded FALSE in the |mask| array
-     Otherwise,
-     it's good and we place it on the list of |DataPairs|.
-     After we've gone through all the data, it's likely that there will
-     be some empty space at the end of the |data| array. 
-     To ensure that this doesn't get confused with data, we assign each
-     area a value of -1 for all the entries beyond |nvalidpts|. This
-     means that they'll be at the top of the list when we sort, so that
-     we can easily skip past them. */
-
-@d SlopeOrdinate 0
-@d StreamPowerOrdinate 1
-
-@<Create list...@>=
+    /* We sweep through the |mask| array once to count the valid data
+     points, so that the |data| list can be made exactly big enough for
+     them. Then we sweep through again: if a data point is invalid, it
+     will be coded FALSE in the |mask| array. Otherwise, it's good and we
+     place it on the list of |DataPairs|. */
 
 printf( "Computing averages...\n" );
 nvalidpts = 0;
 for( i=0; i<NColumns; i++ )
 	for( j=0; j<NRows; j++ )
-		if( mask[i][j] ) 
+		if( MASK(i,j) ) nvalidpts++;
+printf( "There are %ld total valid slope/area pairs.\n", nvalidpts );
+if( nvalidpts==0 ) exit( 0 );
+if( (data = (DataPair *)malloc( nvalidpts*sizeof( DataPair ) ))==NULL ) {
+	printf( "Unable to allocate room for %ld data pairs\n", nvalidpts );
+	exit( 1 );
+}
+k = 0;
+for( i=0; i<NColumns; i++ )
+	for( j=0; j<NRows; j++ )
+		if( MASK(i,j) ) 
 		{
 			
 			if( ordinateType==SlopeOrdinate )
-				data[nvalidpts].sl = s[i][j];
+				data[k].sl = S(i,j);
 			else if( ordinateType==StreamPowerOrdinate )
-				data[nvalidpts].sl = s[i][j]*a[i][j];
+				data[k].sl = S(i,j)*A(i,j);
 			else
-				data[nvalidpts].sl = pow(a[i][j],areaexp)*pow(0.01*s[i][j],slopeexp); 
-			data[nvalidpts].ar = a[i][j];
-			nvalidpts++;
-			if( nvalidpts > MaxValidDataPoints )
-			{
-				printf( "Sorry, there are too many valid data points for the available array size.\n" );
-				exit( 0 );
-			}
+				data[k].sl = pow(A(i,j),areaexp)*pow(0.01*S(i,j),slopeexp); 
+			data[k].ar = A(i,j);
+			k++;
 		}
-printf( "There are %d total valid slope/area pairs.\n", nvalidpts );
-for( i=nvalidpts; i<MaxValidDataPoints; i++ )
-	data[i].ar = -1;
 
 
      printf( "Done.\n" );
@@ -0,0 +1,160 @@
+/*
+**  sasort.c: Sorts slope-area data pairs by drainage area (see sasort.h).
+**
+**  Areas are integers, so rather than comparing pairs we sort them by
+**  the bytes of their areas, least significant first (an LSD radix sort).
+**  Each pass counts how many areas have each value of one byte, works
+**  out where each value's pairs start, and copies the pairs there in
+**  order; after the pass for the last byte the list is in order. Passes
+**  over a byte that is the same for every area (the high bytes, usually)
+**  are skipped, so a list of areas below 2^24 takes at most three passes,
+**  each a straight run through memory. Every pass keeps pairs with equal
+**  bytes in the order it found them, so pairs with equal areas end up in
+**  the order they were listed, whatever the number of threads.
+**
+**  With several threads, the list is cut into one piece per thread. Each
+**  thread counts its own piece, and then copies its pairs to places just
+**  after those of the same byte value from the pieces before it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sasort.h"
+
+#define NBytes (int)sizeof( long )
+
+/* One thread's piece of the list, and its counts for the current byte */
+typedef struct
+{
+  DataPair *from, *to;
+  long lo, hi;
+  int shift;
+  long count[256];      /* Pairs with each value of the byte, then where
+                           the next of them goes */
+} SortPiece;
+
+
+/*
+** Key: the area as an unsigned number with the same order, so that
+** negative areas (if there are any) sort first.
+*/
+#define Key(p) ( (unsigned long)(p).ar ^ (1UL<<(8*NBytes-1)) )
+#define Byte(p,shift) ( (int)((Key(p)>>(shift)) & 0xFF) )
+
+
+static void *CountPiece( void *arg )
+{
+  SortPiece *c = (SortPiece *)arg;
+  long k;
+
+  memset( c->count, 0, sizeof( c->count ) );
+  for( k=c->lo; k<c->hi; k++ ) c->count[Byte(c->from[k],c->shift)]++;
+  return NULL;
+}
+
+static void *MovePiece( void *arg )
+{
+  SortPiece *c = (SortPiece *)arg;
+  long k;
+
+  for( k=c->lo; k<c->hi; k++ )
+    c->to[c->count[Byte(c->from[k],c->shift)]++] = c->from[k];
+  return NULL;
+}
+
+
+/*
+** RunPieces: runs |work| on each of the |n| pieces, one thread apiece.
+*/
+static void RunPieces( SortPiece *c, int n, void *(*work)( void * ) )
+{
+  pthread_t *thread;
+  int t;
+
+  if( n==1 ) { work( c ); return; }
+  thread = (pthread_t *)malloc( n*sizeof( pthread_t ) );
+  for( t=0; t<n; t++ )
+    if( pthread_create( &thread[t], NULL, work, &c[t] )!=0 )
+    {
+      printf("Unable to start thread %d\n", t );
+      exit(1);
+    }
+  for( t=0; t<n; t++ ) pthread_join( thread[t], NULL );
+  free( thread );
+}
+
+
+/*
+** SortByArea: sorts the |n| pairs of |data| into order of increasing
+** area, keeping pairs of equal area in their original order, using
+** |nthreads| threads.
+*/
+void SortByArea( DataPair *data, long n, int nthreads )
+{
+  SortPiece *c;
+  DataPair *buf, *from, *to, *tmp;
+  unsigned long lo, hi;
+  long k, next;
+  int t, b, shift;
+
+  if( n<2 ) return;
+  if( nthreads<1 ) nthreads = 1;
+  if( n < (long)nthreads*65536 ) nthreads = 1 + n/65536;
+  if( (buf = (DataPair *)malloc( n*sizeof( DataPair ) ))==NULL )
+  {
+    printf("Unable to allocate room to sort %ld data pairs\n", n );
+    exit(1);
+  }
+  c = (SortPiece *)calloc( nthreads, sizeof( SortPiece ) );
+  for( t=0; t<nthreads; t++ )
+  {
+    c[t].lo = n*t/nthreads;
+    c[t].hi = n*(t+1)/nthreads;
+  }
+
+  /* Above the highest byte in which the smallest and largest keys
+     differ, all keys are the same, so there is nothing to sort by */
+  lo = hi = Key(data[0]);
+  for( k=1; k<n; k++ )
+  {
+    if( Key(data[k])<lo ) lo = Key(data[k]);
+    if( Key(data[k])>hi ) hi = Key(data[k]);
+  }
+
+  from = data;
+  to = buf;
+  for( shift=0; shift<8*NBytes && ((lo ^ hi)>>shift)!=0; shift+=8 )
+  {
+    for( t=0; t<nthreads; t++ )
+    {
+      c[t].from = from;
+      c[t].to = to;
+      c[t].shift = shift;
+    }
+    RunPieces( c, nthreads, CountPiece );
+
+    /* A byte that is the same in every key leaves the order as it is */
+    for( t=0, k=0; t<nthreads; t++ ) k += c[t].count[Byte(from[0],shift)];
+    if( k==n ) continue;
+
+    /* Pairs with byte value b go after all those with smaller values,
+       and after those with value b in earlier pieces */
+    for( b=0, next=0; b<256; b++ )
+      for( t=0; t<nthreads; t++ )
+      {
+        k = c[t].count[b];
+        c[t].count[b] = next;
+        next += k;
+      }
+    RunPieces( c, nthreads, MovePiece );
+    tmp = from;
+    from = to;
+    to = tmp;
+  }
+
+  if( from!=data ) memcpy( data, from, n*sizeof( DataPair ) );
+  free( c );
+  free( buf );
+}
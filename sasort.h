@@ -0,0 +1,16 @@
+/*
+**  sasort.h: Slope-area data pairs, and sorting them by drainage area.
+*/
+
+#ifndef SASORT_H
+#define SASORT_H
+
+/* The structure |DataPair| holds a slope value and an area value */
+typedef struct {
+	float sl;
+	long ar;
+} DataPair;
+
+void SortByArea( DataPair *data, long n, int nthreads );
+
+#endif
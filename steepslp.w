@@ -9,17 +9,23 @@ pixel is equal to the elevation difference between the cell and the
 adjacent cell that lies in the direction of steepest descent, divided
 by the distance between the two cells. The program works by reading
 two files, one of elevation and one of flow directions. Flow 
-directions are assumed to be in ArcInfo format, and so are converted
-to neighbor coords. 
+directions are assumed to be in ArcInfo format, and are kept as one
+byte per cell. The optional argument \.{--threads N} reads the
+flow directions, and computes the slopes, with |N| threads.
 
-The present version of this program is set up for a 620 by 632 array
-for the Zagros DEM, and reads elevation in 4-byte floating point
-format.
+The program reads elevation in 4-byte floating point format. The size
+of the grid is taken from the header of the flow directions file, so
+the flow directions are read first.
+
+When the flow directions come from \.{flowdir}, there is no need for
+this program: \.{flowdir --slope} works out each cell's slope as it
+finds its direction, in the same pass over the DEM, and writes the same
+\.{steepslope.dat}.
 
 @c
 @<Header files to include@>@/
-@<Type declarations@>@/
 @<Global variables@>@/
+@<Function declarations@>@/
 
 void main( argc, argv )
 int argc;
@@ -27,52 +33,65 @@ char **argv;
 {
         @<Variables local to |main|@>@#
 
+	nthreads = ThreadsOption( &argc, argv );
+	ctile = CompressOption( &argc, argv );
 	@<Make sure input files have been specified@>;
-	@<Open and read elevations file@>;
 	@<Open input file, read flow directions and convert@>;
+	@<Open and read elevations file@>;
 	@<Calculate slope for each cell@>;
 	@<Write the output@>;
         printf( "Done.\n" );
 }
 
 
-@ We'll need |stdio| to do file I/O.
+@ We'll need |stdio| to do file I/O, the shared grid routines in
+\.{demgrid.c} to hold the data, and those in \.{d8dir.c} for the flow
+directions.
 
 @<Header files...@>=
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "demgrid.h"
+#include "asciigrid.h"
+#include "d8dir.h"
 
 
-@ Variable type |CellCoord| is used for |nbr| array.
+@ The flow directions are kept in the grid |dir|, which is |NColumns| by
+|NRows| cells; the dimensions are set from the flow directions file.
 
-@<Type declarations@>=
+@d DIR(i,j) GCELL(dir,unsigned char,i,j)
 
-struct CellCoord        /* Structure stores the coords of a cell */
-{
-        int x;
-        int y;
-};
+@<Global variables@>=
 
+long NColumns, NRows;
+Grid *dir;
+int NoDataValue;
+int nthreads;   /* Number of threads to read and compute with */
+long ctile;     /* Tile width to compress the slopes in (--compress N) */
 
-@ @<Global variables@>=
+@ The grids |elev| and |slope| are the same size as |dir|; the macros
+|ELEV| and |SLOPE| give access to their cells. They are global so that
+the threads computing slopes can share them.
 
-struct CellCoord nbr[NColumns][NRows];
-int NoDataValue;
+@d ELEV(i,j) GCELL(elev,float,i,j)
+@d OnGrid(p,q) ( (p)>=0 && (q)>=0 && (p)<NColumns && (q)<NRows )
+@d SLOPE(i,j) GCELL(slope,float,i,j)
 
-@ Variables used in |main|. 
-The variables |xstart| and |ystart| are the x and y coordinates of the
-starting point, given in cells with the lower left pixel as 0,0.
+@<Global variables@>+=
 
-@d NColumns	632
-@d NRows	620
+Grid *elev, *slope;
+
+@ @<Function declarations@>=
+
+void SlopeBand( GridBand *b );
+
+@ Variables used in |main|. 
 
 @<Variables local to |main|@>=
 
-int i, j;
-FILE *fp;
-float elev[NColumns][NRows];
-float slope[NColumns][NRows];
-int k, m; /* For debug */
+double nodata;     /* No-data slope, for the header of the output */
 
 
 
@@ -82,22 +101,20 @@ the command line.
 @<Make sure...@>=
 
 if( argc < 3 ) {
-	printf( "USAGE: steepslp <elevation file> <flow dir file>\n" );
+	printf( "USAGE: steepslp <elevation file> <flow dir file> [--threads N] [--compress N]\n" );
 	exit( 0 );
 }
 
 
-@ We read the elevation data as a binary file.
+@ We read the elevation data as a binary file. Rather than copying it,
+we map the file into memory and look elevations up in place; the
+system is asked to fetch the whole file early, since the flow directions
+send us all over it.
 
 @<Open and read elevations...@>=
 
-        if( (fp=fopen( argv[1], "r" ))==NULL ) {
-                printf("Unable to find '%s'\n", argv[1] );
-                exit( 0 );
-        }
 	printf( "Reading <%s>...\n", argv[1] );
-	fread( elev, sizeof( elev ), 1, fp );
-	fclose( fp );
+	elev = MapGridFile( argv[1], NColumns, NRows, sizeof( float ), 0 );
 
  
 @ Reading the input file and converting is placed in a separate function
@@ -114,162 +131,105 @@ so as to minimize memory usage.
         ReadAndConvert( filename )
         char *filename;
         {
-                FILE *fp;
-                int i,j,jj,nrows,ncols,tmp;
-                short temparr[NColumns][NRows];
-                char tempstr[80];
-
-                @<Open the flow directions file@>;
-                @<Read the header@>;
-                @<Check that data file has the correct dimensions@>;
-                @<Read the data and convert to cell coordinates@>;
-                fclose( fp );
-        }
-
-
-@ If the file can't be opened (i.e. found) exit with an error message.
-
-@<Open the flow directions file@>=
-
-        if( (fp=fopen( filename, "r" ))==NULL ) {
-                printf("Unable to find '%s'\n", filename );
-                exit( 0 );
-        }
-
-
-@ When ArcInfo creates an ASCII file from a grid, it writes a header
-containing information about the file. Here we read the header, keeping
-some bits and discarding others.
-
-@<Read the header@>=
-
-	ncols = ReadHeaderLine( fp );
-	nrows = ReadHeaderLine( fp );
-	fgets( tempstr, 80, fp );
-	fgets( tempstr, 80, fp );
-	fgets( tempstr, 80, fp );
-	NoDataValue = ReadHeaderLine( fp );
-	printf("NoDataValue is %d\n",NoDataValue);
-
-
-@ The function |ReadHeaderLine| reads 14 text characters (discarding them)
-followed by an integer, and finally the linefeed character after the
-integer.
-
-@c
-int ReadHeaderLine( fp )
-FILE *fp;
-{
-        int i;
-
-        /* Read the text part and discard */
-        for( i=1; i<=14; i++ )
-                fgetc( fp );
-
-        /* Read the integer */
-        fscanf( fp, "%d", &i );
-
-        /* Read the line feed character */
-        fgetc( fp );
-
-        return( i );
-}
-
-
-@ The program is compiled for a grid of dimensions |NColumns| by |NRows|.
-If these aren't the dimensions of the data file, we've got problems.
-
-@<Check that data...@>=
-
-        if( ncols!=NColumns || nrows!=NRows )
-        {
-                printf("Program must be recompiled for %d by %d data\n",
-                        ncols, nrows );
-                exit( 0 );
+                @<Read the flow directions into a grid of one-byte codes@>;
         }
 
 
-@ Here's the meat of the function: we read each flow direction one by
-one, and |switch| on it to find the appropriate neighbor coords.
+@ |ReadFlowDirections| (in \.{d8dir.c}) reads the codes in one go and
+keeps each as a single byte; the halo around the grid is marked as
+no-data. The file may be the ASCII kind that ArcInfo writes, whose
+header |OpenAsciiGrid| (in \.{asciigrid.c}) picks apart, or a \.{.d8}
+file written by \.{flowdir}. If the file can't be opened (i.e. found)
+it exits with an error message. The grid takes its dimensions from the
+data file, so the program needn't be recompiled for each DEM.
+|NoDataValue| comes from the header's \.{NODATA\_value} line; if there
+isn't one we use ArcInfo's usual code.
 If the flow direction isn't a power of 2 (1, 2, ... 128), then the
 flow direction is undefined (this shouldn't happen with a properly
-filled DEM).
+filled DEM); it is reported, and the cell treated as no-data.
 
-@<Read the data and convert...@>=
+@<Read the flow directions into...@>=
 
 	printf( "Reading <%s>...\n", filename );
-	for( j=0; j<NRows; j++ )
-                for( i=0; i<NColumns; i++ )
-                {
-                        jj = (NRows-1)-j;
-                        fscanf( fp, "%d", &tmp );
-                        switch( tmp ) {
-                                case 1: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj;
-                                        break;
-                                case 2: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 4: nbr[i][jj].x = i;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 8: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj-1;
-                                        break;
-                                case 16: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj;
-                                        break;
-                                case 32: nbr[i][jj].x = i-1;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                case 64: nbr[i][jj].x = i;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                case 128: nbr[i][jj].x = i+1;
-                                        nbr[i][jj].y = jj+1;
-                                        break;
-                                default:
-					if( tmp==NoDataValue ) nbr[i][jj].x = NoDataValue;
-					else printf("Undefined flow direction %d at %d,%d\n", tmp, i, jj );
-                        }
-                }
+        dir = ReadFlowDirections( filename, 'a', &NoDataValue, nthreads );
+        printf("NoDataValue is %d\n",NoDataValue);
+        NColumns = dir->nx;
+        NRows = dir->ny;
 
 
 @ Slope is the elevation distance between a cell and its steepest neighbor
-|nbr|, divided by the distance between them. In computing distance, 30 meter
+$(p,q)$, the one its |dir| code points at, divided by the distance
+between them. In computing distance, 30 meter
 cells are assumed, and channel segments within a cell are assumed to be
-straight.
+straight. Edge cells may point just outside the grid, where there is
+no elevation (the mapped |elev| grid has no halo); they get no slope,
+and neither do cells with no flow direction. For the same reason, the
+dump of the neighborhood of a suspiciously negative slope leaves out
+neighbors off the edge.
+
+Each cell's slope depends only on its own elevation and its neighbor's,
+so the columns are split into bands, one per thread, by |RunBands| (in
+\.{demgrid.c}). A band reads elevations one column beyond either side
+of it, but writes only its own slopes, so the result is the same however
+many threads there are.
 
 @<Calculate slope...@>=
 
 printf( "Computing slopes...\n" );
-for( i=0; i<NColumns; i++ )
+slope = NewGrid( NColumns, NRows, sizeof( float ) );
+RunBands( 0, NColumns, nthreads, SlopeBand, NULL, NULL );
+
+
+@ Here's the |SlopeBand| function, which computes the slopes in
+columns |b->lo| to |b->hi|$-1$.
+
+@c
+void SlopeBand( b )
+GridBand *b;
+{
+int i, j;
+int p, q;		/* Coords of the cell that (i,j) drains to */
+unsigned char c;	/* Its flow direction code */
+int k, m; /* For debug */
+
+for( i=b->lo; i<b->hi; i++ )
 	for( j=0; j<NRows; j++ )
-	    if( elev[i][j] != NoDataValue )
+	{
+	    c = DIR(i,j);
+	    p = i + D8DX[c];
+	    q = j + D8DY[c];
+	    if( ELEV(i,j) != NoDataValue && IsD8Dir(c) && OnGrid(p,q) )
 		{
-		slope[i][j] = elev[i][j] - elev[nbr[i][j].x][nbr[i][j].y];
-		if( slope[i][j]<-100 ) {
+		SLOPE(i,j) = ELEV(i,j) - ELEV(p,q);
+		if( SLOPE(i,j)<-100 ) {
 			printf("Neg. slope at (%d,%d) flowing to (%d,%d)\n",
-					i,j,nbr[i][j].x,nbr[i][j].y );
+					i,j,p,q );
 			for( k=j+1; k>=j-1; k-- ) 
 			{	
 				for( m=i-1; m<=i+1; m++ )
-					printf( "(%d,%d) %d   ",k,m,elev[m][k] );
+					if( OnGrid(m,k) )
+						printf( "(%d,%d) %g   ",k,m,ELEV(m,k) );
 				printf("\n");
 			}
 		}
-		if( i==nbr[i][j].x || j==nbr[i][j].y )
-			slope[i][j] = slope[i][j] / 30.0;
-		else slope[i][j] = slope[i][j] / 42.4264;
+		if( D8DX[c]==0 || D8DY[c]==0 )
+			SLOPE(i,j) = SLOPE(i,j) / 30.0;
+		else SLOPE(i,j) = SLOPE(i,j) / 42.4264;
 		}
-	    else slope[i][j] = NoDataValue;
+	    else SLOPE(i,j) = NoDataValue;
+	}
+}
+
 
+@ The slopes are written with a header (see \.{demgrid.h}) giving the
+size of the grid and the no-data value, compressed in |ctile| by |ctile|
+tiles given \.{--compress N} (see \.{gridcodec.h}).
 
-@ @<Write the output@>=
+@<Write the output@>=
 
-fp = fopen( "steepslope.dat", "w" );
-fwrite( slope, sizeof( slope ), 1, fp );
-fclose( fp );
+nodata = NoDataValue;
+WriteGridFile( "steepslope.dat", slope, GridFloat32, &nodata, 0, ctile,
+	nthreads );
 
 
 
@@ -3,36 +3,39 @@
 **             each subbasin in a DEM. "Main stream" is defined as the path
 **             of maximum drainage area, working upstream. If two or more
 **             upstream directions have the same drainage area, one is
-**             selected at random. Length is measured as the sum of the
-**             distance between pixel centers along the stream path. 
+**             selected by a seeded hash of the cell's position. Length
+**             is measured as the sum of the distance between pixel
+**             centers along the stream path. 
 **
 **    Written by Greg Tucker, October 1996.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include "demgrid.h"
+#include "asciigrid.h"
+#include "d8dir.h"
+#include "d8walk.h"
 
-/* These values should be set to the dimensions of the data set */
-#define NColumns 718 
-#define NRows 1395 
+/* The dimensions of the data set are taken from the flow dir file */
+long NColumns, NRows;
 
 
-/* Variable type definitions (just one here) */
-
-struct CellCoord        /* Structure stores the coords of a cell */
-{
-        int x;
-        int y;
-};
+/* Global variables. Flow directions are one-byte ArcInfo codes (see
+   d8dir.h). */
 
+#define DIR(i,j) GCELL(dir,unsigned char,i,j)
+#define STRMLEN(i,j) GCELL(strmlen,float,i,j)
+#define A(i,j) GINTK(a,GIDX(a,i,j))
 
-/* Global variables */
-
-struct CellCoord nbr[NColumns][NRows];
+Grid *dir;
+GridIndex off[256];  /* Step in linear index for each direction code */
 int NoDataValue;
-float strmlen[NColumns][NRows];
-long a[NColumns][NRows];
-int gE,gSE,gS,gSW,gW,gNW,gN,gNE;
+int nthreads;        /* Threads to read with (--threads N) */
+Grid *strmlen;
+Grid *a;
 
 
 
@@ -47,215 +50,223 @@ char *basename;
 void ReadAreaFile( filenm, format )
 char *filenm;
 {
-  FILE *fp;
-  int i,j,jj,itmp1,itmp2;
-  float ftmp1,ftmp2;
-
-  if( (fp=fopen( filenm, "r" ))==NULL ) {
-          printf("Unable to find '%s'\n", filenm );
-          exit( 0 );
-  }
-  printf( "Reading <%s>...\n", filenm );
+  AsciiGrid *f;
 
   if( format=='a' )
   {
-    fread( a, sizeof( a ), 1, fp );
-    fclose( fp );
+    /* Binary areas are used straight from the file, mapped into memory,
+       at the width its header gives (longs, if it has none) */
+    printf( "Reading <%s>...\n", filenm );
+    a = MapIntGridFile( filenm, NColumns, NRows, 0 );
     printf("done.\n");
   }
   else if( format=='t' )
   {
-    fscanf( fp, "%d %d %f %f",&itmp1,&itmp2,&ftmp1,&ftmp2 );
-    for( j=0; j<NRows; j++ )
-      for( i=0; i<NColumns; i++ )
-      {
-        jj = (NRows-1)-j;
-        fscanf( fp, "%d ", &a[i][jj] );
-      }
+    f = OpenAsciiGrid( filenm );
+    printf( "Reading <%s>...\n", filenm );
+    a = NewGrid( NColumns, NRows, sizeof( long ) );
+    ReadAsciiInts( f, a, nthreads );
+    CloseAsciiGrid( f );
   }
 
 }
 
 
-int ReadHeaderLine( fp )
-FILE *fp;
+
+void ReadFlowDirFile( filename, format )
+char *filename, format;
 {
-        int i;
+  /* Read the flow directions, one byte each: an ARC/INFO or
+     D. Tarboton ascii file (converted to ArcInfo's codes), or a .d8 file
+     from flowdir. The grids are sized to fit, and the halo of dir is
+     marked as no-data. */
+  printf( "Reading <%s>...\n", filename );
+  dir = ReadFlowDirections( filename, format, &NoDataValue, nthreads );
+  printf("NoDataValue is %d\n",NoDataValue);
+  NColumns = dir->nx;
+  NRows = dir->ny;
+  D8Offsets( dir, off );
+  strmlen = NewGrid( NColumns, NRows, sizeof( float ) );
 
-        /* Read the text part and discard */
-        for( i=1; i<=14; i++ )
-                fgetc( fp );
+  printf("done.\n");
+}
 
-        /* Read the integer */
-        fscanf( fp, "%d", &i );
 
-        /* Read the line feed character */
-        fgetc( fp );
+/*
+** The main stream above a cell climbs, one cell at a time, to the
+** neighbor that drains to it with the most area, and stops where no
+** neighbor draining to it has any area; its length is the sum of the
+** distances between cell centers along the way. Each cell is the main
+** upstream neighbor of at most one cell (its receiver), so the main
+** streams of the whole grid form separate chains, and each chain is
+** measured in a single walk: up from its lowest cell to its head, then
+** back down, adding one step at a time. Every cell is walked over twice
+** at most, however long the streams, and the chains are independent, so
+** bands of columns are done on separate threads (--threads N).
+**
+** Ties in area are broken by a hash of the cell's position and a seed
+** (--seed N, 0 by default) rather than by rand(), so the lengths are the
+** same from run to run and for any number of threads.
+*/
+#define MAINUP(i,j) GCELL(mainup,unsigned char,i,j)
 
-        return( i );
-}
+Grid *mainup;        /* Code of each cell's main upstream neighbor, or
+                        D8None where the stream starts */
+unsigned long long seed;
 
 
-void ReadFlowDirFile( filename, format )
-char *filename, format;
+/*
+** TieHash: a well-mixed hash (splitmix64) of cell (x,y) and the seed.
+*/
+unsigned long long TieHash( x, y )
+long x, y;
 {
-  FILE *fp;
-  int i,j,jj,nrows,ncols,tmp;
-  short temparr[NColumns][NRows];
-  char tempstr[80];
-  float dx, dy;
+  unsigned long long h;
 
-  if( (fp=fopen( filename, "r" ))==NULL ) {
-    printf("Unable to find '%s'\n", filename );
-    exit( 0 );
-  }
+  h = ((unsigned long long)x*NRows + y) ^ (seed*0x9E3779B97F4A7C15ULL);
+  h = (h ^ (h>>30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h>>27)) * 0x94D049BB133111EBULL;
+  return h ^ (h>>31);
+}
 
-  /* Read the header: ARC/INFO ascii format, or D. Tarboton ascii format */
-  if( format=='a' )
-  {
-    ncols = ReadHeaderLine( fp );
-    nrows = ReadHeaderLine( fp );
-    fgets( tempstr, 80, fp );
-    fgets( tempstr, 80, fp );
-    fgets( tempstr, 80, fp );
-    NoDataValue = ReadHeaderLine( fp );
-  }
-  else if( format=='t' )
-  {
-    fscanf( fp, "%d %d %f %f",&ncols,&nrows,&dx,&dy);
-    NoDataValue = -1;
-  }
-  printf("NoDataValue is %d\n",NoDataValue);
 
-  /* Check that data have the right dimensions */
-  if( ncols!=NColumns || nrows!=NRows )
-  {
-    printf("Program must be recompiled for %d by %d data\n",
-            ncols, nrows );
-    exit( 0 );
-  }
+/*
+** MainUpBand: finds the main upstream neighbor of every cell in a band
+** of columns. Neighbors are looked at in the usual order, and among
+** several with the same (greatest) area the hash picks one.
+*/
+void MainUpBand( b )
+GridBand *b;
+{
+  long x, y, amax, area;
+  int n, ndon, npossdir;
+  unsigned char code[8], poss[8];
 
-  /* Convert from 1,2,4,... code to neighbor cell coords */
-  printf( "Reading <%s>...\n", filename );
-  for( j=0; j<NRows; j++ )
-    for( i=0; i<NColumns; i++ )
+  for( x=b->lo; x<b->hi; x++ )
+    for( y=0; y<NRows; y++ )
     {
-      jj = (NRows-1)-j;
-      fscanf( fp, "%d", &tmp );
-      if( tmp==gE ) {
-        nbr[i][jj].x = i+1;
-        nbr[i][jj].y = jj;
-      }
-      else if( tmp==gSE ) {
-        nbr[i][jj].x = i+1;
-        nbr[i][jj].y = jj-1;
-      }
-      else if( tmp==gS ) {
-        nbr[i][jj].x = i;
-        nbr[i][jj].y = jj-1;
-      }
-      else if( tmp==gSW ) {
-        nbr[i][jj].x = i-1;
-        nbr[i][jj].y = jj-1;
-      }
-      else if( tmp==gW ) {
-        nbr[i][jj].x = i-1;
-        nbr[i][jj].y = jj;
-      }
-      else if( tmp==gNW ) {
-        nbr[i][jj].x = i-1;
-        nbr[i][jj].y = jj+1;
-      }
-      else if( tmp==gN ) {
-        nbr[i][jj].x = i;
-        nbr[i][jj].y = jj+1;
-      }
-      else if( tmp==gNE ) {
-        nbr[i][jj].x = i+1;
-        nbr[i][jj].y = jj+1;
+      npossdir = 0;
+      amax = -1;
+      ndon = D8Donors( dir, GIDX(dir,x,y), code );
+      for( n=0; n<ndon; n++ )
+      {
+        area = A(x+D8DX[code[n]],y+D8DY[code[n]]);
+        if( area>amax )
+        {
+          npossdir = 0;
+          amax = area;
+        }
+        if( area==amax ) poss[npossdir++] = code[n];
       }
-      else if( tmp==NoDataValue ) nbr[i][jj].x = NoDataValue;
-      else printf("Undefined flow direction %d at %d,%d\n", tmp, i, jj );
+      if( amax<=0 ) MAINUP(x,y) = D8None;
+      else if( npossdir==1 ) MAINUP(x,y) = poss[0];
+      else MAINUP(x,y) = poss[TieHash( x, y ) % npossdir];
     }
+}
 
-  fclose( fp );
 
-  printf("done.\n");
+/* Where a main stream walk has got to */
+typedef struct
+{
+  long i, j;           /* The last cell visited */
+  GridIndex stop;      /* The cell to stop at, on the way down */
+  double totlen;
+} StreamWalk;
+
+
+/*
+** ClimbStep: D8WalkDown visitor for the climb up mainup: just remembers
+** where it got to.
+*/
+int ClimbStep( k, i, j, arg )
+GridIndex k;
+long i, j;
+void *arg;
+{
+  ((StreamWalk *)arg)->i = i;
+  ((StreamWalk *)arg)->j = j;
+  return 1;
 }
 
 
-double followmainchan( x,y,totlen,reclvl )
-int x,y;
-float totlen;
-int reclvl;
+/*
+** DescendStep: D8WalkDown visitor for the walk back down: adds the step
+** from the last cell, of one, or of root 2 on a diagonal, and records the
+** length so far.
+*/
+int DescendStep( k, i, j, arg )
+GridIndex k;
+long i, j;
+void *arg;
 {
-  int i,j;
-  int npossdir=0;     /* No. of possible upstream routes */
-  long amax= -1;      /* Max. area found so far */
-  int mnx[8],mny[8];  /* Location(s) of max upstream area */
-  int thedir;
-
-  /* Check recursion level to avoid endless loops */
-  reclvl=reclvl+1;
-  if( reclvl>NColumns*NRows)
-  {
-    printf("Recursion level %d too high!\n",reclvl);
-    exit(1);
-  }
+  StreamWalk *w = (StreamWalk *)arg;
+
+  if( w->i!=i && w->j!=j ) w->totlen += 1.4142136;
+  else if( w->i!=i || w->j!=j ) w->totlen += 1;
+  ((float *)strmlen->data)[k] = w->totlen;
+  w->i = i;
+  w->j = j;
+  return k!=w->stop;
+}
 
-  /* For each adjacent cell, see if it drains here (x,y). If so,
-     compare its area with the highest found so far and remember
-     the max upstream area and location in amax, mnx(1), and mny(1).
-     If we find another with the same value as amax, record multiple
-     possible upstream directions by incrementing npossdir and
-     recording the upstream locations in mnx() and mny(). */
-  for( i=x-1; i<=x+1; i++ ) for( j=y-1; j<=y+1; j++ )
-    if( nbr[i][j].x>0 )
-    {
-      /* Does (i,j) drain here? */
-      if( nbr[i][j].x==x && nbr[i][j].y==y )
-      {
-        if( a[i][j]>amax )
-        {
-          npossdir=1;
-          amax=a[i][j];
-          mnx[0]=i;
-          mny[0]=j;
-        }
-        else if( a[i][j]==amax )
-        {
-          npossdir++;
-          mnx[npossdir-1]=i;
-          mny[npossdir-1]=j;
-        }
-      }
-    }
 
-  /* If there is at least one upstream neighbor, increment total stream length
-     and call ourself again with the upstream coords. */
-  if( amax>0 )
-  {
-    if( npossdir>1 )  /* If multiple possible directions, choose 1 at random */
+/*
+** MainStreamBand: measures the chains whose lowest cells lie in a band of
+** columns. A chain's lowest cell is one that isn't its receiver's main
+** upstream neighbor. The climb follows mainup as if it were a direction
+** grid; the codes of both grids are indexed the same way.
+*/
+void MainStreamBand( b )
+GridBand *b;
+{
+  unsigned char *d = (unsigned char *)dir->data,
+                *up = (unsigned char *)mainup->data;
+  StreamWalk w;
+  GridIndex k;
+  long x, y;
+  unsigned char c;
+
+  for( x=b->lo; x<b->hi; x++ )
+    for( y=0; y<NRows; y++ )
     {
-      thedir = (int)(npossdir*(rand()/32767.0));
-      if( thedir>=npossdir ) thedir=npossdir-1;  /* Will happen very rarely! */
-      mnx[0]=mnx[thedir];
-      mny[0]=mny[thedir];
+      k = GIDX(dir,x,y);
+      c = d[k];
+      if( IsD8Dir(c) && up[k+off[c]]==D8Opposite(c) ) continue;
+
+      /* Climb to the head of the stream, then walk back down to (x,y) */
+      D8WalkDown( mainup, x, y, ClimbStep, &w );
+      w.stop = k;
+      w.totlen = 0;
+      D8WalkDown( dir, w.i, w.j, DescendStep, &w );
     }
+}
 
-    /* Increment the total stream length according to whether orientation
-       is straight or diagonal. */
-    if( mnx[0]==x || mny[0]==y )
-      totlen = totlen+1;
-    else
-      totlen = totlen+1.4142136;
 
-    /* Now call ourself with the upstream coords */
-    totlen = followmainchan(mnx[0],mny[0],totlen,reclvl);
-  }
-
-  return (double)totlen;
+/*
+** SeedOption: looks for "--seed N" among the command line arguments and
+** removes it. Returns N, or 0 if the option isn't there.
+*/
+unsigned long long SeedOption( argc, argv )
+int *argc;
+char **argv;
+{
+  int i;
+  unsigned long long n = 0;
 
+  for( i=1; i<*argc; i++ )
+    if( strcmp( argv[i], "--seed" )==0 )
+    {
+      if( i+1>=*argc )
+      {
+        printf("--seed needs a number\n");
+        exit(1);
+      }
+      n = strtoull( argv[i+1], NULL, 10 );
+      memmove( &argv[i], &argv[i+2], (*argc-i-1)*sizeof( char * ) );
+      *argc -= 2;
+      break;
+    }
+  return n;
 }
 
 
@@ -265,68 +276,57 @@ char **argv;
 {
   int i,j;
   FILE *fp;
+  float minus1;
+
+  nthreads = ThreadsOption( &argc, argv );
+  seed = SeedOption( &argc, argv );
 
   /* Check that input files have been specified */
   if( argc < 4 ) {
-    printf( "USAGE: %s <flow dir file> <area file> <encoding scheme>\n", argv[0] );
+    printf( "USAGE: %s <flow dir file> <area file> <encoding scheme> [--threads N] [--seed N]\n", argv[0] );
     exit( 0 );
   }
 
-  /* Set coding scheme */
+  /* Check coding scheme */
   if( argv[3][0]!='a' && argv[3][0]!='t' )
   {
      printf("I don't know what '%c' is. The encoding scheme must be either a (Arc/Info) or t (Tarboton)\n",argv[3][0]);
      exit(1);
   }
-  switch( argv[3][0] ) {
-    case 'a':
-      gE = 1;
-      gSE = 2;
-      gS = 4;
-      gSW = 8;
-      gW = 16;
-      gNW = 32;
-      gN = 64;
-      gNE = 128;
-      break;
-    case 't':
-      gE = 1;
-      gSE = 8;
-      gS = 7;
-      gSW = 6;
-      gW = 5;
-      gNW = 4;
-      gN = 3;
-      gNE = 2;
-      break;
-    default:
-      printf("I don't know what format '%s' is.\nPossible formats are: a - Arc/Info ascii, t - Tarboton ascii\n",
-              argv[2][0] );
-      exit(2);
-      break;
-  }
 
-  /* Read flow directions file and convert to "neighbor cell" format */
+  /* Read flow directions file and convert to one-byte codes */
   ReadFlowDirFile( argv[1], argv[3][0] );
 
   /* Read drainage areas */
   ReadAreaFile( argv[2], argv[3][0] );
 
-  /* For each cell, find the maximum basin length */
-  for( i=1; i<NColumns-1; i++ )
-  {
-    printf("Col %d\n",i);
-    for( j=1; j<NRows-1; j++ )
-      if( nbr[i][j].x != NoDataValue ) 
+  /* Find each cell's main upstream neighbor, then measure the main
+     streams. Cells left at -1 are on a loop in the flow directions. */
+  printf("Measuring main stream lengths...\n");
+  mainup = NewGrid( NColumns, NRows, sizeof( unsigned char ) );
+  RunBands( 0, NColumns, nthreads, MainUpBand, NULL, NULL );
+  minus1 = -1;
+  FillGrid( strmlen, &minus1 );
+  RunBands( 0, NColumns, nthreads, MainStreamBand, NULL, NULL );
+
+  /* Keep the lengths of the interior cells with data */
+  for( i=0; i<NColumns; i++ )
+    for( j=0; j<NRows; j++ )
+      if( i>0 && j>0 && i<NColumns-1 && j<NRows-1 && DIR(i,j)!=D8NoData )
       {
-        strmlen[i][j] = (float)followmainchan(i,j,0.0,0);
+        if( STRMLEN(i,j)<0 )
+        {
+          printf("The main stream above (%d,%d) runs in a loop\n",i,j);
+          exit(1);
+        }
       }
-  }
+      else STRMLEN(i,j) = 0;
+  printf("done.\n");
 
   /* Write the data in binary format */
   printf("Writing 'strmlen.dat'...");
-  fp = fopen("strmlen.dat","w");
-  fwrite( strmlen, sizeof( strmlen ), 1, fp );
+  fp = CreateGridFile( "strmlen.dat", strmlen, GridFloat32, NULL, 0 );
+  WriteGridData( strmlen, fp );
   fclose( fp );
   printf("all done.\n");
 
@@ -0,0 +1,487 @@
+/*
+**  tileacc.c: Computes flow accumulation for grids too big to hold in
+**             memory, a tile at a time (see tileacc.h).
+**
+**  The flow directions come from a ".d8" file and the areas go straight
+**  to the output file, so neither grid is ever in memory whole. The grid
+**  is cut into square tiles, and the work is done in two passes over
+**  them, with a small problem solved in between:
+**
+**  1. Each tile is accumulated on its own, as though no flow came in from
+**     outside it. For every cell on the tile's perimeter we note where
+**     water arriving there would leave the tile (the "exit" cell on its
+**     path, and the cell in the next tile that the exit drains to), and,
+**     for the exit cells themselves, how much area leaves through them.
+**
+**  2. The perimeter cells of all the tiles form a small graph: each one
+**     passes whatever flows into it from other tiles on to the perimeter
+**     cell its exit drains to, and every exit adds its own tile's area.
+**     This is just another flow accumulation, done in memory.
+**
+**  3. Each tile is accumulated again, this time with the inflow found in
+**     step 2 added to its perimeter cells, and the areas are written out.
+**
+**  Only one tile per thread, plus a few numbers for each perimeter cell,
+**  is in memory at once, so the memory needed is set by the tile size:
+**  about 22 bytes per cell of a tile for each thread. The tiles of each
+**  pass are independent and are handed out to the threads one at a time.
+**
+**  The areas are the same as flowaccum's: interior cells count one, edge
+**  cells none, and flow stops at the edge of the grid.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tileacc.h"
+#include "d8dir.h"
+
+#define Done 0xFF       /* Donor count of a cell whose area is final */
+#define Leaves -2       /* Receiver of a cell whose flow leaves the tile */
+
+typedef struct
+{
+  int in, out;          /* The .d8 file and the area file */
+  off_t body;           /* Offset of the first cell in the .d8 file */
+  int encoding;
+  long nx, ny;          /* Size of the whole grid */
+  long tile;            /* Width and height of a (full) tile */
+  long ntx, nty;        /* Number of tiles across x and y */
+  long long *base;      /* First perimeter node of each tile */
+  long long *next;      /* Node each node's inflow passes on to, or -1 */
+  long long *exitarea;  /* Area leaving a tile through each node */
+  long long *inflow;    /* Area flowing in from other tiles at each node */
+  unsigned char *looped;  /* Whether each node is on a loop across tiles */
+  int pass;
+  pthread_mutex_t lock;
+  long nexttile;        /* Next tile to hand out */
+  long nloop;           /* Cells on loops, from pass 2 */
+} TileJob;
+
+typedef struct
+{
+  long i0, j0, w, h;    /* Corner cell and size of the tile */
+  unsigned char *dir;   /* Flow direction codes */
+  int *rcv;             /* Local index of each cell's receiver, -1 or Leaves */
+  long long *area;
+  unsigned char *ndon;
+  int *order;           /* Cells in the order their areas were finished */
+  int *exit;            /* Exit cell each cell's flow leaves by, or -1 */
+} Tile;
+
+#define Interior(job,i,j) \
+  ( (i)>0 && (j)>0 && (i)<(job)->nx-1 && (j)<(job)->ny-1 )
+
+
+/*
+** PerimCount, PerimPos: the number of perimeter cells of a w by h tile,
+** and the position of perimeter cell (a,b) among them.
+*/
+static long PerimCount( long w, long h )
+{
+  return w==1 ? h : 2*h + (w-2)*(h==1 ? 1 : 2);
+}
+
+static long PerimPos( long a, long b, long w, long h )
+{
+  if( a==0 ) return b;
+  if( a==w-1 ) return h + b;
+  if( b==0 ) return 2*h + a-1;
+  return 2*h + (w-2) + a-1;
+}
+
+
+/*
+** NodeOf: the perimeter node of cell (i,j), which must be on the edge of
+** its tile.
+*/
+static long long NodeOf( TileJob *job, long i, long j )
+{
+  long ti = i/job->tile, tj = j/job->tile;
+  long w = job->nx - ti*job->tile, h = job->ny - tj*job->tile;
+
+  if( w>job->tile ) w = job->tile;
+  if( h>job->tile ) h = job->tile;
+  return job->base[ti*job->nty+tj]
+         + PerimPos( i-ti*job->tile, j-tj*job->tile, w, h );
+}
+
+
+/*
+** LoadTile: reads the directions of tile (ti,tj) and works out the local
+** receiver of each cell.
+*/
+static void LoadTile( TileJob *job, Tile *t, long ti, long tj )
+{
+  long a, b, p, q;
+  int l;
+  unsigned char c;
+
+  t->i0 = ti*job->tile;
+  t->j0 = tj*job->tile;
+  t->w = job->nx - t->i0 < job->tile ? job->nx - t->i0 : job->tile;
+  t->h = job->ny - t->j0 < job->tile ? job->ny - t->j0 : job->tile;
+
+  for( a=0; a<t->w; a++ )
+    if( pread( job->in, t->dir + a*t->h, t->h, job->body
+               + (off_t)(t->i0+a)*job->ny + t->j0 ) != t->h )
+    {
+      printf("The flow direction file is too short\n");
+      exit(1);
+    }
+  D8Decode( t->dir, t->w*t->h, job->encoding );
+
+  /* As in flowaccum, only interior cells pass their area on */
+  for( a=0; a<t->w; a++ )
+    for( b=0; b<t->h; b++ )
+    {
+      l = a*t->h + b;
+      c = t->dir[l];
+      t->rcv[l] = -1;
+      if( Interior(job,t->i0+a,t->j0+b) && IsD8Dir(c) )
+      {
+        p = a + D8DX[c];
+        q = b + D8DY[c];
+        if( p>=0 && q>=0 && p<t->w && q<t->h ) t->rcv[l] = p*t->h + q;
+        else t->rcv[l] = Leaves;
+      }
+    }
+}
+
+
+/*
+** AccumulateTile: accumulates the areas within the tile, as
+** AccumulateFlow does, and lists the cells in the order they were
+** finished. Returns the number of cells finished.
+*/
+static long AccumulateTile( Tile *t )
+{
+  int n = t->w*t->h, l, c, norder = 0;
+
+  memset( t->ndon, 0, n );
+  for( l=0; l<n; l++ )
+    if( t->rcv[l]>=0 ) t->ndon[t->rcv[l]]++;
+  for( l=0; l<n; l++ )
+  {
+    c = l;
+    while( t->ndon[c]==0 )
+    {
+      t->ndon[c] = Done;
+      t->order[norder++] = c;
+      if( t->rcv[c]<0 ) break;
+      t->area[t->rcv[c]] += t->area[c];
+      c = t->rcv[c];
+      t->ndon[c]--;
+    }
+  }
+  return norder;
+}
+
+
+/*
+** SetWeights: gives each cell its own area, plus the inflow from other
+** tiles on the perimeter in pass 2.
+*/
+static void SetWeights( TileJob *job, Tile *t )
+{
+  long a, b;
+
+  for( a=0; a<t->w; a++ )
+    for( b=0; b<t->h; b++ )
+    {
+      t->area[a*t->h+b] = Interior(job,t->i0+a,t->j0+b) ? 1 : 0;
+      if( job->pass==2 && (a==0 || b==0 || a==t->w-1 || b==t->h-1) )
+        t->area[a*t->h+b] += job->inflow[job->base[(t->i0/job->tile)
+                               *job->nty + t->j0/job->tile]
+                             + PerimPos( a, b, t->w, t->h )];
+    }
+}
+
+
+/*
+** PerimeterPass: after the tile has been accumulated on its own, finds the
+** exit of every cell (downstream cells first, so each one can copy its
+** receiver's) and records, for each perimeter cell, where its inflow goes
+** and how much area leaves the tile through it.
+*/
+static void PerimeterPass( TileJob *job, Tile *t, long norder )
+{
+  long a, b, k;
+  long long node, base;
+  int l, e, c;
+
+  for( l=0; l<t->w*t->h; l++ ) t->exit[l] = -1;
+  for( k=norder-1; k>=0; k-- )
+  {
+    c = t->order[k];
+    if( t->rcv[c]==Leaves ) t->exit[c] = c;
+    else if( t->rcv[c]>=0 ) t->exit[c] = t->exit[t->rcv[c]];
+  }
+
+  base = job->base[(t->i0/job->tile)*job->nty + t->j0/job->tile];
+  for( a=0; a<t->w; a++ )
+    for( b=0; b<t->h; b++ )
+      if( a==0 || b==0 || a==t->w-1 || b==t->h-1 )
+      {
+        l = a*t->h + b;
+        node = base + PerimPos( a, b, t->w, t->h );
+        e = t->exit[l];
+        job->next[node] = -1;
+        if( e>=0 )
+          job->next[node] = NodeOf( job,
+            t->i0 + e/t->h + D8DX[t->dir[e]],
+            t->j0 + e%t->h + D8DY[t->dir[e]] );
+        job->exitarea[node] = t->rcv[l]==Leaves ? t->area[l] : 0;
+      }
+}
+
+
+/*
+** CountLooped: the number of cells of the tile on loops, after pass 2's
+** AccumulateTile, which has finished |norder| cells. A loop within the
+** tile leaves its cells unfinished. A loop across tiles enters each tile
+** it passes through at a perimeter node that SolvePerimeter couldn't
+** finish, and its cells in the tile are those downstream of such nodes,
+** so they are marked going down the tile in the order the cells were
+** finished. (Each cell drains to just one other, so nothing lies below a
+** loop; the count is the same as AccumulateFlow's.)
+*/
+static long CountLooped( TileJob *job, Tile *t, long norder )
+{
+  long a, b, k, n = t->w*t->h - norder;
+  long long base;
+  int *mark = t->exit, c;
+
+  base = job->base[(t->i0/job->tile)*job->nty + t->j0/job->tile];
+  for( a=0; a<t->w; a++ )
+    for( b=0; b<t->h; b++ )
+      mark[a*t->h+b] = (a==0 || b==0 || a==t->w-1 || b==t->h-1)
+                       && job->looped[base + PerimPos( a, b, t->w, t->h )];
+  for( k=0; k<norder; k++ )
+  {
+    c = t->order[k];
+    if( !mark[c] ) continue;
+    n++;
+    if( t->rcv[c]>=0 ) mark[t->rcv[c]] = 1;
+  }
+  return n;
+}
+
+
+/*
+** WriteTile: writes the tile's areas, as ints, into the area file.
+*/
+static void WriteTile( TileJob *job, Tile *t, int *col )
+{
+  long a, b;
+
+  for( a=0; a<t->w; a++ )
+  {
+    for( b=0; b<t->h; b++ ) col[b] = (int)t->area[a*t->h+b];
+    if( pwrite( job->out, col, t->h*sizeof( int ), GridHeaderLen
+                + ((off_t)(t->i0+a)*job->ny + t->j0)*sizeof( int ) )
+        != (ssize_t)(t->h*sizeof( int )) )
+    {
+      printf("Unable to write the area file\n");
+      exit(1);
+    }
+  }
+}
+
+
+static void *TileWorker( void *arg )
+{
+  TileJob *job = (TileJob *)arg;
+  Tile t;
+  long n = job->tile*job->tile, k, norder;
+  int *col;
+
+  t.dir = (unsigned char *)malloc( n );
+  t.rcv = (int *)malloc( n*sizeof( int ) );
+  t.area = (long long *)malloc( n*sizeof( long long ) );
+  t.ndon = (unsigned char *)malloc( n );
+  t.order = (int *)malloc( n*sizeof( int ) );
+  t.exit = (int *)malloc( n*sizeof( int ) );
+  col = (int *)malloc( job->tile*sizeof( int ) );
+  if( t.dir==NULL || t.rcv==NULL || t.area==NULL || t.ndon==NULL
+      || t.order==NULL || t.exit==NULL || col==NULL )
+  {
+    printf("Unable to allocate a %ld by %ld tile\n", job->tile, job->tile );
+    exit(1);
+  }
+
+  for( ;; )
+  {
+    pthread_mutex_lock( &job->lock );
+    k = job->nexttile++;
+    pthread_mutex_unlock( &job->lock );
+    if( k>=job->ntx*job->nty ) break;
+
+    LoadTile( job, &t, k/job->nty, k%job->nty );
+    SetWeights( job, &t );
+    norder = AccumulateTile( &t );
+    if( job->pass==1 ) PerimeterPass( job, &t, norder );
+    else
+    {
+      WriteTile( job, &t, col );
+      k = CountLooped( job, &t, norder );
+      pthread_mutex_lock( &job->lock );
+      job->nloop += k;
+      pthread_mutex_unlock( &job->lock );
+    }
+  }
+
+  free( t.dir ); free( t.rcv ); free( t.area );
+  free( t.ndon ); free( t.order ); free( t.exit ); free( col );
+  return NULL;
+}
+
+
+/*
+** RunPass: hands all the tiles out to |nthreads| threads for one pass.
+*/
+static void RunPass( TileJob *job, int pass, int nthreads )
+{
+  pthread_t *thread;
+  int t;
+
+  job->pass = pass;
+  job->nexttile = 0;
+  if( nthreads>job->ntx*job->nty ) nthreads = job->ntx*job->nty;
+  if( nthreads<=1 ) { TileWorker( job ); return; }
+  thread = (pthread_t *)malloc( nthreads*sizeof( pthread_t ) );
+  for( t=0; t<nthreads; t++ )
+    if( pthread_create( &thread[t], NULL, TileWorker, job )!=0 )
+    {
+      printf("Unable to start thread %d\n", t );
+      exit(1);
+    }
+  for( t=0; t<nthreads; t++ ) pthread_join( thread[t], NULL );
+  free( thread );
+}
+
+
+/*
+** SolvePerimeter: adds up the inflow to every perimeter node from the
+** other tiles. Each exit node hands its tile's area to the node it drains
+** to, and every node passes its inflow on, in topological order as in
+** AccumulateFlow. The nodes left unfinished are on loops across tiles,
+** and are marked in job->looped for CountLooped.
+*/
+static void SolvePerimeter( TileJob *job, long long nnodes )
+{
+  int *ndon;
+  long long k, c;
+
+  ndon = (int *)calloc( nnodes, sizeof( int ) );
+  job->inflow = (long long *)calloc( nnodes, sizeof( long long ) );
+  job->looped = (unsigned char *)malloc( nnodes );
+  if( ndon==NULL || job->inflow==NULL || job->looped==NULL )
+  {
+    printf("Unable to allocate the tile perimeter graph\n");
+    exit(1);
+  }
+  for( k=0; k<nnodes; k++ )
+    if( job->next[k]>=0 )
+    {
+      job->inflow[job->next[k]] += job->exitarea[k];
+      ndon[job->next[k]]++;
+    }
+  for( k=0; k<nnodes; k++ )
+  {
+    c = k;
+    while( ndon[c]==0 )
+    {
+      ndon[c] = -1;
+      if( job->next[c]<0 ) break;
+      job->inflow[job->next[c]] += job->inflow[c];
+      c = job->next[c];
+      ndon[c]--;
+    }
+  }
+  for( k=0; k<nnodes; k++ ) job->looped[k] = ndon[k]!=-1;
+  free( ndon );
+}
+
+
+/*
+** AccumulateFlowTiled: computes the drainage area of every cell of the
+** directions in |d8file|, using square tiles |tile| cells on a side and
+** |nthreads| threads, and writes them to |outfile| as ints, header and
+** all, just as flowaccum writes a .flowacc file in one go. Returns the
+** number of cells whose area could not be completed because of loops in
+** the flow directions.
+*/
+long AccumulateFlowTiled( char *d8file, char *outfile, long tile,
+                          int nthreads )
+{
+  TileJob job;
+  Grid shape;
+  FILE *fp;
+  long k, w, h;
+  long long nnodes = 0;
+
+  if( (fp = OpenD8File( d8file, &job.nx, &job.ny, &job.encoding ))==NULL )
+  {
+    printf("Working in tiles needs a .d8 flow direction file, as written by 'flowdir --d8'\n");
+    exit(1);
+  }
+  job.body = ftell( fp );
+  fclose( fp );
+
+  /* Write the header of the area file, and make room for the areas
+     after it, so that each tile's can be written in its place */
+  memset( &shape, 0, sizeof( Grid ) );
+  shape.nx = job.nx;
+  shape.ny = job.ny;
+  fclose( CreateGridFile( outfile, &shape, GridIntType( int ), NULL, 0 ) );
+  if( (job.in = open( d8file, O_RDONLY ))<0
+      || (job.out = open( outfile, O_RDWR ))<0
+      || ftruncate( job.out, GridHeaderLen
+                    + (off_t)job.nx*job.ny*sizeof( int ) )!=0 )
+  {
+    printf("Unable to open '%s' or create '%s'\n", d8file, outfile );
+    exit(1);
+  }
+
+  /* Number the perimeter cells of the tiles */
+  job.tile = tile;
+  job.ntx = (job.nx + tile-1)/tile;
+  job.nty = (job.ny + tile-1)/tile;
+  job.base = (long long *)malloc( job.ntx*job.nty*sizeof( long long ) );
+  for( k=0; k<job.ntx*job.nty; k++ )
+  {
+    w = job.nx - (k/job.nty)*tile;
+    h = job.ny - (k%job.nty)*tile;
+    job.base[k] = nnodes;
+    nnodes += PerimCount( w<tile ? w : tile, h<tile ? h : tile );
+  }
+  job.next = (long long *)malloc( nnodes*sizeof( long long ) );
+  job.exitarea = (long long *)malloc( nnodes*sizeof( long long ) );
+  if( job.next==NULL || job.exitarea==NULL )
+  {
+    printf("Unable to allocate the tile perimeter graph\n");
+    exit(1);
+  }
+  pthread_mutex_init( &job.lock, NULL );
+  job.nloop = 0;
+
+  printf( "Pass 1 over %ld tiles...\n", job.ntx*job.nty );
+  RunPass( &job, 1, nthreads );
+  SolvePerimeter( &job, nnodes );
+  free( job.exitarea );
+  free( job.next );
+  printf( "Pass 2...\n" );
+  RunPass( &job, 2, nthreads );
+
+  pthread_mutex_destroy( &job.lock );
+  free( job.inflow );
+  free( job.looped );
+  free( job.base );
+  close( job.in );
+  close( job.out );
+  return job.nloop;
+}
@@ -0,0 +1,11 @@
+/*
+**  tileacc.h: Out-of-core flow accumulation, a tile at a time.
+*/
+
+#ifndef TILEACC_H
+#define TILEACC_H
+
+long AccumulateFlowTiled( char *d8file, char *outfile, long tile,
+                          int nthreads );
+
+#endif
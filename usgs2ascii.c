@@ -1,28 +1,269 @@
-/* usgs2ascii: attempt to convert a USGS DEM file to plain ascii */
+/* usgs2ascii: converts a USGS DEM file to a binary grid of elevations
+**
+** A USGS DEM is a Record A, giving the corners, resolution and number of
+** profiles, followed by one Record B per profile: a column of elevations
+** running south to north, with the coordinates of its first point. Each
+** record is padded out to a 1024-byte block (some files also end each
+** block with a line break), and all the fields are fixed width, so the
+** numbers are read from their places in the block rather than by
+** looking for white space; real numbers may have Fortran D exponents.
+**
+** The file is mapped into memory. One pass over the profile headers
+** finds where each profile starts, which fixes the size of the grid, and
+** then the profiles are parsed straight into the grid on --threads N
+** threads, each taking a band of them. The grid is written as a binary
+** file of short elevations, with a header, the kind flowdir reads,
+** with cells the DEM has no elevation for set to -32767. Each profile
+** becomes the column of the grid for its easting, starting at the row for
+** the northing of its first point. Given --compress N, the grid is
+** compressed in N by N tiles (see gridcodec.h).
+**
+** (There is no ascii any more, in spite of the name: the grid goes
+** straight to binary.)
+*/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "demgrid.h"
+#include "asciigrid.h"
 
-main()
-{
-  FILE *fp, *fpout;
-  char header[1170];
-  char achar;
-  char achunk[10];
-  int i;
-
-  fp = fopen("mariposae.dem","r");
-  fpout = fopen("mariposa.ascii","w");
-  fprintf(fpout,"north:                   4342700.00\n");
-  fprintf(fpout,"south:                   4334280.00\n");
-  fprintf(fpout,"east:                     690700.00\n");
-  fprintf(fpout,"west:                     685420.00\n");
-  fprintf(fpout,"rows:                       1201\n");
-  fprintf(fpout,"cols:                       1201\n");
-  fread( header, sizeof( header ), 1, fp );
-  for( i=1; i<=983947; i++ ) {
-    fread( achunk, sizeof( achunk ), 1, fp );
-    fwrite( achunk, sizeof( achunk ), 1, fpout );
-  } 
-  fclose(fp);
+#define BlockLen 1024      /* Length of a logical record */
+#define FirstElevs 146     /* Elevations in the first block of a profile */
+#define MoreElevs 170      /* ...and in each block after that */
+#define VoidElev -32767    /* USGS code for a point with no elevation */
 
+/* Where each profile is, and where its elevations go */
+typedef struct
+{
+  char *rec;             /* Its first block */
+  long m;                /* Number of elevations */
+  double x, y;           /* Coordinates of the first elevation */
+  double datum;          /* Added to each elevation */
+  long col, row;         /* Cell of the first elevation */
+} Profile;
+
+char *dem, *demend;      /* The DEM file, mapped into memory */
+char *demname;
+long reclen;             /* BlockLen, plus any line break after a block */
+double dx, dy, dz;       /* Spatial resolution */
+Profile *prof;
+long nprof;
+Grid *elev;
+long ctile;              /* Tile width to compress in (--compress N) */
+
+
+/*
+** FieldLong: the integer in the |w| characters at |p|; blank is 0.
+*/
+long FieldLong( p, w )
+char *p;
+int w;
+{
+  char *end = p + w;
+  long v = 0;
+  int neg = 0;
+
+  while( p<end && *p==' ' ) p++;
+  if( p<end && (*p=='-' || *p=='+') ) neg = (*p++=='-');
+  while( p<end && *p>='0' && *p<='9' ) v = v*10 + (*p++ - '0');
+  return neg ? -v : v;
+}
+
+
+/*
+** FieldDouble: the real number in the |w| characters at |p|, which may
+** have an exponent of E or D; blank is 0.
+*/
+double FieldDouble( p, w )
+char *p;
+int w;
+{
+  char *end = p + w;
+  double v;
+
+  while( p<end && *p==' ' ) p++;
+  if( p==end ) return 0;
+  if( ScanFloat( p, end, 1, &v )==NULL ) {
+    printf("Bad number '%.*s' in '%s'\n", w, p, demname );
+    exit(1);
+  }
+  return v;
+}
+
+
+/*
+** Block: the |b|th block of the file, or NULL if the file ends first.
+*/
+char *Block( b )
+long b;
+{
+  return b*reclen+BlockLen <= demend-dem ? dem + b*reclen : NULL;
+}
+
+
+/*
+** ReadRecordA: reads the resolution and number of profiles, and works
+** out the length of a record.
+*/
+void ReadRecordA()
+{
+  if( demend-dem < BlockLen ) {
+    printf("'%s' is too short to be a USGS DEM\n", demname );
+    exit(1);
+  }
+  reclen = BlockLen;
+  if( demend-dem > BlockLen && dem[BlockLen]=='\n' ) reclen = BlockLen+1;
+  else if( demend-dem > BlockLen+1 && dem[BlockLen]=='\r'
+           && dem[BlockLen+1]=='\n' ) reclen = BlockLen+2;
+
+  printf("%.40s\n", dem );
+  printf("Ground units %ld, elevation units %ld (0=radians, 1=feet, "
+         "2=meters, 3=arc-seconds)\n", FieldLong( dem+528, 6 ),
+         FieldLong( dem+534, 6 ) );
+  dx = FieldDouble( dem+816, 12 );
+  dy = FieldDouble( dem+828, 12 );
+  dz = FieldDouble( dem+840, 12 );
+  nprof = FieldLong( dem+858, 6 );
+  if( dx<=0 || dy<=0 || dz<=0 || nprof<1 ) {
+    printf("I can't make sense of the Record A of '%s'\n", demname );
+    exit(1);
+  }
+  printf("%ld profiles; resolution %g by %g, elevations in units of %g\n",
+         nprof, dx, dy, dz );
+}
+
+
+/*
+** FindProfiles: reads the header of each profile's Record B, and from
+** them the size of the grid. A profile takes up one block, plus one more
+** for each MoreElevs of its elevations past the first FirstElevs.
+*/
+void FindProfiles( nx, ny )
+long *nx, *ny;
+{
+  long k, b = 1;
+  double xmin = HUGE_VAL, ymin = HUGE_VAL;
+  Profile *p;
+
+  prof = (Profile *)malloc( nprof*sizeof( Profile ) );
+  for( k=0; k<nprof; k++ ) {
+    p = &prof[k];
+    if( (p->rec = Block( b ))==NULL ) {
+      printf("'%s' ends before profile %ld of %ld\n", demname, k+1, nprof );
+      exit(1);
+    }
+    p->m = FieldLong( p->rec+12, 6 ) * FieldLong( p->rec+18, 6 );
+    p->x = FieldDouble( p->rec+24, 24 );
+    p->y = FieldDouble( p->rec+48, 24 );
+    p->datum = FieldDouble( p->rec+72, 24 );
+    if( p->m<0 ) p->m = 0;
+    b += 1 + (p->m>FirstElevs ? (p->m-FirstElevs+MoreElevs-1)/MoreElevs : 0);
+    if( p->m>FirstElevs && Block( b-1 )==NULL ) {
+      printf("'%s' ends in the middle of profile %ld\n", demname, k+1 );
+      exit(1);
+    }
+    if( p->x<xmin ) xmin = p->x;
+    if( p->y<ymin ) ymin = p->y;
+  }
+
+  *nx = *ny = 0;
+  for( k=0; k<nprof; k++ ) {
+    p = &prof[k];
+    p->col = (long)floor( (p->x-xmin)/dx + 0.5 );
+    p->row = (long)floor( (p->y-ymin)/dy + 0.5 );
+    if( p->col+1 > *nx ) *nx = p->col+1;
+    if( p->row+p->m > *ny ) *ny = p->row+p->m;
+  }
+  printf("The grid is %ld columns by %ld rows; its southwest cell is at "
+         "(%.2f, %.2f)\n", *nx, *ny, xmin, ymin );
+}
+
+
+/*
+** ParseBand: parses the elevations of profiles b->lo to b->hi-1 into
+** their columns of the grid, counting the points with no elevation in
+** b->count[0].
+*/
+void ParseBand( b )
+GridBand *b;
+{
+  Profile *p;
+  char *q;
+  long k, n, v;
+  double e;
+
+  for( k=b->lo; k<b->hi; k++ ) {
+    p = &prof[k];
+    q = p->rec + 144;
+    for( n=0; n<p->m; n++ ) {
+      if( n>=FirstElevs && (n-FirstElevs)%MoreElevs==0 )
+        q = p->rec + (1 + (n-FirstElevs)/MoreElevs)*reclen;
+      v = FieldLong( q, 6 );
+      q += 6;
+      if( v==VoidElev ) {
+        b->count[0]++;
+        continue;
+      }
+      e = floor( p->datum + dz*v + 0.5 );
+      GCELL(elev,short,p->col,p->row+n) =
+        e<-32767 ? -32767 : e>32767 ? 32767 : (short)e;
+    }
+  }
+}
+
+
+main( argc, argv )
+int argc;
+char **argv;
+{
+  int nthreads, fd;
+  long nx, ny, count[4] = { 0, 0, 0, 0 };
+  short voidelev = VoidElev;
+  double nodata = VoidElev;
+  struct stat st;
+
+  nthreads = ThreadsOption( &argc, argv );
+  ctile = CompressOption( &argc, argv );
+  if( argc<3 ) {
+    printf("USAGE: %s <USGS DEM file> <output elevation file> [--threads N] [--compress N]\n",
+           argv[0] );
+    exit(1);
+  }
+
+  /* Map the DEM */
+  demname = argv[1];
+  if( (fd = open( demname, O_RDONLY ))<0 || fstat( fd, &st )!=0 ) {
+    printf("Unable to find '%s'\n", demname );
+    exit(0);
+  }
+  dem = (char *)mmap( NULL, st.st_size>0 ? st.st_size : 1, PROT_READ,
+                      MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( dem==MAP_FAILED ) {
+    printf("Unable to read '%s'\n", demname );
+    exit(1);
+  }
+  demend = dem + st.st_size;
+  madvise( dem, st.st_size, MADV_WILLNEED );
+
+  ReadRecordA();
+  FindProfiles( &nx, &ny );
+
+  /* Parse the profiles into the grid */
+  elev = NewGrid( nx, ny, sizeof( short ) );
+  FillGrid( elev, &voidelev );
+  RunBands( 0, nprof, nthreads, ParseBand, NULL, count );
+  if( count[0]>0 )
+    printf("%ld points have no elevation\n", count[0] );
+
+  WriteGridFile( argv[2], elev, GridInt16, &nodata, dx==dy ? dx : 0, ctile,
+                 nthreads );
+  munmap( dem, st.st_size );
+  printf("All done!\n");
 }